@@ -9,6 +9,8 @@ require "compiler/constants"
 require "compiler/error"
 require "compiler/utils"
 require "compiler/npm_package"
+require "compiler/path_index"
+require "compiler/resolve_map"
 require 'shellwords'
 require 'tmpdir'
 require 'fileutils'
@@ -108,6 +110,7 @@ class Compiler
       @options[:output] ||= 'a.out'
     end
     @options[:output] = File.expand_path(@options[:output])
+    @options[:runtime] = File.expand_path(@options[:runtime]) if @options[:runtime]
 
     @options[:tmpdir] ||= File.expand_path("nodec", Dir.tmpdir)
     @options[:tmpdir] = File.expand_path(@options[:tmpdir])
@@ -117,6 +120,45 @@ class Compiler
       @npm_package = NpmPackage.new(@options)
     end
     
+    @options[:squash_comp] ||= 'gzip'
+    unless SQUASH_COMPRESSORS.has_key?(@options[:squash_comp])
+      raise Error, "Unknown --squash-comp #{@options[:squash_comp]}, expecting one of #{SQUASH_COMPRESSORS.keys.join(', ')}"
+    end
+
+    if @options[:squash_uncompressed]
+      @options[:squash_uncompressed] = @options[:squash_uncompressed].map { |ext| ext.sub(/\A\./, '') }
+      bad = @options[:squash_uncompressed].reject { |ext| ext =~ /\A[\w+-][\w.+-]*\z/ }
+      raise Error, "Bad --squash-uncompressed extension #{bad.first.inspect}" unless bad.empty?
+    end
+
+    if @options[:squash_profile]
+      @options[:squash_profile] = File.expand_path(@options[:squash_profile])
+      raise Error, "Cannot find --squash-profile #{@options[:squash_profile]}" unless File.file?(@options[:squash_profile])
+    end
+
+    @options[:code_cache] = true if @options[:bytecode]
+
+    if @options[:snapshot]
+      raise Error, "--snapshot compiles V8, which --runtime does not" if @options[:runtime]
+      unless @options[:accept_fixed_hash_seed]
+        msg =  "=== HINT ===\n"
+        msg += "A V8 startup snapshot carries the seed of V8's hash tables, which is then the\n"
+        msg += "same for every run of the product. Whoever knows the binary can craft keys that\n"
+        msg += "all collide, e.g. in a JSON body or the query string, and stall the process:\n"
+        msg += "a hash flooding denial of service, CVE-2017-11499, for which Node.js v8.1.4\n"
+        msg += "turned snapshots off. Pass --accept-fixed-hash-seed along with --snapshot if\n"
+        msg += "the product never handles untrusted input.\n\n"
+        STDERR.puts msg
+        raise Error, "--snapshot fixes the hash seed of the product, it needs --accept-fixed-hash-seed"
+      end
+      @options[:snapshot] = File.expand_path(@options[:snapshot])
+      raise Error, "Cannot find --snapshot #{@options[:snapshot]}" unless File.file?(@options[:snapshot])
+    end
+
+    if @options[:squash_cache_mb] && @options[:squash_cache_mb] < 1
+      raise Error, "--squash-cache-mb should be at least 1"
+    end
+
     if @options[:auto_update_url] || @options[:auto_update_base]
       unless @options[:auto_update_url].length > 0 && @options[:auto_update_base].length > 0
         raise Error, "Please provide both --auto-update-url and --auto-update-base"
@@ -161,14 +203,28 @@ class Compiler
     npm_package_set_entrance if @npm_package
     set_package_json
     msi_prepare if @options[:msi]
-    make_enclose_io_memfs
-    make_enclose_io_vars
-    if Gem.win_platform?
-      compile_win
-    elsif RbConfig::CONFIG['host_os'] =~ /darwin|mac os/i
-      compile_mac
+    # V8 would take the stale cache of a source of the same length
+    Utils.rm_rf(code_cache_dir)
+    make_resolve_map
+    if @options[:runtime]
+      make_runtime unless File.exist?(@options[:runtime])
+      make_squashfs_image
+      append_payload
+      if @options[:code_cache]
+        make_code_cache
+        make_squashfs_image
+        append_payload
+      end
     else
-      compile_linux
+      check_snapshot! if @options[:snapshot]
+      make_enclose_io_memfs
+      make_enclose_io_vars
+      compile(@options[:output])
+      if @options[:code_cache]
+        make_code_cache
+        make_enclose_io_memfs
+        compile(@options[:output], false)
+      end
     end
     if @options[:msi]
       if @options[:debug]
@@ -227,43 +283,163 @@ class Compiler
     end
   end
 
-  def make_enclose_io_memfs
+  # With --resolve-map, resolving require()s of the memfs is a lookup in
+  # this map at runtime, instead of probing paths and reading package.json
+  # files; the map is parsed at the first require() and kept afterwards
+  def make_resolve_map
+    resolve_map = File.join(@work_dir, '__enclose_io_resolve__')
+    Utils.rm_f(resolve_map)
+    return unless @options[:resolve_map]
+    map = ResolveMap.scan(@work_dir_inner)
+    map.write(resolve_map)
+    STDERR.puts "-> Resolved #{map.size} paths of the memfs ahead of require()"
+  end
+
+  def code_cache_dir
+    File.join(@work_dir, '__enclose_io_code_cache__')
+  end
+
+  # The product compiles every .js file of its memfs without running the
+  # application and saves their V8 code cache, which only the very same
+  # V8 accepts; the next image carries it in /__enclose_io_code_cache__.
+  # With --bytecode, the product compiles every function into the cache
+  # rather than the top level only, under --serialize-eager, which only
+  # this run sets; see the Enclose.IO hack after V8::Initialize()
+  def make_code_cache
+    dir = code_cache_dir
+    Utils.rm_rf(dir)
+    # CI keeps the product from checking for updates
+    env = { 'ENCLOSE_IO_PRODUCE_CODE_CACHE' => dir, 'CI' => 'true' }
+    env['ENCLOSE_IO_PRODUCE_CODE_CACHE_EAGER'] = '1' if @options[:bytecode]
+    Utils.run(env, Utils.escape(@options[:output]))
+  end
+
+  def make_squashfs_image
+    mkfs = squash_mkfs
     Utils.chdir(@tmpdir_node) do
       Utils.rm_f('deps/libsquash/sample/enclose_io_memfs.squashfs')
-      Utils.rm_f('deps/libsquash/sample/enclose_io_memfs.c')
+      Utils.run("#{Utils.escape mkfs} #{Utils.escape @work_dir} deps/libsquash/sample/enclose_io_memfs.squashfs #{squash_mkfs_args}")
+    end
+  end
+
+  # libsquash's own image builder, compiled with CMake once per tmpdir
+  def squash_mkfs
+    build_dir = File.join(@tmpdir_node, 'out', 'squash_mkfs')
+    exe = Gem.win_platform? ? File.join(build_dir, 'Release', 'squash_mkfs.exe') : File.join(build_dir, 'squash_mkfs')
+    return exe if File.exist?(exe)
+    Utils.mkdir_p(build_dir)
+    Utils.chdir(build_dir) do
       begin
-        Utils.run("mksquashfs -version")
+        Utils.run("cmake #{Utils.escape File.join(@tmpdir_node, 'deps', 'libsquash')} -DBUILD_MKFS=ON -DCMAKE_BUILD_TYPE=Release")
       rescue => e
         msg =  "=== HINT ===\n"
-        msg += "Failed exectuing mksquashfs. Have you installed SquashFS Tools?\n"
-        msg += "- On Windows, you could download it from https://github.com/pmq20/squashfuse/files/691217/sqfs43-win32.zip\n"
-        msg += "- On macOS, you could install by using brew: brew install squashfs\n"
-        msg += "- On Linux, you could install via apt or yum, or build from source after downloading source from http://squashfs.sourceforge.net/\n\n"
+        msg += "Failed exectuing cmake. Have you installed CMake?\n"
+        msg += "- On Windows, you could download it from https://cmake.org/download/\n"
+        msg += "- On macOS, you could install by using brew: brew install cmake\n"
+        msg += "- On Linux, you could install via apt or yum\n\n"
         STDERR.puts msg
         raise e
       end
-      Utils.run("mksquashfs #{Utils.escape @work_dir} deps/libsquash/sample/enclose_io_memfs.squashfs")
-      bytes = IO.binread('deps/libsquash/sample/enclose_io_memfs.squashfs').bytes
+      Utils.run("cmake --build . --config Release --target squash_mkfs")
+    end
+    exe
+  end
+
+  def make_enclose_io_memfs
+    make_squashfs_image
+    Utils.chdir(@tmpdir_node) do
+      Utils.rm_f('deps/libsquash/sample/enclose_io_memfs.c')
       # remember to change libsquash's sample/enclose_io_memfs.c as well
       File.open("deps/libsquash/sample/enclose_io_memfs.c", "w") do |f|
         f.puts '#include <stdint.h>'
         f.puts '#include <stddef.h>'
         f.puts '#include "squash.h"'
         f.puts 'sqfs *enclose_io_fs;'
-        f.puts "const uint8_t enclose_io_memfs[#{bytes.size}] = { #{bytes[0]}"
-        i = 1
-        while i < bytes.size
-          f.print ','
-          f.puts bytes[(i)..(i + 100)].join(',')
-          i += 101
+        if Gem.win_platform?
+          write_enclose_io_memfs_array(f, 'deps/libsquash/sample/enclose_io_memfs.squashfs')
+        else
+          write_enclose_io_memfs_incbin(f, File.expand_path('deps/libsquash/sample/enclose_io_memfs.squashfs'))
         end
-        f.puts '};'
+        f.puts ''
+        PathIndex.scan(@work_dir).write(f, 'enclose_io_memfs_index', 'deps/libsquash/sample/enclose_io_memfs.squashfs')
         f.puts ''
       end
     end
   end
 
+  # MSVC has no inline assembly on x64, so the image is still spelled out
+  def write_enclose_io_memfs_array(f, image)
+    bytes = IO.binread(image).bytes
+    f.puts "const uint8_t enclose_io_memfs[#{bytes.size}] = { #{bytes[0]}"
+    i = 1
+    while i < bytes.size
+      f.print ','
+      f.puts bytes[(i)..(i + 100)].join(',')
+      i += 101
+    end
+    f.puts '};'
+  end
+
+  # The assembler copies the image into a page-aligned read-only section of its own,
+  # instead of the C compiler parsing it as integer literals
+  def write_enclose_io_memfs_incbin(f, image)
+    f.puts '#ifdef __APPLE__'
+    f.puts '#define ENCLOSE_IO_MEMFS_SECTION "__TEXT,__const"'
+    f.puts '#define ENCLOSE_IO_MEMFS_SYMBOL "_enclose_io_memfs"'
+    f.puts '#else'
+    f.puts '#define ENCLOSE_IO_MEMFS_SECTION ".rodata.enclose_io_memfs,\\"a\\""'
+    f.puts '#define ENCLOSE_IO_MEMFS_SYMBOL "enclose_io_memfs"'
+    f.puts '#endif'
+    f.puts '__asm__('
+    f.puts '  ".pushsection " ENCLOSE_IO_MEMFS_SECTION "\\n"'
+    f.puts '  ".globl " ENCLOSE_IO_MEMFS_SYMBOL "\\n"'
+    f.puts '  ".p2align 12\\n"'
+    f.puts '  ENCLOSE_IO_MEMFS_SYMBOL ":\\n"'
+    f.puts "  #{".incbin #{image.inspect}\n".inspect}"
+    f.puts '  ".popsection\\n"'
+    f.puts ');'
+    f.puts 'extern const uint8_t enclose_io_memfs[];'
+  end
+
   def make_enclose_io_vars
+    write_enclose_io_h do |f|
+      if Gem.win_platform?
+        f.puts "#define ENCLOSE_IO_ENTRANCE L#{mempath(@entrance).inspect}"
+        squash_root_alias, squash_root_alias2 = squash_root_aliases
+        f.puts "#define ENCLOSE_IO_ROOT_ALIAS #{squash_root_alias.inspect}"
+        if squash_root_alias2
+          f.puts "#define ENCLOSE_IO_ROOT_ALIAS2 #{squash_root_alias2.inspect}"
+        end
+      else
+        f.puts "#define ENCLOSE_IO_ENTRANCE #{mempath(@entrance).inspect}"
+      end
+      if @options[:squash_cache_mb]
+        f.puts "#define ENCLOSE_IO_SQUASH_CACHE_MB #{@options[:squash_cache_mb]}"
+      end
+      f.puts "#define ENCLOSE_IO_PATH_INDEX 1"
+      if @options[:auto_update_url] && @options[:auto_update_base]
+        f.puts "#define ENCLOSE_IO_AUTO_UPDATE 1"
+        f.puts "#define ENCLOSE_IO_AUTO_UPDATE_BASE #{@options[:auto_update_base].inspect}"
+        urls = auto_update_url_parts
+        port = urls[3]
+        f.puts "#define ENCLOSE_IO_AUTO_UPDATE_URL_Scheme #{urls[0].inspect}" if urls[0]
+        f.puts "#define ENCLOSE_IO_AUTO_UPDATE_URL_Userinfo #{urls[1].inspect}" if urls[1]
+        f.puts "#define ENCLOSE_IO_AUTO_UPDATE_URL_Host #{urls[2].inspect}" if urls[2]
+        if Gem.win_platform?
+          f.puts "#define ENCLOSE_IO_AUTO_UPDATE_URL_Port #{port.to_s.inspect}"
+        else
+          f.puts "#define ENCLOSE_IO_AUTO_UPDATE_URL_Port #{port}"
+        end
+        f.puts "#define ENCLOSE_IO_AUTO_UPDATE_URL_Registry #{urls[4].inspect}" if urls[4]
+        f.puts "#define ENCLOSE_IO_AUTO_UPDATE_URL_Path #{urls[5].inspect}" if urls[5]
+        f.puts "#define ENCLOSE_IO_AUTO_UPDATE_URL_Opaque #{urls[6].inspect}" if urls[6]
+        f.puts "#define ENCLOSE_IO_AUTO_UPDATE_URL_Query #{urls[7].inspect}" if urls[7]
+        f.puts "#define ENCLOSE_IO_AUTO_UPDATE_URL_Fragment #{urls[8].inspect}" if urls[8]
+      end
+    end
+  end
+
+  def write_enclose_io_h
     Utils.chdir(@tmpdir_node) do
       File.open("deps/libsquash/sample/enclose_io.h", "w") do |f|
         # remember to change libsquash's sample/enclose_io.h as well
@@ -274,78 +450,190 @@ class Compiler
         f.puts '#include "enclose_io_common.h"'
         f.puts '#include "enclose_io_win32.h"'
         f.puts '#include "enclose_io_unix.h"'
-        if Gem.win_platform?
-          f.puts "#define ENCLOSE_IO_ENTRANCE L#{mempath(@entrance).inspect}"
-          # TODO remove this dirty hack some day
-          squash_root_alias = @work_dir
-          squash_root_alias += '/' unless '/' == squash_root_alias[-1]
-          raise 'logic error' unless ':/' == squash_root_alias[1..2]
-          squash_root_alias = "/cygdrive/#{squash_root_alias[0].downcase}/#{squash_root_alias[3..-1]}"
-          f.puts "#define ENCLOSE_IO_ROOT_ALIAS #{squash_root_alias.inspect}"
-          squash_root_alias2 = squash_root_alias[11..-1]
-          if squash_root_alias2 && squash_root_alias2.length > 1
-            f.puts "#define ENCLOSE_IO_ROOT_ALIAS2 #{squash_root_alias2.inspect}"
-          end
-        else
-          f.puts "#define ENCLOSE_IO_ENTRANCE #{mempath(@entrance).inspect}"
-        end
-        if @options[:auto_update_url] && @options[:auto_update_base]
-          f.puts "#define ENCLOSE_IO_AUTO_UPDATE 1"
-          f.puts "#define ENCLOSE_IO_AUTO_UPDATE_BASE #{@options[:auto_update_base].inspect}"
-          urls = URI.split(@options[:auto_update_url])
-          raise 'logic error' unless 9 == urls.length
-          port = urls[3]
-          if port.nil?
-            if 'https' == urls[0]
-              port = 443
-            else
-              port = 80
-            end
-          end
-          f.puts "#define ENCLOSE_IO_AUTO_UPDATE_URL_Scheme #{urls[0].inspect}" if urls[0]
-          f.puts "#define ENCLOSE_IO_AUTO_UPDATE_URL_Userinfo #{urls[1].inspect}" if urls[1]
-          f.puts "#define ENCLOSE_IO_AUTO_UPDATE_URL_Host #{urls[2].inspect}" if urls[2]
-          if Gem.win_platform?
-            f.puts "#define ENCLOSE_IO_AUTO_UPDATE_URL_Port #{port.to_s.inspect}"
-          else
-            f.puts "#define ENCLOSE_IO_AUTO_UPDATE_URL_Port #{port}"
-          end
-          f.puts "#define ENCLOSE_IO_AUTO_UPDATE_URL_Registry #{urls[4].inspect}" if urls[4]
-          f.puts "#define ENCLOSE_IO_AUTO_UPDATE_URL_Path #{urls[5].inspect}" if urls[5]
-          f.puts "#define ENCLOSE_IO_AUTO_UPDATE_URL_Opaque #{urls[6].inspect}" if urls[6]
-          f.puts "#define ENCLOSE_IO_AUTO_UPDATE_URL_Query #{urls[7].inspect}" if urls[7]
-          f.puts "#define ENCLOSE_IO_AUTO_UPDATE_URL_Fragment #{urls[8].inspect}" if urls[8]
-        end
+        yield f
         f.puts '#endif'
         f.puts ''
       end
     end
   end
 
-  def compile_win
+  # TODO remove this dirty hack some day
+  def squash_root_aliases
+    squash_root_alias = @work_dir
+    squash_root_alias += '/' unless '/' == squash_root_alias[-1]
+    raise 'logic error' unless ':/' == squash_root_alias[1..2]
+    squash_root_alias = "/cygdrive/#{squash_root_alias[0].downcase}/#{squash_root_alias[3..-1]}"
+    squash_root_alias2 = squash_root_alias[11..-1]
+    squash_root_alias2 = nil unless squash_root_alias2 && squash_root_alias2.length > 1
+    [squash_root_alias, squash_root_alias2]
+  end
+
+  # URI.split of --auto-update-url, with the port filled in
+  def auto_update_url_parts
+    urls = URI.split(@options[:auto_update_url])
+    raise 'logic error' unless 9 == urls.length
+    if urls[3].nil?
+      if 'https' == urls[0]
+        urls[3] = 443
+      else
+        urls[3] = 80
+      end
+    end
+    urls
+  end
+
+  # A Node.js runtime without any application, which finds its memfs
+  # appended to itself; built once, then reused by every --runtime build
+  def make_runtime
+    STDERR.puts "-> Building the runtime #{@options[:runtime]}, which takes a while but only once"
+    Utils.chdir(@tmpdir_node) do
+      File.open("deps/libsquash/sample/enclose_io_memfs.c", "w") do |f|
+        f.puts '#include <stdint.h>'
+        f.puts '#include <stddef.h>'
+        f.puts '#include "squash.h"'
+        f.puts 'sqfs *enclose_io_fs;'
+        f.puts 'const uint8_t enclose_io_memfs[1] = { 0 };'
+      end
+    end
+    write_enclose_io_h do |f|
+      f.puts "#define ENCLOSE_IO_APPENDED 1"
+      if Gem.win_platform?
+        f.puts "#define ENCLOSE_IO_ENTRANCE ((wchar_t *)enclose_io_payload.wentrance)"
+        f.puts "#define ENCLOSE_IO_ROOT_ALIAS (enclose_io_payload.root_alias)"
+        f.puts "#define ENCLOSE_IO_ROOT_ALIAS2 (enclose_io_payload.root_alias2)"
+      else
+        f.puts "#define ENCLOSE_IO_ENTRANCE ((char *)enclose_io_payload.entrance)"
+      end
+    end
+    Utils.mkdir_p(File.dirname(@options[:runtime]))
+    compile(@options[:runtime])
+  end
+
+  # Appends the memfs and the settings that would otherwise be compiled
+  # into enclose_io.h to a copy of the runtime,
+  # see libsquash's sample/enclose_io_common.h for the layout
+  def append_payload
+    image = File.join(@tmpdir_node, 'deps/libsquash/sample/enclose_io_memfs.squashfs')
+    settings = payload_settings.map { |key, value| "#{key}\0#{value}\0" }.join.b
+    Utils.cp(@options[:runtime], @options[:output])
+    File.open(@options[:output], 'ab') do |f|
+      # the image starts on a page of its own
+      padding = -f.size % 4096
+      f.write("\0" * padding)
+      image_offset = f.size
+      image_size = IO.copy_stream(image, f)
+      settings_offset = image_offset + image_size
+      f.write(settings)
+      f.write([PAYLOAD_TRAILER_MAGIC, image_offset, image_size, settings_offset, settings.bytesize].pack('a8Q<Q<Q<Q<'))
+    end
+    File.chmod(0755, @options[:output]) unless Gem.win_platform?
+  end
+
+  def payload_settings
+    settings = { 'entrance' => mempath(@entrance) }
+    if Gem.win_platform?
+      squash_root_alias, squash_root_alias2 = squash_root_aliases
+      settings['root_alias'] = squash_root_alias
+      settings['root_alias2'] = squash_root_alias2 if squash_root_alias2
+    end
+    settings['squash_cache_mb'] = @options[:squash_cache_mb] if @options[:squash_cache_mb]
+    if @options[:auto_update_url] && @options[:auto_update_base]
+      urls = auto_update_url_parts
+      settings['auto_update_host'] = urls[2]
+      settings['auto_update_port'] = urls[3]
+      settings['auto_update_path'] = urls[5]
+      settings['auto_update_base'] = @options[:auto_update_base]
+    end
+    settings
+  end
+
+  # Data blocks of files with the --squash-uncompressed extensions are
+  # stored as they are, and without fragments, so that libsquash's
+  # squash_map() can hand them out without copying.
+  # Files listed in the --squash-profile are laid out first, in the order
+  # a previous product read them at startup.
+  # With --squash-uncompressed-metadata, looking up paths reads the inode
+  # and directory tables straight out of the binary.
+  # The content hash of every file is recorded, so that SQUASH_EXTRACT_CACHE
+  # finds what an earlier run extracted without hashing it again.
+  def squash_mkfs_args
+    args = "-comp #{@options[:squash_comp]} -content-hashes"
+    exts = @options[:squash_uncompressed]
+    args += " -uncompressed #{Utils.escape exts.join(',')}" if exts && exts.length > 0
+    args += " -profile #{Utils.escape @options[:squash_profile]}" if @options[:squash_profile]
+    args += " -uncompressed-metadata" if @options[:squash_uncompressed_metadata]
+    args
+  end
+
+  # The --snapshot script is run by mksnapshot in a bare V8 context, before
+  # Node.js exists, so it is tried the same way first for a readable error
+  def check_snapshot!
+    check = "require('vm').runInNewContext(require('fs').readFileSync(process.argv[1], 'utf8'), Object.create(null), { filename: process.argv[1] })"
+    begin
+      Utils.run("node -e #{Utils.escape check} #{Utils.escape @options[:snapshot]}")
+    rescue Error
+      msg =  "=== HINT ===\n"
+      msg += "The --snapshot script cannot use require, process, Buffer, console, timers or\n"
+      msg += "any other Node.js API, nor hold files, sockets or native addons: it runs\n"
+      msg += "before Node.js starts, and only what it leaves in the global object is saved.\n\n"
+      STDERR.puts msg
+      raise Error, "Failed running the --snapshot #{@options[:snapshot]} in a bare context"
+    end
+  end
+
+  # Enables the decompressor of the chosen codec in libsquash,
+  # and embeds the --snapshot script into V8's startup snapshot
+  def gyp_env
+    defines = []
+    variable = SQUASH_COMPRESSORS[@options[:squash_comp]]
+    defines << "#{variable}=1" if variable
+    defines << "embed_script=#{Utils.escape @options[:snapshot]}" if @options[:snapshot]
+    return {} if defines.empty?
+    env = { 'GYP_DEFINES' => [ENV['GYP_DEFINES'], *defines].compact.join(' ') }
+    # read by vcbuild.bat
+    env['config_flags'] = [ENV['config_flags'], '--with-snapshot'].compact.join(' ') if @options[:snapshot] && Gem.win_platform?
+    env
+  end
+
+  def configure_args
+    @options[:snapshot] ? '--with-snapshot' : ''
+  end
+
+  # Without configure, only the memfs is compiled again and linked
+  def compile(target, configure = true)
+    if Gem.win_platform?
+      compile_win(target, configure)
+    elsif RbConfig::CONFIG['host_os'] =~ /darwin|mac os/i
+      compile_mac(target, configure)
+    else
+      compile_linux(target, configure)
+    end
+  end
+
+  def compile_win(target, configure = true)
     Utils.chdir(@tmpdir_node) do
-      Utils.run("call vcbuild.bat #{@options[:debug] ? 'debug' : ''} #{@options[:vcbuild_args]}")
+      Utils.run(gyp_env, "call vcbuild.bat #{@options[:debug] ? 'debug' : ''} #{configure ? '' : 'noprojgen'} #{@options[:vcbuild_args]}")
     end
     src = File.join(@tmpdir_node, (@options[:debug] ? 'Debug\\node.exe' : 'Release\\node.exe'))
-    Utils.cp(src, @options[:output])
+    Utils.cp(src, target)
   end
 
-  def compile_mac
+  def compile_mac(target, configure = true)
     Utils.chdir(@tmpdir_node) do
-      Utils.run("./configure #{@options[:debug] ? '--debug --xcode' : ''}")
-      Utils.run("make #{@options[:make_args]}")
+      Utils.run(gyp_env, "./configure #{@options[:debug] ? '--debug --xcode' : ''} #{configure_args}") if configure
+      Utils.run(gyp_env, "make #{@options[:make_args]}")
     end
     src = File.join(@tmpdir_node, "out/#{@options[:debug] ? 'Debug' : 'Release'}/node")
-    Utils.cp(src, @options[:output])
+    Utils.cp(src, target)
   end
 
-  def compile_linux
+  def compile_linux(target, configure = true)
     Utils.chdir(@tmpdir_node) do
-      Utils.run("./configure #{@options[:debug] ? '--debug' : ''}")
-      Utils.run("make #{@options[:make_args]}")
+      Utils.run(gyp_env, "./configure #{@options[:debug] ? '--debug' : ''} #{configure_args}") if configure
+      Utils.run(gyp_env, "make #{@options[:make_args]}")
     end
     src = File.join(@tmpdir_node, "out/#{@options[:debug] ? 'Debug' : 'Release'}/node")
-    Utils.cp(src, @options[:output])
+    Utils.cp(src, target)
   end
 
   def mempath(path)
@@ -9,4 +9,14 @@ class Compiler
   VERSION = '1.3.0'
   PRJ_ROOT = File.expand_path('../../..', __FILE__)
   MEMFS = '/__enclose_io_memfs__'
+  # --squash-comp codec => GYP variable enabling its decompressor in libsquash
+  SQUASH_COMPRESSORS = {
+    'gzip' => nil,
+    'lz4' => 'libsquash_lz4',
+    'zstd' => 'libsquash_zstd',
+    'xz' => 'libsquash_xz',
+    'lzo' => 'libsquash_lzo',
+  }
+  # ends a runtime with an appended memfs, see sample/enclose_io_common.h of libsquash
+  PAYLOAD_TRAILER_MAGIC = 'ENCLOSE1'
 end
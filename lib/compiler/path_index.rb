@@ -0,0 +1,124 @@
+# Copyright (c) 2017 Minqi Pan <pmq2001@gmail.com>
+#                    Yuwei Ba <xiaobayuwei@gmail.com>
+#                    Alessandro Agosto <agosto.alessandro@gmail.com>
+# 
+# This file is part of Node.js Compiler, distributed under the MIT License
+# For full terms see the included LICENSE file
+
+require 'find'
+
+class Compiler
+  # Minimal perfect hash of every path of the squashfs image, emitted into
+  # enclose_io_memfs.c next to the image. libsquash consults it before
+  # walking directories, so that looking up a path that does not exist
+  # costs one probe. See libsquash's include/squash/index.h for the layout.
+  class PathIndex
+    OTHER = 0
+    DIR = 1
+    LINK = 2
+
+    # Must match sqfs_path_index_hash()
+    def self.hash(seed, key)
+      h = 2166136261 ^ seed
+      key.each_byte do |c|
+        h = ((h ^ c) * 16777619) & 0xffffffff
+      end
+      # the finalizer of MurmurHash3, so that the low bits depend on
+      # every bit of the seed and of the path
+      h ^= h >> 16
+      h = (h * 0x85ebca6b) & 0xffffffff
+      h ^= h >> 13
+      h = (h * 0xc2b2ae35) & 0xffffffff
+      h ^ (h >> 16)
+    end
+
+    # entries are [path, type] pairs, path being absolute within the image
+    def initialize(entries)
+      @entries = entries
+      build
+    end
+
+    # Every path under dir, which is the root of the image
+    def self.scan(dir)
+      entries = [['/', DIR]]
+      Find.find(dir) do |path|
+        next if path == dir
+        st = File.lstat(path)
+        type = if st.symlink? then LINK elsif st.directory? then DIR else OTHER end
+        entries << [path[dir.size..-1].b, type]
+      end
+      new(entries)
+    end
+
+    # Writes the index as sqfs_path_index name for the image in image_path
+    def write(f, name, image_path)
+      sb = IO.binread(image_path, 48)
+      mkfs_time = sb[8, 4].unpack('V').first
+      bytes_used = sb[40, 8].unpack('Q<').first
+      f.puts "static const char * const #{name}_paths[#{@slots.size}] = {"
+      @slots.each { |i| f.puts "#{c_string(@entries[i][0])}," }
+      f.puts '};'
+      f.puts "static const uint8_t #{name}_types[#{@slots.size}] = {"
+      @slots.each_slice(100) { |slice| f.puts slice.map { |i| @entries[i][1] }.join(',') + ',' }
+      f.puts '};'
+      f.puts "static const int32_t #{name}_displacements[#{@displacements.size}] = {"
+      @displacements.each_slice(100) { |slice| f.puts slice.join(',') + ',' }
+      f.puts '};'
+      f.puts "const sqfs_path_index #{name} = {"
+      f.puts "  #{mkfs_time}U, #{bytes_used}ULL, #{@slots.size},"
+      f.puts "  #{name}_displacements, #{name}_paths, #{name}_types"
+      f.puts '};'
+    end
+
+    private
+
+    # Hash and displace: place the largest buckets first, each with the
+    # smallest seed that sends all its paths to free slots, then fill the
+    # remaining slots with the buckets of a single path
+    def build
+      n = @entries.size
+      buckets = Array.new(n) { [] }
+      @entries.each_with_index do |(path, _), i|
+        buckets[PathIndex.hash(0, path) % n] << i
+      end
+      @displacements = Array.new(n, 0)
+      @slots = Array.new(n)
+      order = (0...n).sort_by { |b| [-buckets[b].size, b] }
+      order.each do |b|
+        items = buckets[b]
+        break if items.size <= 1
+        seed = 1
+        loop do
+          slots = items.map { |i| PathIndex.hash(seed, @entries[i][0]) % n }
+          if slots.uniq.size == slots.size && slots.all? { |s| @slots[s].nil? }
+            slots.zip(items).each { |s, i| @slots[s] = i }
+            @displacements[b] = seed
+            break
+          end
+          seed += 1
+          raise Error, 'Failed building the path index' if seed > 0x7fffffff
+        end
+      end
+      free = (0...n).select { |s| @slots[s].nil? }
+      order.each do |b|
+        next unless 1 == buckets[b].size
+        s = free.shift
+        @slots[s] = buckets[b].first
+        @displacements[b] = -s - 1
+      end
+      raise 'logic error' unless free.empty? && @slots.none?(&:nil?)
+    end
+
+    def c_string(str)
+      '"' + str.each_byte.map do |c|
+        if c == 0x22 || c == 0x5c || c == 0x3f
+          "\\#{c.chr}"
+        elsif c >= 0x20 && c < 0x7f
+          c.chr
+        else
+          format('\\%03o', c)
+        end
+      end.join + '"'
+    end
+  end
+end
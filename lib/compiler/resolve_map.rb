@@ -0,0 +1,126 @@
+# Copyright (c) 2017 Minqi Pan <pmq2001@gmail.com>
+#                    Yuwei Ba <xiaobayuwei@gmail.com>
+#                    Alessandro Agosto <agosto.alessandro@gmail.com>
+#
+# This file is part of Node.js Compiler, distributed under the MIT License
+# For full terms see the included LICENSE file
+
+require 'find'
+require 'json'
+
+class Compiler
+  # Where each path of the memfs leads when it is required, worked out the
+  # way Module._findPath of lib/module.js does with the default extensions,
+  # so that the loader looks it up instead of probing the memfs.
+  # Written into the image as /__enclose_io_resolve__, a JSON object whose
+  # keys and values are paths below /__enclose_io_memfs__, a value starting
+  # with '+' being a suffix of its key.
+  # Only what can be required is a key: files with one of EXTS or without
+  # any extension, those without their extension, and directories of a
+  # package.json or an index; anything else is probed as usual.
+  class ResolveMap
+    EXTS = ['.js', '.json', '.node']
+
+    # A path that Node.js would resolve to somewhere outside the memfs,
+    # or fail to resolve with an error; left to the loader
+    class Unresolvable < StandardError; end
+
+    # dir is the directory mounted as /__enclose_io_memfs__
+    def self.scan(dir)
+      map = new(dir)
+      Find.find(map.root) do |path|
+        key = path[map.root.size..-1]
+        ext = File.extname(path)
+        if File.directory?(path)
+          map.add(key)
+        elsif File.file?(path) && (ext.empty? || EXTS.include?(ext))
+          map.add(key)
+          map.add(key[0...-ext.size]) unless ext.empty?
+        end
+      end
+      map
+    end
+
+    attr_reader :root
+
+    def initialize(dir)
+      @root = File.realpath(dir)
+      @map = {}
+      @packages = {}
+    end
+
+    def add(key)
+      return if @map.has_key?(key) || !key.valid_encoding?
+      value = resolve(@root + key)
+      @map[key] = value.start_with?(key) ? "+#{value[key.size..-1]}" : value if value
+    rescue Unresolvable
+      # probed as usual at runtime
+    end
+
+    def size
+      @map.size
+    end
+
+    def write(path)
+      File.write(path, JSON.generate(@map))
+    end
+
+    private
+
+    def resolve(path)
+      if File.file?(path)
+        real(path)
+      elsif File.directory?(path)
+        package(path) || extensions(path) || extensions(File.join(path, 'index'))
+      else
+        extensions(path)
+      end
+    end
+
+    # tryPackage()
+    def package(dir)
+      main = @packages.fetch(dir) do
+        @packages[dir] = package_main(dir)
+      end
+      raise Unresolvable if :error == main
+      return nil unless main
+      filename = File.expand_path(main, dir)
+      file(filename) || extensions(filename) || extensions(File.join(filename, 'index'))
+    end
+
+    # readPackage(), whose JSON.parse(json).main throws on null, and whose
+    # path.resolve() throws on a main that is truthy but not a string
+    def package_main(dir)
+      json = File.join(dir, 'package.json')
+      return nil unless File.exist?(json)
+      return :error unless File.file?(json)
+      pkg = JSON.parse(File.binread(json).force_encoding(Encoding::UTF_8).sub(/\A\uFEFF/, ''))
+      return :error if pkg.nil?
+      main = pkg.is_a?(Hash) ? pkg['main'] : nil
+      return nil if [nil, false, '', 0].include?(main)
+      main.is_a?(String) ? main : :error
+    rescue JSON::ParserError, EncodingError
+      :error
+    end
+
+    # tryExtensions()
+    def extensions(path)
+      EXTS.each do |ext|
+        filename = file(path + ext)
+        return filename if filename
+      end
+      nil
+    end
+
+    # tryFile()
+    def file(path)
+      real(path) if File.file?(path)
+    end
+
+    def real(path)
+      real = File.realpath(path)
+      raise Unresolvable unless real.start_with?("#{@root}/")
+      real[@root.size..-1]
+    end
+  end
+end
@@ -5,6 +5,13 @@
 # For full terms see the included LICENSE file
 
 {
+  'variables': {
+    # Optional decompressors, the libraries have to be installed
+    'libsquash_xz%': 0,
+    'libsquash_lzo%': 0,
+    'libsquash_lz4%': 0,
+    'libsquash_zstd%': 0,
+  },
   'targets': [
     {
       'target_name': 'enclose_io_libsquash',
@@ -20,7 +27,10 @@
         'include/squash/file.h',
         'include/squash/fs.h',
         'include/squash/hash.h',
+        'include/squash/index.h',
+        'include/squash/mkfs.h',
         'include/squash/nonstd.h',
+        'include/squash/pool.h',
         'include/squash/private.h',
         'include/squash/squashfs_fs.h',
         'include/squash/stack.h',
@@ -38,9 +48,16 @@
         'src/file.c',
         'src/fs.c',
         'src/hash.c',
+        'src/index.c',
+        'src/map.c',
+        'src/mkfs.c',
         'src/nonstd-makedev.c',
         'src/nonstd-stat.c',
+        'src/overlay.c',
+        'src/pool.c',
         'src/private.c',
+        'src/profile.c',
+        'src/readahead.c',
         'src/readlink.c',
         'src/scandir.c',
         'src/stack.c',
@@ -52,6 +69,7 @@
         'sample/enclose_io.h',
         'sample/enclose_io_common.h',
         'sample/enclose_io_memfs.c',
+        'sample/enclose_io_payload.c',
         'sample/enclose_io_prelude.h',
         'sample/enclose_io_unix.c',
         'sample/enclose_io_unix.h',
@@ -64,6 +82,24 @@
         'sample',
         '../zlib',
       ],
+      'conditions': [
+        ['libsquash_xz==1', {
+          'defines': [ 'SQFS_HAVE_XZ' ],
+          'link_settings': { 'libraries': [ '-llzma' ] },
+        }],
+        ['libsquash_lzo==1', {
+          'defines': [ 'SQFS_HAVE_LZO' ],
+          'link_settings': { 'libraries': [ '-llzo2' ] },
+        }],
+        ['libsquash_lz4==1', {
+          'defines': [ 'SQFS_HAVE_LZ4' ],
+          'link_settings': { 'libraries': [ '-llz4' ] },
+        }],
+        ['libsquash_zstd==1', {
+          'defines': [ 'SQFS_HAVE_ZSTD' ],
+          'link_settings': { 'libraries': [ '-lzstd' ] },
+        }],
+      ],
     },
   ],
 }
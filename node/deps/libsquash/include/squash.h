@@ -44,17 +44,42 @@
 #include "squash/private.h"
 #include "squash/fdtable.h"
 #include "squash/dirent.h"
+#include "squash/mkfs.h"
+#include "squash/readahead.h"
 
 #define SQUASH_SEEK_SET 0 /* set file offset to offset */
 #define SQUASH_SEEK_CUR 1 /* set file offset to current plus offset */
 #define SQUASH_SEEK_END 2 /* set file offset to EOF plus offset */
 
-#define SQUASH_VALID_VFD(vfd) ((vfd) < squash_global_fdtable.nr && NULL != squash_global_fdtable.fds[(vfd)])
-#define SQUASH_VFD_FILE(vfd) (squash_global_fdtable.fds[(vfd)])
+#define SQUASH_VALID_VFD(vfd) (NULL != squash_vfd_file(vfd))
+#define SQUASH_VFD_FILE(vfd) (squash_vfd_file(vfd))
 
 extern sqfs_err squash_errno;
 
+/*
+ * Sets up the global state, which is torn down at exit. Threads that are
+ * still running then see their virtual file descriptors fail with EBADF.
+ */
 sqfs_err squash_start();
+
+/*
+ * Sets the number of megabytes that the metadata, data and fragment caches
+ * of a SquashFS fs may use altogether, for images opened afterwards.
+ * The budget is shared adaptively: whichever block was used least recently
+ * is evicted first, regardless of the cache it belongs to.
+ * The environment variable SQUASH_CACHE_MB, if set, takes precedence.
+ */
+void squash_set_cache_mb(size_t mb);
+
+/*
+ * Reads the counters of the lookup caches of a SquashFS fs.
+ * Whole paths, looked up by squash_stat, squash_open and friends,
+ * are counted in paths; the path components of the misses in names.
+ * A path that does not exist is cached as well.
+ * Either argument may be NULL.
+ */
+void squash_lookup_stat(sqfs *fs, sqfs_cache_stats *paths,
+	sqfs_cache_stats *names);
 ssize_t squash_readlink_inode(sqfs *fs, sqfs_inode *node, char *buf, size_t bufsize);
 sqfs_err squash_follow_link(sqfs *fs, const char *path, sqfs_inode *node);
 struct squash_file * squash_find_entry(void *ptr);
@@ -118,6 +143,52 @@ int squash_close(int vfd);
  */
 ssize_t squash_read(int vfd, void *buf, sqfs_off_t nbyte);
 
+/*
+ * Acts like squash_read() except that it reads from the position offset
+ * instead of the file pointer of vfd, which is neither used nor changed.
+ * It is therefore safe to call concurrently on the same vfd.
+ * Reading at or beyond end-of-file returns zero.
+ */
+ssize_t squash_pread(int vfd, void *buf, sqfs_off_t nbyte, sqfs_off_t offset);
+
+/*
+ * Acts like squash_read() except that the data is scattered into
+ * the iovcnt buffers described by iov, filling each one in turn.
+ * The blocks of the file are walked only once for all the buffers.
+ */
+ssize_t squash_readv(int vfd, const struct SQUASH_IOVEC *iov, int iovcnt);
+
+/*
+ * Combines squash_pread() and squash_readv().
+ */
+ssize_t squash_preadv(int vfd, const struct SQUASH_IOVEC *iov, int iovcnt, sqfs_off_t offset);
+
+/*
+ * Returns a read-only pointer to the whole content of the file path
+ * of a SquashFS fs, straight out of the image without any copying,
+ * and stores the length of the file in size.
+ * This only works for files whose blocks are all stored uncompressed
+ * and which do not end in a fragment shared with other files,
+ * e.g. with mksquashfs `-action "uncompressed@name(*.node)"`
+ * and `-action "no-fragments@name(*.node)"`.
+ * The pointer stays valid for as long as the image itself and
+ * must neither be written to nor freed.
+ * Otherwise, a value of NULL is returned and error is set to
+ * the reason of the error, which is EINVAL for compressed files.
+ */
+const void *squash_map(sqfs *fs, const char *path, size_t *size);
+
+/*
+ * Reads the whole content of the file path of a SquashFS fs
+ * into a buffer sized after its inode, to be released with free(),
+ * and stores the length of the file in size.
+ * Compressed blocks are decompressed straight into that buffer
+ * unless they are cached already.
+ * Otherwise, a value of NULL is returned and error is set to
+ * the reason of the error.
+ */
+void *squash_readfile(sqfs *fs, const char *path, size_t *size);
+
 /*
  * Repositions the offset of vfs to the argument offset,
  * according to the directive whence.
@@ -173,6 +244,18 @@ int squash_closedir(SQUASH_DIR *dirp);
  */
 struct SQUASH_DIRENT * squash_readdir(SQUASH_DIR *dirp);
 
+/*
+ * Fills buf with as many of the next entries of dirp as fit in nbytes,
+ * each a struct squash_dent with its name and type, so that a whole
+ * directory is read in a few calls without any allocation.
+ * Returns the number of bytes filled, 0 at the end of the directory,
+ * or -1 with errno set to the reason of the error, EINVAL if the next
+ * entry does not fit at all.
+ * It reads on from where it stopped last, apart from squash_readdir():
+ * do not mix the two on one stream.
+ */
+ssize_t squash_getdents(SQUASH_DIR *dirp, void *buf, size_t nbytes);
+
 /*
  * Returns the current location associated with the named directory stream.
  */
@@ -230,6 +313,9 @@ int squash_scandir(sqfs *fs, const char *dirname, struct SQUASH_DIRENT ***nameli
  * Otherwise, a value of `NULL` is returned
  * and `errno` is set to the reason of the error.
  * The returned path is referenced by an internal cache and must not be freed.
+ * On Linux, without `ext_name`, the file is rather created in memory with
+ * memfd_create(2), and the path returned is its link in /proc/self/fd,
+ * the descriptor of which is close-on-exec, see squash_extract_memfd().
  */
 #ifdef _WIN32
 #define SQUASH_OS_PATH const wchar_t*
@@ -241,4 +327,72 @@ SQUASH_OS_PATH squash_tmpf(SQUASH_OS_PATH tmpdir, const char *ext_name);
 SQUASH_OS_PATH squash_extract(sqfs *fs, const char *path, const char *ext_name);
 void squash_extract_clear_cache();
 
+/*
+ * Returns the descriptor of the memfd behind a path of /proc/self/fd
+ * returned by squash_extract(), or -1 for any other path. It is meant for
+ * a forked child to clear its FD_CLOEXEC right before execve(), for the
+ * file it runs or a path it hands over, e.g. a script to its interpreter,
+ * so that no other child inherits the descriptor. Async-signal-safe.
+ */
+int squash_extract_memfd(const char *path);
+
+/*
+ * Sets the number of threads that decompress and write a file
+ * being extracted by squash_extract(), up to 16.
+ * The environment variable SQUASH_EXTRACT_THREADS, if set, takes precedence.
+ */
+#define SQUASH_EXTRACT_THREADS_DEFAULT 4
+void squash_set_extract_threads(size_t threads);
+
+/*
+ * Turns off extracting into memory on Linux, e.g. for a program that is
+ * given the path of the extracted file but closes the descriptors it
+ * inherits.
+ * The environment variable SQUASH_EXTRACT_MEMFD=0 does the same and takes
+ * precedence.
+ */
+void squash_set_extract_memfd(short enabled);
+
+/*
+ * Keeps the files extracted by squash_extract() in dir after the process
+ * exits, named by a hash of their content, so that later processes find
+ * them there instead of extracting them again; "" is libsquash in the
+ * cache directory of the user, e.g. ~/.cache/libsquash, and NULL, the
+ * default, turns it off. The environment variable SQUASH_EXTRACT_CACHE
+ * takes precedence: a directory, 1 for that of the user or 0 for none.
+ * Not on Windows yet.
+ */
+void squash_set_extract_cache(const char *dir);
+
+struct squash_extract_stats {
+	uint64_t files;		/* extracted */
+	uint64_t memfds;	/* of the files, extracted into memory */
+	uint64_t hits;		/* served by the cache of squash_extract() */
+	uint64_t reused;	/* found in the persistent cache, extracted by earlier processes */
+	uint64_t bytes;		/* extracted */
+	uint64_t nanoseconds;	/* spent extracting, summed over the files */
+};
+
+/*
+ * Reads the counters of squash_extract(), e.g. bytes * 1e3 / nanoseconds
+ * is the throughput in megabytes per second.
+ */
+void squash_extract_stat(struct squash_extract_stats *stats);
+
+/* Records the path of every file opened or mapped afterwards into the
+ * file profile, once per file, in the order of their first access.
+ * squash_start() starts it for the environment variable SQUASH_PROFILE. */
+int squash_profile_start(const char *profile);
+void squash_profile_stop();
+void squash_profile_record(sqfs_inode *node, const char *path);
+
+/* Remembers that path, relative to the root of the image, was written
+ * outside of it, e.g. into the directory that mkdir() hooks create;
+ * with subtree, so may anything below it.
+ * squash_overlay_lookup() tells whether path may have been written, and
+ * is 0 without a system call, or a lock if nothing ever was. */
+int squash_overlay_add(const char *path, short subtree);
+short squash_overlay_lookup(const char *path);
+void squash_overlay_clear();
+
 #endif
@@ -27,35 +27,107 @@
 
 #include "squash/common.h"
 
-/* Really simplistic cache
- *  - Linear search
- *  - Linear eviction
- *  - No thread safety
+/* Hashed, sharded LRU cache
+ *  - Entries are spread over a power-of-two number of shards by a hash
+ *    of their index, each shard has its own lock
+ *  - O(1) lookup through per-shard hash buckets
+ *  - Least recently used entry of a shard is evicted first
+ *  - Callers must hold the lock returned by sqfs_cache_mutex() around
+ *    sqfs_cache_get() / sqfs_cache_add() / sqfs_cache_charge() and
+ *    any use of the entry
  *  - Misses are caller's responsibility
+ *  - Several caches may share a byte budget, see sqfs_cache_budget
  */
 #define SQFS_CACHE_IDX_INVALID 0
 
+/* Upper bound of the number of shards of a cache */
+#define SQFS_CACHE_SHARDS 16
+/* Don't split a cache into shards smaller than this */
+#define SQFS_CACHE_SHARD_MIN 4
+/* Upper bound of the number of caches sharing a budget */
+#define SQFS_CACHE_BUDGET_MAX 8
+
 typedef uint64_t sqfs_cache_idx;
 typedef void (*sqfs_cache_dispose)(void* data);
 
 typedef struct {
-	sqfs_cache_idx *idxs;
+	sqfs_cache_idx idx;
+	size_t hash_next;	/* next slot in the same hash bucket, or free list */
+	size_t lru_prev, lru_next;
+	size_t cost;		/* bytes charged to the budget */
+	int64_t tick;		/* budget clock at last use */
+} sqfs_cache_slot;
+
+typedef struct {
+	sqfs_cache_slot *slots;
+	size_t *buckets;
 	uint8_t *buf;
 	
-	sqfs_cache_dispose dispose;
+	size_t count, used;
+	size_t nbuckets;
+	size_t lru_head, lru_tail; /* most / least recently used */
+	size_t free_head;
 	
-	size_t size, count;
-	size_t next; /* next block to evict */
+	uint64_t hits, misses, evictions;
 	
 	MUTEX mutex;
+} sqfs_cache_shard;
+
+struct sqfs_cache_budget;
+
+typedef struct {
+	sqfs_cache_shard *shards;
+	size_t nshards;
+	
+	sqfs_cache_dispose dispose;
+	struct sqfs_cache_budget *budget;
+	
+	size_t size, count;
 } sqfs_cache;
 
+/* Caches attached to a budget compete for the same number of bytes,
+ * whichever entry was used least recently among all of them is evicted
+ * first once the budget is exceeded */
+typedef struct sqfs_cache_budget {
+	int64_t limit;
+	volatile int64_t used;
+	volatile int64_t tick;
+	
+	sqfs_cache *caches[SQFS_CACHE_BUDGET_MAX];
+	size_t ncaches;
+	
+	MUTEX mutex; /* one trimmer at a time */
+} sqfs_cache_budget;
+
+typedef struct {
+	size_t count, used;
+	uint64_t hits, misses, evictions;
+	size_t bytes;
+} sqfs_cache_stats;
+
 sqfs_err sqfs_cache_init(sqfs_cache *cache, size_t size, size_t count,
 	sqfs_cache_dispose dispose);
 void sqfs_cache_destroy(sqfs_cache *cache);
 
+/* The lock guarding the shard that idx belongs to */
+MUTEX *sqfs_cache_mutex(sqfs_cache *cache, sqfs_cache_idx idx);
+
 void *sqfs_cache_get(sqfs_cache *cache, sqfs_cache_idx idx);
+/* Disposes of the least recently used entry if the shard is full, or of
+ * the previous entry if idx is already cached */
 void *sqfs_cache_add(sqfs_cache *cache, sqfs_cache_idx idx);
+/* Accounts cost bytes for the cached entry idx to the budget */
+void sqfs_cache_charge(sqfs_cache *cache, sqfs_cache_idx idx, size_t cost);
+
+/* Sums the counters of all shards, takes the shard locks */
+void sqfs_cache_stat(sqfs_cache *cache, sqfs_cache_stats *stats);
+
+sqfs_err sqfs_cache_budget_init(sqfs_cache_budget *budget, size_t limit);
+void sqfs_cache_budget_destroy(sqfs_cache_budget *budget);
+sqfs_err sqfs_cache_budget_attach(sqfs_cache_budget *budget, sqfs_cache *cache);
+/* Evicts globally least recently used entries until the budget is met.
+ * Must be called without holding any shard lock */
+void sqfs_cache_budget_trim(sqfs_cache_budget *budget);
 
 
 typedef struct {
@@ -40,13 +40,21 @@
                 uint8_t d_type;
         };
         #define SQUASH_DIRENT squash_windows_dirent
+        struct squash_windows_iovec
+        {
+                void *iov_base;
+                size_t iov_len;
+        };
+        #define SQUASH_IOVEC squash_windows_iovec
 #else
 	#include <sys/dir.h>
+	#include <sys/uio.h>
 	#include <unistd.h>
 	typedef mode_t sqfs_mode_t;
 	typedef uid_t sqfs_id_t;
 	typedef off_t sqfs_off_t;
         #define SQUASH_DIRENT dirent
+        #define SQUASH_IOVEC iovec
 #endif
 typedef const uint8_t * sqfs_fd_t;
 
@@ -66,10 +74,14 @@ typedef uint32_t sqfs_inode_num;
 typedef struct sqfs sqfs;
 typedef struct sqfs_inode sqfs_inode;
 
+struct sqfs_pool;
+
 typedef struct {
 	size_t size;
 	void *data;
 	short data_need_freeing;
+	volatile long refcount; /* caches and readers each hold a reference */
+	struct sqfs_pool *pool; /* returned there when disposed, if any */
 } sqfs_block;
 
 typedef struct {
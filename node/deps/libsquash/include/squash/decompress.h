@@ -39,4 +39,18 @@ typedef sqfs_err (*sqfs_decompressor)(void *in, size_t insz,
 
 sqfs_decompressor sqfs_decompressor_get(sqfs_compression_type type);
 
+/* By the name given to mksquashfs -comp, "gzip" for zlib,
+ * SQFS_COMP_UNKNOWN if there is no such codec */
+sqfs_compression_type sqfs_compression_by_name(const char *name);
+
+/* Fails when the output does not fit into *outsz bytes,
+ * which must be at least SQFS_COMPRESS_BOUND(insz) */
+typedef sqfs_err (*sqfs_compressor)(void *in, size_t insz,
+	void *out, size_t *outsz);
+
+/* Large enough for LZO, which does not check the size of its output */
+#define SQFS_COMPRESS_BOUND(insz) ((insz) + (insz) / 16 + 64 + 3)
+
+sqfs_compressor sqfs_compressor_get(sqfs_compression_type type);
+
 #endif
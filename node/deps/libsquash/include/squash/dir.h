@@ -29,6 +29,8 @@
 
 #include "squash/squashfs_fs.h"
 
+#include "squash/cache.h"
+
 typedef struct {
 	sqfs_md_cursor cur;
 	sqfs_off_t offset, total;
@@ -64,6 +66,14 @@ void sqfs_dentry_init(sqfs_dir_entry *entry, char *namebuf);
 short sqfs_dir_next(sqfs *fs, sqfs_dir *dir, sqfs_dir_entry *entry,
 	sqfs_err *err);
 
+/* Get the next directory entries one after another, calling func on each,
+	 until the end or until func returns non-zero, which leaves that entry to
+	 be read again. Entries are decoded straight out of their metadata block,
+	 taken from the cache once per block rather than once per field. */
+typedef short sqfs_dir_entry_f(sqfs_dir_entry *entry, void *arg);
+sqfs_err sqfs_dir_each(sqfs *fs, sqfs_dir *dir, sqfs_dir_entry *entry,
+	sqfs_dir_entry_f *func, void *arg);
+
 /* Lookup an entry in a directory inode.
 	 The dir_entry must have been initialized with a buffer. */
 sqfs_err sqfs_dir_lookup(sqfs *fs, sqfs_inode *inode,
@@ -76,6 +86,12 @@ sqfs_err sqfs_lookup_path_inner(sqfs *fs, sqfs_inode *inode, const char *path,
 sqfs_err sqfs_lookup_path(sqfs *fs, sqfs_inode *inode, const char *path,
 	short *found);
 
+/* Lookups are cached twice, both with negative entries for misses:
+ *  - by starting inode, follow_link and whole normalized path
+ *  - by parent directory inode and name of one path component
+ * The image never changes, so entries stay valid until evicted. */
+sqfs_err sqfs_lookup_cache_init(sqfs_cache *cache, size_t count);
+
 
 /* Accessors on sqfs_dir_entry */
 sqfs_off_t			sqfs_dentry_offset			(sqfs_dir_entry *entry);
@@ -33,4 +33,13 @@ typedef struct {
         void *payload;
 } SQUASH_DIR;
 
+/* A record filled by squash_getdents(), the next one following d_reclen
+ * bytes further */
+struct squash_dent {
+	uint32_t d_ino;
+	unsigned short d_reclen;
+	unsigned char d_type;	/* DT_REG, DT_DIR, DT_LNK, ... */
+	char d_name[1];		/* NUL-terminated, extended to its length */
+};
+
 #endif /* end of include guard: DIRENT_H_245C4278 */
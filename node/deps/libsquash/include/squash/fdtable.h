@@ -18,14 +18,30 @@ struct squash_file {
 	struct stat st;
 	uint64_t pos;
 	void *payload;
+	/* sequential access detection, see squash_file_readahead() */
+	uint64_t readahead_next;	/* where the last read ended */
+	size_t readahead_block;	/* up to which block it was read ahead */
 };
 
+/*
+ * Slot vfd holds the open file of that vfd. Lookups take no lock:
+ * when the table grows, a bigger copy replaces it, and the old one is
+ * kept around until exit, since a reader may still be looking at it.
+ * The tables at most double each time, so all of them together take
+ * less than twice the size of the current one.
+ */
 struct squash_fdtable {
 	size_t nr;
-	struct squash_file **fds;
-	size_t end;
+	struct squash_fdtable *retired;	/* the smaller table this one replaced */
+	struct squash_file * volatile fds[1];	/* nr slots */
 };
 
-extern struct squash_fdtable squash_global_fdtable;
+extern struct squash_fdtable * volatile squash_global_fdtable;
+
+/* The open file of vfd, or NULL if vfd is not ours */
+struct squash_file *squash_vfd_file(int vfd);
+
+/* Replaces the payload of vfd, by which squash_find_entry() finds it */
+int squash_vfd_set_payload(int vfd, void *payload);
 
 #endif /* end of include guard: FDTABLE_H_60F13289 */
@@ -60,6 +60,18 @@ sqfs_err sqfs_blocklist_next(sqfs_blocklist *bl);
 sqfs_err sqfs_read_range(sqfs *fs, sqfs_inode *inode, sqfs_off_t start,
 	sqfs_off_t *size, void *buf);
 
+/* Scatter the data at start into iov, walking the blocks only once.
+ * *size is set to the number of bytes read, which is short at EOF. */
+sqfs_err sqfs_read_rangev(sqfs *fs, sqfs_inode *inode, sqfs_off_t start,
+	const struct SQUASH_IOVEC *iov, int iovcnt, sqfs_off_t *size);
+
+/* Borrow the data at start directly from the image instead of copying it.
+ * On success *span points into the image and *size is shrunk to the length
+ * of the run of stored (uncompressed) data that begins at start.
+ * Returns SQFS_UNSUP if the data at start is compressed or a hole. */
+sqfs_err sqfs_read_span(sqfs *fs, sqfs_inode *inode, sqfs_off_t start,
+	sqfs_off_t *size, const void **span);
+
 
 /*** Block index for skipping to the middle of large files ***/
 
@@ -31,6 +31,8 @@
 
 #include "squash/cache.h"
 #include "squash/decompress.h"
+#include "squash/index.h"
+#include "squash/pool.h"
 #include "squash/table.h"
 
 struct sqfs {
@@ -40,11 +42,22 @@ struct sqfs {
 	sqfs_table id_table;
 	sqfs_table frag_table;
 	sqfs_table export_table;
+	sqfs_table xattr_table;	/* the xattr ids, see sqfs_xattr_get */
+	uint32_t xattr_ids;
+	uint64_t xattr_start;	/* of the names and values */
+	sqfs_cache_budget cache_budget;
 	sqfs_cache md_cache;
 	sqfs_cache data_cache;
 	sqfs_cache frag_cache;
 	sqfs_cache blockidx;
+	sqfs_cache path_cache;	/* whole paths, see sqfs_lookup_cache_init */
+	sqfs_cache name_cache;	/* path components, see sqfs_lookup_cache_init */
+	sqfs_pool md_pool;	/* decompressed metadata blocks */
+	sqfs_pool data_pool;	/* decompressed data and fragment blocks */
+	sqfs_pool stored_pool;	/* blocks stored uncompressed, no buffer */
 	sqfs_decompressor decompressor;
+	const sqfs_path_index *path_index;	/* optional, see sqfs_path_index_set */
+	uint32_t path_index_root;	/* inode number of the root */
         const char *root_alias;
         const char *root_alias2;
 };
@@ -52,6 +65,7 @@ struct sqfs {
 struct sqfs_inode {
 	struct squashfs_base_inode base;
 	int nlink;
+	uint32_t xattr;	/* index in the xattr ids, or SQUASHFS_INVALID_XATTR */
 	
 	sqfs_md_cursor next;
 	
@@ -83,6 +97,9 @@ void sqfs_version_supported(int *min_major, int *min_minor, int *max_major,
 size_t sqfs_divceil(uint64_t total, size_t group);
 
 
+/* Default byte budget shared by the block and lookup caches */
+#define SQFS_CACHE_MB_DEFAULT 16
+
 sqfs_err sqfs_init(sqfs *fs, sqfs_fd_t fd, size_t offset);
 void sqfs_destroy(sqfs *fs);
 
@@ -96,6 +113,8 @@ void sqfs_data_header(uint32_t hdr, short *compressed, uint32_t *size);
 
 sqfs_err sqfs_block_read(sqfs *fs, sqfs_off_t pos, short compressed, uint32_t size,
 	size_t outsize, sqfs_block **block);
+/* Blocks are reference counted, dispose drops one reference */
+void sqfs_block_ref(sqfs_block *block);
 void sqfs_block_dispose(sqfs_block *block);
 
 sqfs_err sqfs_md_block_read(sqfs *fs, sqfs_off_t pos, size_t *data_size,
@@ -103,10 +122,15 @@ sqfs_err sqfs_md_block_read(sqfs *fs, sqfs_off_t pos, size_t *data_size,
 sqfs_err sqfs_data_block_read(sqfs *fs, sqfs_off_t pos, uint32_t hdr,
 	sqfs_block **block);
 
-/* Don't dispose after getting block, it's in the cache */
+/* The block stays valid even if evicted meanwhile, dispose of it after use */
 sqfs_err sqfs_md_cache(sqfs *fs, sqfs_off_t *pos, sqfs_block **block);
 sqfs_err sqfs_data_cache(sqfs *fs, sqfs_cache *cache, sqfs_off_t pos,
 	uint32_t hdr, sqfs_block **block);
+/* Decompresses a data block straight into out, which has room for
+ * *outsize bytes, leaving the cache alone; SQFS_UNSUP when the block is
+ * stored or already cached, so that copying it out is cheaper */
+sqfs_err sqfs_data_block_read_into(sqfs *fs, sqfs_cache *cache, sqfs_off_t pos,
+	uint32_t hdr, void *out, size_t *outsize);
 
 void sqfs_md_cursor_inode(sqfs_md_cursor *cur, sqfs_inode_id id, sqfs_off_t base);
 
@@ -126,6 +150,16 @@ sqfs_err sqfs_readlink(sqfs *fs, sqfs_inode *inode, char *buf, size_t *size);
 int sqfs_export_ok(sqfs *fs);
 sqfs_err sqfs_export_inode(sqfs *fs, sqfs_inode_num n, sqfs_inode_id *i);
 
+/* The xattr squash_mkfs records the content hash of files in, when asked
+ * to, as a little-endian uint64_t */
+#define SQFS_XATTR_HASH "squash.hash"
+
+/* Copies up to *size bytes of the value of the xattr of the inode, of
+ * prefix type such as SQUASHFS_XATTR_USER and of name without its prefix,
+ * into value and sets *size to its length; SQFS_UNSUP if there is none */
+sqfs_err sqfs_xattr_get(sqfs *fs, sqfs_inode *inode, int type,
+	const char *name, void *value, size_t *size);
+
 /* Find the root inode */
 sqfs_inode_id sqfs_inode_root(sqfs *fs);
 
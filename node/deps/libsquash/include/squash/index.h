@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2017 Minqi Pan <pmq2001@gmail.com>
+ *                    Shengyuan Liu <sounder.liu@gmail.com>
+ *
+ * This file is part of libsquash, distributed under the MIT License
+ * For full terms see the included LICENSE file
+ */
+
+#ifndef SQFS_INDEX_H
+#define SQFS_INDEX_H
+
+#include "squash/common.h"
+
+/* Index of every path of an image, generated along with the image
+ *  - A minimal perfect hash: a path is looked up by one probe and one
+ *    string comparison, without reading any metadata
+ *  - Built by hash and displace: the bucket of a path is
+ *    sqfs_path_index_hash(0, path) % count, a displacement d >= 0 of the
+ *    bucket gives the slot sqfs_path_index_hash(d, path) % count, a
+ *    displacement d < 0 the slot -d - 1
+ *  - Paths are absolute, without "." or ".." components or trailing slash
+ *  - Only tells which paths do not exist, the ones that do are still
+ *    looked up through their directories
+ */
+#define SQFS_PATH_INDEX_OTHER 0
+#define SQFS_PATH_INDEX_DIR 1
+#define SQFS_PATH_INDEX_LINK 2
+
+typedef struct {
+	/* of the superblock of the image the index was built for */
+	uint32_t mkfs_time;
+	uint64_t bytes_used;
+	
+	uint32_t count;	/* number of paths, of slots and of buckets */
+	const int32_t *displacements;	/* per bucket */
+	const char * const *paths;	/* per slot */
+	const uint8_t *types;	/* per slot, SQFS_PATH_INDEX_* */
+} sqfs_path_index;
+
+/* 32-bit FNV-1a, its offset basis xor'ed with seed, then mixed by the
+ * finalizer of MurmurHash3 */
+uint32_t sqfs_path_index_hash(uint32_t seed, const char *key, size_t len);
+
+/* Lookups from the root of fs consult index from now on.
+ * Returns SQFS_BADFORMAT, and leaves fs alone, if index was built for
+ * another image. */
+sqfs_err sqfs_path_index_set(sqfs *fs, const sqfs_path_index *index);
+
+/* 1 if the index of fs proves that path, normalized by
+ * sqfs_lookup_path_inner(), does not exist; 0 if it might */
+short sqfs_path_index_absent(sqfs *fs, const char *path);
+
+#endif
@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2017 Minqi Pan <pmq2001@gmail.com>
+ *                    Shengyuan Liu <sounder.liu@gmail.com>
+ *
+ * This file is part of libsquash, distributed under the MIT License
+ * For full terms see the included LICENSE file
+ */
+
+#ifndef SQFS_MKFS_H
+#define SQFS_MKFS_H
+
+#include "squash/common.h"
+#include "squash/decompress.h"
+
+/* Builds a squashfs image out of a directory, in place of mksquashfs
+ *  - Data blocks are compressed on several threads, and written in the
+ *    order of a depth-first walk that visits entries by name, after the
+ *    files listed in options->order
+ *  - Files of the same content share their blocks
+ *  - Tails shorter than a block are packed together into fragments
+ *  - Regular files, directories and symbolic links are taken, anything
+ *    else is skipped
+ *  - There is no export table, and no xattrs but those of
+ *    options->content_hashes
+ *  - The environment variable SOURCE_DATE_EPOCH replaces the time of
+ *    creation, for reproducible images
+ */
+typedef struct {
+	sqfs_compression_type compression;	/* ZLIB_COMPRESSION by default */
+	size_t block_size;	/* a power of two from 4K to 1M, SQUASHFS_FILE_SIZE by default */
+	size_t threads;	/* compressing data blocks, 1 by default */
+	/* NULL-terminated extensions, without the dot, of files stored
+	 * uncompressed and without fragments so that squash_map() takes them;
+	 * NULL by default */
+	const char * const *uncompressed;
+	/* NULL-terminated paths inside the image, e.g. /lib/index.js, whose
+	 * data is laid out first and in this order, as recorded by
+	 * squash_profile_start(); paths not found are skipped; NULL by default */
+	const char * const *order;
+	/* stores the inode and directory tables uncompressed, so that looking
+	 * up a path reads them straight out of the image; 0 by default */
+	short uncompressed_metadata;
+	/* records the 64-bit FNV-1a hash of the content of every regular file
+	 * as its xattr user.squash.hash, SQFS_XATTR_HASH, which squash_extract()
+	 * names its persistent cache after instead of hashing the file at run
+	 * time; 0 by default */
+	short content_hashes;
+} sqfs_mkfs_options;
+
+void sqfs_mkfs_options_init(sqfs_mkfs_options *options);
+
+/* Writes the image of the directory source to the file image,
+ * SQFS_BADCOMP if the codec is not compiled in, SQFS_ERR with errno set
+ * if the directory cannot be read or the image cannot be written */
+sqfs_err sqfs_mkfs(const char *source, const char *image,
+	const sqfs_mkfs_options *options);
+
+#endif
@@ -16,10 +16,20 @@
     #include <pthread.h>
 #endif
 
+#include <stdint.h>
+
 #ifdef _WIN32
    #define MUTEX HANDLE
+   #define COND HANDLE
+   #define THREAD HANDLE
+   #define THREAD_RETURN unsigned __stdcall
+   typedef unsigned (__stdcall *THREAD_START)(void *);
 #else
    #define MUTEX pthread_mutex_t
+   #define COND pthread_cond_t
+   #define THREAD pthread_t
+   #define THREAD_RETURN void *
+   typedef void *(*THREAD_START)(void *);
 #endif
 
 extern MUTEX squash_global_mutex;
@@ -29,4 +39,27 @@ int MUTEX_LOCK(MUTEX *mutex);
 int MUTEX_UNLOCK(MUTEX *mutex);
 int MUTEX_DESTORY(MUTEX *mutex);
 
+/* A condition has a single waiter, which holds the mutex and checks
+ * again what it waits for when it wakes up */
+int COND_INIT(COND *cond);
+int COND_WAIT(COND *cond, MUTEX *mutex);
+int COND_SIGNAL(COND *cond);
+int COND_DESTROY(COND *cond);
+
+/* Thread functions are declared as static THREAD_RETURN f(void *arg) */
+int THREAD_CREATE(THREAD *thread, THREAD_START start, void *arg);
+int THREAD_JOIN(THREAD *thread);
+void THREAD_YIELD();
+
+/* Atomically add / subtract one, returning the new value */
+long ATOMIC_INCREMENT(volatile long *value);
+long ATOMIC_DECREMENT(volatile long *value);
+int64_t ATOMIC_ADD64(volatile int64_t *value, int64_t delta);
+
+/* Memory fences for lock-free readers and the writers they race with:
+ * loads before ATOMIC_ACQUIRE() happen before the loads after it,
+ * stores before ATOMIC_RELEASE() become visible before the stores after it */
+void ATOMIC_ACQUIRE();
+void ATOMIC_RELEASE();
+
 #endif //LIBSQUASH_MUTEX_H
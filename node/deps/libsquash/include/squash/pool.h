@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2017 Minqi Pan <pmq2001@gmail.com>
+ *                    Shengyuan Liu <sounder.liu@gmail.com>
+ *
+ * This file is part of libsquash, distributed under the MIT License
+ * For full terms see the included LICENSE file
+ */
+
+#ifndef SQFS_POOL_H
+#define SQFS_POOL_H
+
+#include "squash/common.h"
+
+/* Pool of equally sized blocks
+ *  - The sqfs_block and its data buffer are allocated together
+ *  - Disposed blocks are kept on a free list for the next sqfs_pool_get(),
+ *    up to max_free of them; the rest are freed
+ *  - Thread safe
+ */
+typedef struct sqfs_pool {
+	size_t size; /* bytes of data of each block */
+	size_t max_free;
+	
+	sqfs_block *free_list; /* linked through block->data */
+	size_t nfree;
+	
+	uint64_t allocs, reuses;
+	
+	MUTEX mutex;
+} sqfs_pool;
+
+/* Don't keep more than this many bytes of free blocks per pool */
+#define SQFS_POOL_MAX_FREE_BYTES (4 * 1024 * 1024)
+
+sqfs_err sqfs_pool_init(sqfs_pool *pool, size_t size);
+/* All blocks must have been returned */
+void sqfs_pool_destroy(sqfs_pool *pool);
+
+/* A block with refcount 1 and size bytes of data, or NULL */
+sqfs_block *sqfs_pool_get(sqfs_pool *pool);
+void sqfs_pool_put(sqfs_pool *pool, sqfs_block *block);
+
+#endif
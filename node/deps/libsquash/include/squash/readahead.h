@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2017 Minqi Pan <pmq2001@gmail.com>
+ *                    Shengyuan Liu <sounder.liu@gmail.com>
+ *
+ * This file is part of libsquash, distributed under the MIT License
+ * For full terms see the included LICENSE file
+ */
+
+#ifndef SQFS_READAHEAD_H
+#define SQFS_READAHEAD_H
+
+#include "squash/common.h"
+
+/* Data blocks decompressed ahead of a sequential reader, by default */
+#define SQUASH_READAHEAD_DEFAULT 4
+#define SQUASH_READAHEAD_MAX 64
+
+/* The environment variable SQUASH_READAHEAD takes precedence, 0 turns
+ * readahead off */
+void squash_set_readahead(size_t blocks);
+size_t squash_readahead_depth();
+
+struct squash_readahead_stats {
+	uint64_t requests;	/* queued by sequential readers */
+	uint64_t dropped;	/* requests that found the queue full */
+	uint64_t blocks;	/* decompressed ahead of the reader */
+	uint64_t cached;	/* skipped, being in the cache already */
+};
+
+void squash_readahead_stat(struct squash_readahead_stats *stats);
+
+/* Called by squash_start() and at exit */
+void squash_readahead_init();
+void squash_readahead_halt();
+
+/* Queues count data blocks of inode, from its block number block, to be
+ * decompressed into the data cache of fs by the readahead thread */
+void squash_readahead(sqfs *fs, sqfs_inode *inode, size_t block, size_t count);
+
+/* Drops what is queued for fs and waits for the readahead thread to be
+ * done with it, before fs is destroyed */
+void squash_readahead_cancel(sqfs *fs);
+
+#endif
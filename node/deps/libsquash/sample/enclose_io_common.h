@@ -39,7 +39,38 @@
 
 extern sqfs *enclose_io_fs;
 extern sqfs_path enclose_io_cwd;
+extern SQUASH_OS_PATH mkdir_workdir;
 extern const uint8_t enclose_io_memfs[];
+extern const sqfs_path_index enclose_io_memfs_index;
+
+/* An executable built by nodec --runtime ends with
+ *   the squashfs image,
+ *   the settings, as "key\0value\0" pairs,
+ *   ENCLOSE_IO_TRAILER_SIZE bytes of trailer: ENCLOSE_IO_TRAILER_MAGIC,
+ *   then the offset and size of the image and of the settings,
+ *   as little-endian 64-bit integers */
+#define ENCLOSE_IO_TRAILER_MAGIC "ENCLOSE1"
+#define ENCLOSE_IO_TRAILER_SIZE 40
+
+struct enclose_io_payload {
+	const uint8_t *base;	/* the executable, mapped */
+	size_t image_offset;
+	const char *entrance;
+#ifdef _WIN32
+	const wchar_t *wentrance;
+#endif
+	const char *root_alias;
+	const char *root_alias2;
+	size_t squash_cache_mb;	/* 0 if not set */
+	const char *auto_update_host;	/* NULL if auto-update is disabled */
+	const char *auto_update_port;
+	const char *auto_update_path;
+	const char *auto_update_base;
+};
+
+extern struct enclose_io_payload enclose_io_payload;
+/* Finds the payload appended to the running executable, 0 on success */
+int enclose_io_payload_load();
 
 #define ENCLOSE_IO_PP_NARG(...) \
     ENCLOSE_IO_PP_NARG_(__VA_ARGS__,ENCLOSE_IO_PP_RSEQ_N())
@@ -65,9 +96,10 @@ extern const uint8_t enclose_io_memfs[];
 short enclose_io_is_path(char *pathname);
 short enclose_io_is_path_w(wchar_t *pathname);
 short enclose_io_is_relative_w(wchar_t *pathname);
+short enclose_io_mkdir_overlay(const char *path);
 
 #define ENCLOSE_IO_CONSIDER_MKDIR_WORKDIR_RETURN(PATH, RETURN1, RETURN2) \
-	if (mkdir_workdir) { \
+	if (mkdir_workdir && enclose_io_mkdir_overlay(PATH)) { \
 		sqfs_path mkdir_workdir_expanded; \
 		char *mkdir_workdir_expanded_head; \
 		size_t mkdir_workdir_len; \
@@ -140,6 +172,9 @@ short enclose_io_is_relative_w(wchar_t *pathname);
 int enclose_io_dos_return(int statement);
 short enclose_io_if(const char* path);
 SQUASH_OS_PATH enclose_io_ifextract(const char* path, const char* ext_name);
+const void *enclose_io_ifmap(const char* path, size_t *size);
+void *enclose_io_ifreadfile(const char* path, size_t *size);
+SQUASH_DIR *enclose_io_ifopendir(const char* path);
 void enclose_io_chdir_helper(const char *path);
 int enclose_io_chdir(const char *path);
 char *enclose_io_getcwd(char *buf, size_t size);
@@ -291,12 +326,12 @@ EncloseIOReadDirectoryChangesW(
         LPOVERLAPPED lpOverlapped,
         LPOVERLAPPED_COMPLETION_ROUTINE lpCompletionRoutine
 );
-
-HMODULE
-EncloseIOLoadLibraryExW(
-	LPCWSTR lpLibFileName,
-	HANDLE hFile,
-	DWORD dwFlags
+
+HMODULE
+EncloseIOLoadLibraryExW(
+	LPCWSTR lpLibFileName,
+	HANDLE hFile,
+	DWORD dwFlags
 );
 
 #else
@@ -313,6 +348,7 @@ int enclose_io_scandir(const char *dirname, struct SQUASH_DIRENT ***namelist,
 	int(*select)(const struct SQUASH_DIRENT *),
 	int(*compar)(const struct SQUASH_DIRENT **, const struct SQUASH_DIRENT **));
 ssize_t enclose_io_pread(int d, void *buf, size_t nbyte, off_t offset);
+ssize_t enclose_io_preadv(int d, const struct iovec *iov, int iovcnt, off_t offset);
 ssize_t enclose_io_readv(int d, const struct iovec *iov, int iovcnt);
 void* enclose_io_dlopen(const char* path, int mode);
 int enclose_io_access(const char *path, int mode);
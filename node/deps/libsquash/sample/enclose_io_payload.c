@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2017 Minqi Pan <pmq2001@gmail.com>
+ *                    Shengyuan Liu <sounder.liu@gmail.com>
+ *
+ * This file is part of libsquash, distributed under the MIT License
+ * For full terms see the included LICENSE file
+ */
+
+#include "enclose_io_common.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#ifdef __APPLE__
+#include <mach-o/dyld.h>
+#endif
+#endif
+
+struct enclose_io_payload enclose_io_payload;
+
+/* Maps the whole executable read-only, the mapping is never undone */
+static const uint8_t *enclose_io_map_self(size_t *size)
+{
+#ifdef _WIN32
+	wchar_t path[32768];
+	DWORD length;
+	HANDLE file, mapping;
+	LARGE_INTEGER file_size;
+	const uint8_t *base;
+
+	length = GetModuleFileNameW(NULL, path, sizeof(path) / sizeof(path[0]));
+	if (0 == length || sizeof(path) / sizeof(path[0]) == length) {
+		return NULL;
+	}
+	file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (INVALID_HANDLE_VALUE == file) {
+		return NULL;
+	}
+	if (!GetFileSizeEx(file, &file_size)) {
+		CloseHandle(file);
+		return NULL;
+	}
+	mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(file);
+	if (NULL == mapping) {
+		return NULL;
+	}
+	base = (const uint8_t *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+	*size = (size_t)file_size.QuadPart;
+	return base;
+#else
+	int fd;
+	struct stat st;
+	void *base;
+#ifdef __APPLE__
+	char path[MAXPATHLEN + 1];
+	uint32_t length = sizeof(path);
+
+	if (0 != _NSGetExecutablePath(path, &length)) {
+		return NULL;
+	}
+	fd = open(path, O_RDONLY);
+#else
+	fd = open("/proc/self/exe", O_RDONLY);
+#endif
+	if (-1 == fd) {
+		return NULL;
+	}
+	if (-1 == fstat(fd, &st)) {
+		close(fd);
+		return NULL;
+	}
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (MAP_FAILED == base) {
+		return NULL;
+	}
+	*size = st.st_size;
+	return (const uint8_t *)base;
+#endif
+}
+
+static uint64_t enclose_io_payload_u64(const uint8_t *p)
+{
+	uint64_t ret = 0;
+	int i;
+
+	for (i = 7; i >= 0; --i) {
+		ret = (ret << 8) | p[i];
+	}
+	return ret;
+}
+
+int enclose_io_payload_load()
+{
+	const uint8_t *base, *trailer;
+	const char *settings, *end;
+	uint64_t image_offset, image_size, settings_offset, settings_size;
+	size_t size;
+
+	memset(&enclose_io_payload, 0, sizeof(enclose_io_payload));
+	base = enclose_io_map_self(&size);
+	if (NULL == base || size < ENCLOSE_IO_TRAILER_SIZE) {
+		return -1;
+	}
+	trailer = base + size - ENCLOSE_IO_TRAILER_SIZE;
+	if (0 != memcmp(trailer, ENCLOSE_IO_TRAILER_MAGIC, 8)) {
+		return -1;
+	}
+	image_offset = enclose_io_payload_u64(trailer + 8);
+	image_size = enclose_io_payload_u64(trailer + 16);
+	settings_offset = enclose_io_payload_u64(trailer + 24);
+	settings_size = enclose_io_payload_u64(trailer + 32);
+	if (image_offset > size || image_size > size - image_offset ||
+			settings_offset > size || settings_size > size - settings_offset) {
+		return -1;
+	}
+	enclose_io_payload.base = base;
+	enclose_io_payload.image_offset = (size_t)image_offset;
+
+	/* "key\0value\0" pairs */
+	settings = (const char *)base + settings_offset;
+	end = settings + settings_size;
+	if (settings_size > 0 && '\0' != end[-1]) {
+		return -1;
+	}
+	while (settings < end) {
+		const char *key = settings;
+		const char *value = key + strlen(key) + 1;
+		if (value >= end) {
+			return -1;
+		}
+		settings = value + strlen(value) + 1;
+		if (0 == strcmp(key, "entrance")) {
+			enclose_io_payload.entrance = value;
+		} else if (0 == strcmp(key, "root_alias")) {
+			enclose_io_payload.root_alias = value;
+		} else if (0 == strcmp(key, "root_alias2")) {
+			enclose_io_payload.root_alias2 = value;
+		} else if (0 == strcmp(key, "squash_cache_mb")) {
+			enclose_io_payload.squash_cache_mb = (size_t)strtoul(value, NULL, 10);
+		} else if (0 == strcmp(key, "auto_update_host")) {
+			enclose_io_payload.auto_update_host = value;
+		} else if (0 == strcmp(key, "auto_update_port")) {
+			enclose_io_payload.auto_update_port = value;
+		} else if (0 == strcmp(key, "auto_update_path")) {
+			enclose_io_payload.auto_update_path = value;
+		} else if (0 == strcmp(key, "auto_update_base")) {
+			enclose_io_payload.auto_update_base = value;
+		}
+		/* unknown keys are left for newer runtimes */
+	}
+	if (NULL == enclose_io_payload.entrance) {
+		return -1;
+	}
+#ifdef _WIN32
+	{
+		int length = MultiByteToWideChar(CP_UTF8, 0, enclose_io_payload.entrance, -1, NULL, 0);
+		wchar_t *wentrance;
+		if (0 == length) {
+			return -1;
+		}
+		wentrance = (wchar_t *)malloc(length * sizeof(wchar_t));
+		if (NULL == wentrance) {
+			return -1;
+		}
+		MultiByteToWideChar(CP_UTF8, 0, enclose_io_payload.entrance, -1, wentrance, length);
+		enclose_io_payload.wentrance = wentrance;
+	}
+#endif
+	return 0;
+}
@@ -50,6 +50,20 @@ static const char* enclose_io_mkdir_workdir()
 	}
 	return mkdir_workdir;
 }
+#endif // !_WIN32
+
+/* Whether path may have been written into mkdir_workdir, answered by the
+ * overlay index rather than by a stat() of the workdir */
+short enclose_io_mkdir_overlay(const char *path)
+{
+	const char *head = strstr(path, enclose_io_mkdir_scope);
+	if (NULL == head || '/' != head[strlen(enclose_io_mkdir_scope)]) {
+		return 0;
+	}
+	return squash_overlay_lookup(head + strlen(enclose_io_mkdir_scope));
+}
+
+#ifndef _WIN32
 
 int enclose_io_lstat(const char *path, struct stat *buf)
 {
@@ -214,45 +228,43 @@ int enclose_io_scandir(const char *dirname, struct SQUASH_DIRENT ***namelist,
 ssize_t enclose_io_pread(int d, void *buf, size_t nbyte, off_t offset)
 {
 	if (SQUASH_VALID_VFD(d)) {
-		off_t lseek_off, backup_off;
-		ssize_t read_ssize;
-		backup_off = squash_lseek(d, 0, SQUASH_SEEK_CUR);
-		if (-1 == backup_off) {
-			return -1;
-		}
-		lseek_off = squash_lseek(d, offset, SQUASH_SEEK_SET);
-		if (-1 == lseek_off) {
-			return -1;
-		}
-		read_ssize = squash_read(d, buf, nbyte);
-		if (-1 == read_ssize) {
-			return -1;
-		}
-		lseek_off = squash_lseek(d, backup_off, SQUASH_SEEK_SET);
-		assert(backup_off == lseek_off);
-		return read_ssize;
+		return squash_pread(d, buf, nbyte, offset);
 	} else {
 		return pread(d, buf, nbyte, offset);
 	}
 }
 
-ssize_t enclose_io_readv(int d, const struct iovec *iov, int iovcnt)
+ssize_t enclose_io_preadv(int d, const struct iovec *iov, int iovcnt, off_t offset)
 {
 	if (SQUASH_VALID_VFD(d)) {
+		return squash_preadv(d, iov, iovcnt, offset);
+	} else {
+#ifdef __APPLE__
+		// older macOS do not have preadv
 		int i;
 		ssize_t i_ssize;
 		ssize_t ret = 0;
 		for (i = 0; i < iovcnt; ++i) {
-			i_ssize = squash_read(d, iov[i].iov_base, iov[i].iov_len);
+			i_ssize = pread(d, iov[i].iov_base, iov[i].iov_len, offset + ret);
 			if (-1 == i_ssize) {
-				return -1;
-			} else if (0 == i_ssize) {
+				return ret ? ret : -1;
+			}
+			ret += i_ssize;
+			if ((size_t)i_ssize < iov[i].iov_len) {
 				break;
-			} else {
-				ret += i_ssize;
 			}
 		}
 		return ret;
+#else
+		return preadv(d, iov, iovcnt, offset);
+#endif
+	}
+}
+
+ssize_t enclose_io_readv(int d, const struct iovec *iov, int iovcnt)
+{
+	if (SQUASH_VALID_VFD(d)) {
+		return squash_readv(d, iov, iovcnt);
 	} else {
 		return readv(d, iov, iovcnt);
 	}
@@ -320,6 +332,7 @@ static int enclose_io_mkdir_consult(char *path, mode_t mode) {
 						strlen(path2 + (head-path) + strlen(enclose_io_mkdir_scope)) + 1
 					);
 					mkdir(path2, mode);
+					squash_overlay_add(path2 + (head-path), 0);
 					free(path2);
 				}
 				*p = '/';
@@ -334,7 +347,11 @@ static int enclose_io_mkdir_consult(char *path, mode_t mode) {
 		head + strlen(enclose_io_mkdir_scope),
 		strlen(head + strlen(enclose_io_mkdir_scope)) + 1
 	);
-	return mkdir(path, mode);
+	ret = mkdir(path, mode);
+	if (0 == ret) {
+		squash_overlay_add(head, 1);
+	}
+	return ret;
 }
 
 int enclose_io_mkdir(const char *path, mode_t mode)
@@ -446,6 +463,75 @@ SQUASH_OS_PATH enclose_io_ifextract(const char* path, const char* ext_name)
     }
 }
 
+const void *enclose_io_ifmap(const char* path, size_t *size)
+{
+	if (enclose_io_cwd[0] && '/' != *path) {
+		sqfs_path enclose_io_expanded;
+		size_t enclose_io_cwd_len;
+		size_t memcpy_len;
+		ENCLOSE_IO_GEN_EXPANDED_NAME(path);
+		ENCLOSE_IO_CONSIDER_MKDIR_WORKDIR_RETURN(
+			enclose_io_expanded,
+			squash_map(enclose_io_fs, enclose_io_expanded, size),
+			NULL
+		);
+	} else if (enclose_io_is_path(path)) {
+		ENCLOSE_IO_CONSIDER_MKDIR_WORKDIR_RETURN(
+			path,
+			squash_map(enclose_io_fs, path, size),
+			NULL
+		);
+	} else {
+		return NULL;
+	}
+}
+
+void *enclose_io_ifreadfile(const char* path, size_t *size)
+{
+	if (enclose_io_cwd[0] && '/' != *path) {
+		sqfs_path enclose_io_expanded;
+		size_t enclose_io_cwd_len;
+		size_t memcpy_len;
+		ENCLOSE_IO_GEN_EXPANDED_NAME(path);
+		ENCLOSE_IO_CONSIDER_MKDIR_WORKDIR_RETURN(
+			enclose_io_expanded,
+			squash_readfile(enclose_io_fs, enclose_io_expanded, size),
+			NULL
+		);
+	} else if (enclose_io_is_path(path)) {
+		ENCLOSE_IO_CONSIDER_MKDIR_WORKDIR_RETURN(
+			path,
+			squash_readfile(enclose_io_fs, path, size),
+			NULL
+		);
+	} else {
+		return NULL;
+	}
+}
+
+SQUASH_DIR *enclose_io_ifopendir(const char* path)
+{
+	if (enclose_io_cwd[0] && '/' != *path) {
+		sqfs_path enclose_io_expanded;
+		size_t enclose_io_cwd_len;
+		size_t memcpy_len;
+		ENCLOSE_IO_GEN_EXPANDED_NAME(path);
+		ENCLOSE_IO_CONSIDER_MKDIR_WORKDIR_RETURN(
+			enclose_io_expanded,
+			squash_opendir(enclose_io_fs, enclose_io_expanded),
+			NULL
+		);
+	} else if (enclose_io_is_path(path)) {
+		ENCLOSE_IO_CONSIDER_MKDIR_WORKDIR_RETURN(
+			path,
+			squash_opendir(enclose_io_fs, path),
+			NULL
+		);
+	} else {
+		return NULL;
+	}
+}
+
 void enclose_io_chdir_helper(const char *path)
 {
         size_t memcpy_len = strlen(path);
@@ -463,7 +549,7 @@ void enclose_io_chdir_helper(const char *path)
 int enclose_io_chdir(const char *path)
 {
 	if (enclose_io_is_path(path)) {
-		if (mkdir_workdir) {
+		if (mkdir_workdir && enclose_io_mkdir_overlay(path)) {
 			sqfs_path mkdir_workdir_expanded;
 			char *mkdir_workdir_expanded_head;
 			size_t mkdir_workdir_len;
@@ -630,7 +716,11 @@ int enclose_io_open(int nargs, const char *pathname, int flags, ...)
 						mkdir_workdir_expanded_head + strlen(enclose_io_mkdir_scope),
 						strlen(mkdir_workdir_expanded_head + strlen(enclose_io_mkdir_scope)) + 1
 					);
-					return enclose_io_dos_return(open(mkdir_workdir_expanded, flags, mode));
+					int ret = open(mkdir_workdir_expanded, flags, mode);
+					if (-1 != ret) {
+						squash_overlay_add(mkdir_workdir_expanded_head, 0);
+					}
+					return enclose_io_dos_return(ret);
 				} else {
 					errno = ENOENT;
 					return enclose_io_dos_return(-1);
@@ -675,7 +765,11 @@ int enclose_io_open(int nargs, const char *pathname, int flags, ...)
 						mkdir_workdir_expanded_head + strlen(enclose_io_mkdir_scope),
 						strlen(mkdir_workdir_expanded_head + strlen(enclose_io_mkdir_scope)) + 1
 					);
-					return enclose_io_dos_return(open(mkdir_workdir_expanded, flags, mode));
+					int ret = open(mkdir_workdir_expanded, flags, mode);
+					if (-1 != ret) {
+						squash_overlay_add(mkdir_workdir_expanded_head, 0);
+					}
+					return enclose_io_dos_return(ret);
 				} else {
 					errno = ENOENT;
 					return enclose_io_dos_return(-1);
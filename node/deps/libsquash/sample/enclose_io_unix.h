@@ -35,6 +35,7 @@
 	#define dirfd(...)	enclose_io_dirfd(__VA_ARGS__)
 	#define scandir(...)	enclose_io_scandir(__VA_ARGS__)
 	#define pread(...)	enclose_io_pread(__VA_ARGS__)
+	#define preadv(...)	enclose_io_preadv(__VA_ARGS__)
 	#define readv(...)	enclose_io_readv(__VA_ARGS__)
 	#define dlopen(...)	enclose_io_dlopen(__VA_ARGS__)
 	#define access(...)	enclose_io_access(__VA_ARGS__)
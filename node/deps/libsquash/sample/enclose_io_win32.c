@@ -65,8 +65,8 @@ int enclose_io_open_osfhandle(intptr_t osfhandle, int flags)
 intptr_t enclose_io_get_osfhandle(int fd)
 {
 	if (SQUASH_VALID_VFD(fd)) {
-                assert(!(S_ISDIR(squash_global_fdtable.fds[fd]->st.st_mode)));
-		return (intptr_t)(squash_global_fdtable.fds[fd]->payload);
+                assert(!(S_ISDIR(SQUASH_VFD_FILE(fd)->st.st_mode)));
+		return (intptr_t)(SQUASH_VFD_FILE(fd)->payload);
 	}
 	else {
 		return _get_osfhandle(fd);
@@ -206,7 +206,7 @@ static HANDLE EncloseIOCreateFileWHelper(
 	} else {
 		ret = squash_open_inner(enclose_io_fs, incoming, follow_link);
 		if (ret >= 0) {
-                        return (HANDLE)(squash_global_fdtable.fds[ret]->payload);
+                        return (HANDLE)(SQUASH_VFD_FILE(ret)->payload);
                 } else {
                         ENCLOSE_IO_SET_LAST_ERROR;
                         return INVALID_HANDLE_VALUE;
@@ -27,65 +27,320 @@
 #include "squash/fs.h"
 
 #include <stdlib.h>
+#include <string.h>
+
+#define SQFS_CACHE_NIL ((size_t)-1)
+
+static uint64_t sqfs_cache_hash(sqfs_cache_idx idx) {
+	/* finalizer of MurmurHash3, spreads sequential block offsets */
+	idx ^= idx >> 33;
+	idx *= 0xff51afd7ed558ccdULL;
+	idx ^= idx >> 33;
+	idx *= 0xc4ceb9fe1a85ec53ULL;
+	idx ^= idx >> 33;
+	return idx;
+}
+
+static sqfs_cache_shard *sqfs_cache_shard_of(sqfs_cache *cache,
+		sqfs_cache_idx idx, uint64_t *hash) {
+	*hash = sqfs_cache_hash(idx);
+	return &cache->shards[*hash & (cache->nshards - 1)];
+}
+
+static size_t sqfs_cache_bucket(sqfs_cache_shard *shard, uint64_t hash) {
+	return (size_t)(hash >> 32) & (shard->nbuckets - 1);
+}
+
+static void *sqfs_cache_entry(sqfs_cache *cache, sqfs_cache_shard *shard,
+		size_t i) {
+	return shard->buf + i * cache->size;
+}
+
+static sqfs_err sqfs_cache_shard_init(sqfs_cache_shard *shard, size_t size,
+		size_t count) {
+	size_t i;
+	
+	shard->count = count;
+	shard->used = 0;
+	shard->lru_head = shard->lru_tail = SQFS_CACHE_NIL;
+	shard->hits = shard->misses = shard->evictions = 0;
+	
+	for (shard->nbuckets = 1; shard->nbuckets < count; shard->nbuckets <<= 1)
+		;
+	
+	if (MUTEX_INIT(&shard->mutex))
+		return SQFS_ERR;
+	
+	shard->slots = calloc(count, sizeof(sqfs_cache_slot));
+	shard->buckets = malloc(shard->nbuckets * sizeof(size_t));
+	shard->buf = calloc(count, size);
+	if (!(shard->slots && shard->buckets && shard->buf))
+		return SQFS_ERR;
+	
+	for (i = 0; i < shard->nbuckets; ++i)
+		shard->buckets[i] = SQFS_CACHE_NIL;
+	for (i = 0; i < count; ++i)
+		shard->slots[i].hash_next = i + 1 < count ? i + 1 : SQFS_CACHE_NIL;
+	shard->free_head = 0;
+	return SQFS_OK;
+}
 
 sqfs_err sqfs_cache_init(sqfs_cache *cache, size_t size, size_t count,
 		sqfs_cache_dispose dispose) {
+	size_t i, per_shard;
+	
 	cache->size = size;
 	cache->count = count;
 	cache->dispose = dispose;
-	cache->next = 0;
-
-	MUTEX_INIT(&cache->mutex);
+	cache->budget = NULL;
 	
-	cache->idxs = calloc(count, sizeof(sqfs_cache_idx));
-	cache->buf = calloc(count, size);
-	if (cache->idxs && cache->buf)
-		return SQFS_OK;
+	cache->nshards = 1;
+	while (cache->nshards < SQFS_CACHE_SHARDS &&
+			count / (cache->nshards * 2) >= SQFS_CACHE_SHARD_MIN)
+		cache->nshards <<= 1;
+	per_shard = (count + cache->nshards - 1) / cache->nshards;
+	if (per_shard == 0)
+		per_shard = 1;
 	
-	sqfs_cache_destroy(cache);
-	return SQFS_ERR;
+	cache->shards = calloc(cache->nshards, sizeof(sqfs_cache_shard));
+	if (!cache->shards) {
+		cache->nshards = 0;
+		return SQFS_ERR;
+	}
+	for (i = 0; i < cache->nshards; ++i) {
+		if (sqfs_cache_shard_init(&cache->shards[i], size, per_shard)) {
+			cache->nshards = i + 1;
+			sqfs_cache_destroy(cache);
+			return SQFS_ERR;
+		}
+	}
+	return SQFS_OK;
 }
 
-static void *sqfs_cache_entry(sqfs_cache *cache, size_t i) {
-	return cache->buf + i * cache->size;
+/* Dispose of the entry in slot i and give back its bytes */
+static void sqfs_cache_release(sqfs_cache *cache, sqfs_cache_shard *shard,
+		size_t i) {
+	cache->dispose(sqfs_cache_entry(cache, shard, i));
+	if (cache->budget && shard->slots[i].cost)
+		ATOMIC_ADD64(&cache->budget->used, -(int64_t)shard->slots[i].cost);
+	shard->slots[i].cost = 0;
 }
 
 void sqfs_cache_destroy(sqfs_cache *cache) {
-	MUTEX_DESTORY(&cache->mutex);
-
-	if (cache->buf && cache->idxs) {
-		size_t i;
-		for (i = 0; i < cache->count; ++i) {
-			if (cache->idxs[i] != SQFS_CACHE_IDX_INVALID)
-				cache->dispose(sqfs_cache_entry(cache, i));
+	size_t i, j;
+	
+	if (!cache->shards)
+		return;
+	for (i = 0; i < cache->nshards; ++i) {
+		sqfs_cache_shard *shard = &cache->shards[i];
+		if (shard->slots && shard->buf) {
+			for (j = shard->lru_head; j != SQFS_CACHE_NIL;
+					j = shard->slots[j].lru_next)
+				sqfs_cache_release(cache, shard, j);
 		}
+		free(shard->buf);
+		free(shard->buckets);
+		free(shard->slots);
+		MUTEX_DESTORY(&shard->mutex);
 	}
-	free(cache->buf);
-	free(cache->idxs);
+	free(cache->shards);
+	cache->shards = NULL;
+	cache->nshards = 0;
+}
+
+MUTEX *sqfs_cache_mutex(sqfs_cache *cache, sqfs_cache_idx idx) {
+	uint64_t hash;
+	return &sqfs_cache_shard_of(cache, idx, &hash)->mutex;
+}
+
+static void sqfs_cache_lru_unlink(sqfs_cache_shard *shard, size_t i) {
+	sqfs_cache_slot *slot = &shard->slots[i];
+	if (slot->lru_prev == SQFS_CACHE_NIL)
+		shard->lru_head = slot->lru_next;
+	else
+		shard->slots[slot->lru_prev].lru_next = slot->lru_next;
+	if (slot->lru_next == SQFS_CACHE_NIL)
+		shard->lru_tail = slot->lru_prev;
+	else
+		shard->slots[slot->lru_next].lru_prev = slot->lru_prev;
+}
+
+static void sqfs_cache_lru_push(sqfs_cache *cache, sqfs_cache_shard *shard,
+		size_t i) {
+	sqfs_cache_slot *slot = &shard->slots[i];
+	slot->lru_prev = SQFS_CACHE_NIL;
+	slot->lru_next = shard->lru_head;
+	if (shard->lru_head != SQFS_CACHE_NIL)
+		shard->slots[shard->lru_head].lru_prev = i;
+	shard->lru_head = i;
+	if (shard->lru_tail == SQFS_CACHE_NIL)
+		shard->lru_tail = i;
+	if (cache->budget)
+		slot->tick = ATOMIC_ADD64(&cache->budget->tick, 1);
+}
+
+static size_t sqfs_cache_find(sqfs_cache_shard *shard, sqfs_cache_idx idx,
+		uint64_t hash) {
+	size_t i = shard->buckets[sqfs_cache_bucket(shard, hash)];
+	while (i != SQFS_CACHE_NIL && shard->slots[i].idx != idx)
+		i = shard->slots[i].hash_next;
+	return i;
+}
+
+static void sqfs_cache_unhash(sqfs_cache_shard *shard, size_t i) {
+	uint64_t hash = sqfs_cache_hash(shard->slots[i].idx);
+	size_t *link = &shard->buckets[sqfs_cache_bucket(shard, hash)];
+	while (*link != i)
+		link = &shard->slots[*link].hash_next;
+	*link = shard->slots[i].hash_next;
+}
+
+/* Remove the entry in slot i altogether */
+static void sqfs_cache_evict(sqfs_cache *cache, sqfs_cache_shard *shard,
+		size_t i) {
+	++shard->evictions;
+	sqfs_cache_release(cache, shard, i);
+	sqfs_cache_unhash(shard, i);
+	sqfs_cache_lru_unlink(shard, i);
+	shard->slots[i].hash_next = shard->free_head;
+	shard->free_head = i;
+	--shard->used;
 }
 
 void *sqfs_cache_get(sqfs_cache *cache, sqfs_cache_idx idx) {
-	size_t i;
-	void *ret = NULL;
-	for (i = 0; i < cache->count; ++i) {
-		if (cache->idxs[i] == idx){
-			ret = sqfs_cache_entry(cache, i);
-			break;
-		}
+	uint64_t hash;
+	sqfs_cache_shard *shard = sqfs_cache_shard_of(cache, idx, &hash);
+	size_t i = sqfs_cache_find(shard, idx, hash);
+	
+	if (i == SQFS_CACHE_NIL)
+		return NULL;
+	
+	++shard->hits;
+	sqfs_cache_lru_unlink(shard, i);
+	sqfs_cache_lru_push(cache, shard, i);
+	return sqfs_cache_entry(cache, shard, i);
+}
 
+void *sqfs_cache_add(sqfs_cache *cache, sqfs_cache_idx idx) {
+	uint64_t hash;
+	sqfs_cache_shard *shard = sqfs_cache_shard_of(cache, idx, &hash);
+	size_t i = sqfs_cache_find(shard, idx, hash);
+	size_t bucket;
+	
+	++shard->misses;
+	if (i != SQFS_CACHE_NIL) {
+		sqfs_cache_release(cache, shard, i);
+		sqfs_cache_lru_unlink(shard, i);
+		sqfs_cache_lru_push(cache, shard, i);
+		return sqfs_cache_entry(cache, shard, i);
 	}
-	return ret;
+	
+	if (shard->free_head == SQFS_CACHE_NIL)
+		sqfs_cache_evict(cache, shard, shard->lru_tail);
+	i = shard->free_head;
+	shard->free_head = shard->slots[i].hash_next;
+	++shard->used;
+	
+	bucket = sqfs_cache_bucket(shard, hash);
+	shard->slots[i].idx = idx;
+	shard->slots[i].cost = 0;
+	shard->slots[i].hash_next = shard->buckets[bucket];
+	shard->buckets[bucket] = i;
+	sqfs_cache_lru_push(cache, shard, i);
+	return sqfs_cache_entry(cache, shard, i);
 }
 
-void *sqfs_cache_add(sqfs_cache *cache, sqfs_cache_idx idx) {
-	size_t i = (cache->next++);
-	cache->next %= cache->count;
+void sqfs_cache_charge(sqfs_cache *cache, sqfs_cache_idx idx, size_t cost) {
+	uint64_t hash;
+	sqfs_cache_shard *shard = sqfs_cache_shard_of(cache, idx, &hash);
+	size_t i = sqfs_cache_find(shard, idx, hash);
 	
-	if (cache->idxs[i] != SQFS_CACHE_IDX_INVALID)
-		cache->dispose(sqfs_cache_entry(cache, i));
+	if (i == SQFS_CACHE_NIL || !cache->budget)
+		return;
+	ATOMIC_ADD64(&cache->budget->used,
+		(int64_t)cost - (int64_t)shard->slots[i].cost);
+	shard->slots[i].cost = cost;
+}
+
+void sqfs_cache_stat(sqfs_cache *cache, sqfs_cache_stats *stats) {
+	size_t i, j;
 	
-	cache->idxs[i] = idx;
-	return sqfs_cache_entry(cache, i);
+	memset(stats, 0, sizeof(*stats));
+	for (i = 0; i < cache->nshards; ++i) {
+		sqfs_cache_shard *shard = &cache->shards[i];
+		MUTEX_LOCK(&shard->mutex);
+		stats->count += shard->count;
+		stats->used += shard->used;
+		stats->hits += shard->hits;
+		stats->misses += shard->misses;
+		stats->evictions += shard->evictions;
+		for (j = shard->lru_head; j != SQFS_CACHE_NIL;
+				j = shard->slots[j].lru_next)
+			stats->bytes += shard->slots[j].cost;
+		MUTEX_UNLOCK(&shard->mutex);
+	}
+}
+
+sqfs_err sqfs_cache_budget_init(sqfs_cache_budget *budget, size_t limit) {
+	memset(budget, 0, sizeof(*budget));
+	budget->limit = (int64_t)limit;
+	return MUTEX_INIT(&budget->mutex) ? SQFS_ERR : SQFS_OK;
+}
+
+void sqfs_cache_budget_destroy(sqfs_cache_budget *budget) {
+	size_t i;
+	for (i = 0; i < budget->ncaches; ++i)
+		budget->caches[i]->budget = NULL;
+	budget->ncaches = 0;
+	MUTEX_DESTORY(&budget->mutex);
+}
+
+sqfs_err sqfs_cache_budget_attach(sqfs_cache_budget *budget, sqfs_cache *cache) {
+	if (budget->ncaches == SQFS_CACHE_BUDGET_MAX)
+		return SQFS_ERR;
+	budget->caches[budget->ncaches++] = cache;
+	cache->budget = budget;
+	return SQFS_OK;
+}
+
+void sqfs_cache_budget_trim(sqfs_cache_budget *budget) {
+	if (ATOMIC_ADD64(&budget->used, 0) <= budget->limit)
+		return;
+	
+	MUTEX_LOCK(&budget->mutex);
+	while (ATOMIC_ADD64(&budget->used, 0) > budget->limit) {
+		sqfs_cache *victim = NULL;
+		sqfs_cache_shard *victim_shard = NULL;
+		int64_t oldest = 0;
+		size_t c, i;
+		
+		/* The oldest entry overall is the oldest of the LRU tails */
+		for (c = 0; c < budget->ncaches; ++c) {
+			sqfs_cache *cache = budget->caches[c];
+			for (i = 0; i < cache->nshards; ++i) {
+				sqfs_cache_shard *shard = &cache->shards[i];
+				size_t tail;
+				MUTEX_LOCK(&shard->mutex);
+				tail = shard->lru_tail;
+				if (tail != SQFS_CACHE_NIL && shard->slots[tail].cost &&
+						(!victim || shard->slots[tail].tick < oldest)) {
+					victim = cache;
+					victim_shard = shard;
+					oldest = shard->slots[tail].tick;
+				}
+				MUTEX_UNLOCK(&shard->mutex);
+			}
+		}
+		if (!victim)
+			break;
+		
+		MUTEX_LOCK(&victim_shard->mutex);
+		if (victim_shard->lru_tail != SQFS_CACHE_NIL &&
+				victim_shard->slots[victim_shard->lru_tail].cost)
+			sqfs_cache_evict(victim, victim_shard, victim_shard->lru_tail);
+		MUTEX_UNLOCK(&victim_shard->mutex);
+	}
+	MUTEX_UNLOCK(&budget->mutex);
 }
 
 static void sqfs_block_cache_dispose(void *data) {
@@ -26,7 +26,11 @@
 #include "squash/squashfs_fs.h"
 
 #include <zlib.h>
-#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Codecs other than zlib are optional, each one is compiled in
+ * when SQFS_HAVE_<CODEC> is defined and its library is linked */
 
 static sqfs_err sqfs_decompressor_zlib(void *in, size_t insz,
 		void *out, size_t *outsz) {
@@ -38,7 +42,185 @@ static sqfs_err sqfs_decompressor_zlib(void *in, size_t insz,
 	return SQFS_OK;
 }
 
+/* The compressors use the same levels as mksquashfs by default */
+static sqfs_err sqfs_compressor_zlib(void *in, size_t insz,
+		void *out, size_t *outsz) {
+	uLongf zout = *outsz;
+	int zerr = compress2((Bytef*)out, &zout, in, insz, Z_BEST_COMPRESSION);
+	if (zerr != Z_OK)
+		return SQFS_ERR;
+	*outsz = zout;
+	return SQFS_OK;
+}
+
+#ifdef SQFS_HAVE_XZ
+#include <lzma.h>
+
+static sqfs_err sqfs_decompressor_xz(void *in, size_t insz,
+		void *out, size_t *outsz) {
+	/* FIXME: Save stream state, to minimize setup time? */
+	uint64_t memlimit = UINT64_MAX;
+	size_t inpos = 0, outpos = 0;
+	lzma_ret err = lzma_stream_buffer_decode(&memlimit, 0, NULL, in, &inpos, insz,
+		out, &outpos, *outsz);
+	if (err != LZMA_OK)
+		return SQFS_ERR;
+	*outsz = outpos;
+	return SQFS_OK;
+}
+
+static sqfs_err sqfs_compressor_xz(void *in, size_t insz,
+		void *out, size_t *outsz) {
+	size_t outpos = 0;
+	lzma_ret err = lzma_easy_buffer_encode(LZMA_PRESET_DEFAULT, LZMA_CHECK_CRC32,
+		NULL, in, insz, out, &outpos, *outsz);
+	if (err != LZMA_OK)
+		return SQFS_ERR;
+	*outsz = outpos;
+	return SQFS_OK;
+}
+#endif
+
+#ifdef SQFS_HAVE_LZO
+#include <lzo/lzo1x.h>
+
+static sqfs_err sqfs_decompressor_lzo(void *in, size_t insz,
+		void *out, size_t *outsz) {
+	lzo_uint lzout = *outsz;
+	int err = lzo1x_decompress_safe(in, insz, out, &lzout, NULL);
+	if (err != LZO_E_OK)
+		return SQFS_ERR;
+	*outsz = lzout;
+	return SQFS_OK;
+}
+
+static sqfs_err sqfs_compressor_lzo(void *in, size_t insz,
+		void *out, size_t *outsz) {
+	lzo_uint lzout = *outsz;
+	void *wrkmem;
+	int err;
+	
+	if (*outsz < SQFS_COMPRESS_BOUND(insz) || lzo_init() != LZO_E_OK)
+		return SQFS_ERR;
+	if (!(wrkmem = malloc(LZO1X_999_MEM_COMPRESS)))
+		return SQFS_ERR;
+	err = lzo1x_999_compress(in, insz, out, &lzout, wrkmem);
+	free(wrkmem);
+	if (err != LZO_E_OK)
+		return SQFS_ERR;
+	*outsz = lzout;
+	return SQFS_OK;
+}
+#endif
+
+#ifdef SQFS_HAVE_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+
+static sqfs_err sqfs_decompressor_lz4(void *in, size_t insz,
+		void *out, size_t *outsz) {
+	int lz4out = LZ4_decompress_safe(in, out, (int)insz, (int)*outsz);
+	if (lz4out < 0)
+		return SQFS_ERR;
+	*outsz = lz4out;
+	return SQFS_OK;
+}
+
+/* high compression costs build time only, decompression is as fast */
+static sqfs_err sqfs_compressor_lz4(void *in, size_t insz,
+		void *out, size_t *outsz) {
+	int lz4out = LZ4_compress_HC(in, out, (int)insz, (int)*outsz, 9);
+	if (lz4out <= 0)
+		return SQFS_ERR;
+	*outsz = lz4out;
+	return SQFS_OK;
+}
+#endif
+
+#ifdef SQFS_HAVE_ZSTD
+#include <zstd.h>
+
+static sqfs_err sqfs_decompressor_zstd(void *in, size_t insz,
+		void *out, size_t *outsz) {
+	size_t zout = ZSTD_decompress(out, *outsz, in, insz);
+	if (ZSTD_isError(zout))
+		return SQFS_ERR;
+	*outsz = zout;
+	return SQFS_OK;
+}
+
+static sqfs_err sqfs_compressor_zstd(void *in, size_t insz,
+		void *out, size_t *outsz) {
+	size_t zout = ZSTD_compress(out, *outsz, in, insz, 15);
+	if (ZSTD_isError(zout))
+		return SQFS_ERR;
+	*outsz = zout;
+	return SQFS_OK;
+}
+#endif
+
 sqfs_decompressor sqfs_decompressor_get(sqfs_compression_type type) {
-	assert(ZLIB_COMPRESSION == type);
-	return &sqfs_decompressor_zlib;
+	switch (type) {
+		case ZLIB_COMPRESSION: return &sqfs_decompressor_zlib;
+#ifdef SQFS_HAVE_XZ
+		case XZ_COMPRESSION: return &sqfs_decompressor_xz;
+#endif
+#ifdef SQFS_HAVE_LZO
+		case LZO_COMPRESSION: return &sqfs_decompressor_lzo;
+#endif
+#ifdef SQFS_HAVE_LZ4
+		case LZ4_COMPRESSION: return &sqfs_decompressor_lz4;
+#endif
+#ifdef SQFS_HAVE_ZSTD
+		case ZSTD_COMPRESSION: return &sqfs_decompressor_zstd;
+#endif
+		default: return NULL;
+	}
+}
+
+char *sqfs_compression_name(sqfs_compression_type type) {
+	switch (type) {
+		case ZLIB_COMPRESSION: return "zlib";
+		case LZMA_COMPRESSION: return "lzma";
+		case LZO_COMPRESSION: return "lzo";
+		case XZ_COMPRESSION: return "xz";
+		case LZ4_COMPRESSION: return "lz4";
+		case ZSTD_COMPRESSION: return "zstd";
+	}
+	return NULL;
+}
+
+sqfs_compression_type sqfs_compression_by_name(const char *name) {
+	if (0 == strcmp(name, "gzip") || 0 == strcmp(name, "zlib"))
+		return ZLIB_COMPRESSION;
+	if (0 == strcmp(name, "lzma"))
+		return LZMA_COMPRESSION;
+	if (0 == strcmp(name, "lzo"))
+		return LZO_COMPRESSION;
+	if (0 == strcmp(name, "xz"))
+		return XZ_COMPRESSION;
+	if (0 == strcmp(name, "lz4"))
+		return LZ4_COMPRESSION;
+	if (0 == strcmp(name, "zstd"))
+		return ZSTD_COMPRESSION;
+	return SQFS_COMP_UNKNOWN;
+}
+
+sqfs_compressor sqfs_compressor_get(sqfs_compression_type type) {
+	switch (type) {
+		case ZLIB_COMPRESSION: return &sqfs_compressor_zlib;
+#ifdef SQFS_HAVE_XZ
+		case XZ_COMPRESSION: return &sqfs_compressor_xz;
+#endif
+#ifdef SQFS_HAVE_LZO
+		case LZO_COMPRESSION: return &sqfs_compressor_lzo;
+#endif
+#ifdef SQFS_HAVE_LZ4
+		case LZ4_COMPRESSION: return &sqfs_compressor_lz4;
+#endif
+#ifdef SQFS_HAVE_ZSTD
+		case ZSTD_COMPRESSION: return &sqfs_compressor_zstd;
+#endif
+		default: return NULL;
+	}
 }
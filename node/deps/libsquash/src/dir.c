@@ -28,6 +28,7 @@
 
 #include "squash/fs.h"
 
+#include <stdlib.h>
 #include <string.h>
 
 /* Read some directory metadata, updating the dir structure as necessary */
@@ -156,6 +157,75 @@ short sqfs_dir_next(sqfs *fs, sqfs_dir *dir, sqfs_dir_entry *entry,
 	return 1;
 }
 
+sqfs_err sqfs_dir_each(sqfs *fs, sqfs_dir *dir, sqfs_dir_entry *entry,
+		sqfs_dir_entry_f *func, void *arg) {
+	sqfs_block *block = NULL;
+	sqfs_off_t block_pos = 0, next_pos = 0;
+	sqfs_err err = SQFS_OK;
+	
+	for (;;) {
+		sqfs_dir saved = *dir;
+		struct squashfs_dir_entry e;
+		const char *data;
+		size_t avail, need;
+		
+		if (dir->header.count == 0 && dir->offset >= dir->total)
+			break;
+		if (!block || block_pos != dir->cur.block) {
+			if (block)
+				sqfs_block_dispose(block);
+			block_pos = next_pos = dir->cur.block;
+			if ((err = sqfs_md_cache(fs, &next_pos, &block))) {
+				block = NULL;
+				break;
+			}
+		}
+		data = (const char*)block->data + dir->cur.offset;
+		avail = block->size - dir->cur.offset;
+		need = (dir->header.count == 0 ? sizeof(dir->header) : 0) + sizeof(e);
+		if (avail >= need) {
+			memcpy(&e, data + need - sizeof(e), sizeof(e));
+			need += e.size + 1;
+		}
+		
+		if (avail < need) {
+			/* split across two blocks */
+			if (!sqfs_dir_next(fs, dir, entry, &err))
+				break;
+		} else {
+			entry->offset = dir->offset;
+			if (dir->header.count == 0) {
+				memcpy(&dir->header, data, sizeof(dir->header));
+				++(dir->header.count); /* biased by one */
+			}
+			--(dir->header.count);
+			entry->type = e.type;
+			entry->name_size = e.size + 1;
+			entry->inode = ((uint64_t)dir->header.start_block << 16) + e.offset;
+			/* e.inode_number is signed */
+			entry->inode_number = dir->header.inode_number + (int16_t)e.inode_number;
+			if (entry->name)
+				memcpy(entry->name, data + need - entry->name_size, entry->name_size);
+			
+			dir->offset += need;
+			dir->cur.offset += need;
+			if (dir->cur.offset == block->size) {
+				dir->cur.block = next_pos;
+				dir->cur.offset = 0;
+			}
+			entry->next_offset = dir->offset;
+		}
+		
+		if (func(entry, arg)) {
+			*dir = saved;
+			break;
+		}
+	}
+	if (block)
+		sqfs_block_dispose(block);
+	return err;
+}
+
 
 static sqfs_err sqfs_dir_ff_header(sqfs *fs, sqfs_inode *inode,
 		sqfs_dir *dir, sqfs_dir_header_f func, void *arg) {
@@ -310,6 +380,124 @@ static sqfs_err clear_dot_dot(char *path)
 	return SQFS_OK;
 }
 
+typedef struct {
+	char *key;		/* the entry belongs to this key, not just to its hash */
+	size_t key_len;
+	short found;	/* negative entry if 0 */
+	sqfs_inode inode;
+} sqfs_lookup_cache_entry;
+
+/* Keys start with the inode number of the directory looked up from,
+ * and follow_link for whole paths */
+#define SQFS_LOOKUP_KEY_PREFIX (sizeof(uint32_t) + 1)
+
+static void sqfs_lookup_cache_dispose(void *data) {
+	sqfs_lookup_cache_entry *entry = (sqfs_lookup_cache_entry*)data;
+	free(entry->key);
+}
+
+sqfs_err sqfs_lookup_cache_init(sqfs_cache *cache, size_t count) {
+	return sqfs_cache_init(cache, sizeof(sqfs_lookup_cache_entry), count,
+		&sqfs_lookup_cache_dispose);
+}
+
+/* 64-bit FNV-1a, never SQFS_CACHE_IDX_INVALID */
+static sqfs_cache_idx sqfs_lookup_key_hash(const char *key, size_t key_len) {
+	uint64_t h = 14695981039346656037ULL;
+	size_t i;
+	
+	for (i = 0; i < key_len; ++i) {
+		h ^= (uint8_t)key[i];
+		h *= 1099511628211ULL;
+	}
+	return h == SQFS_CACHE_IDX_INVALID ? 1 : h;
+}
+
+/* Returns 1 and fills in *found and *inode on a hit */
+static short sqfs_lookup_cache_get(sqfs_cache *cache, const char *key,
+		size_t key_len, short *found, sqfs_inode *inode) {
+	sqfs_cache_idx idx = sqfs_lookup_key_hash(key, key_len);
+	MUTEX *mutex = sqfs_cache_mutex(cache, idx);
+	sqfs_lookup_cache_entry *entry;
+	short hit = 0;
+	
+	MUTEX_LOCK(mutex);
+	entry = sqfs_cache_get(cache, idx);
+	if (entry && entry->key_len == key_len &&
+			0 == memcmp(entry->key, key, key_len)) {
+		*found = entry->found;
+		if (*found)
+			*inode = entry->inode;
+		hit = 1;
+	}
+	MUTEX_UNLOCK(mutex);
+	return hit;
+}
+
+/* Best effort, nothing is cached if the key cannot be copied */
+static void sqfs_lookup_cache_add(sqfs_cache *cache, const char *key,
+		size_t key_len, short found, sqfs_inode *inode) {
+	sqfs_cache_idx idx = sqfs_lookup_key_hash(key, key_len);
+	MUTEX *mutex = sqfs_cache_mutex(cache, idx);
+	sqfs_lookup_cache_entry *entry;
+	char *copy = malloc(key_len);
+	
+	if (!copy)
+		return;
+	memcpy(copy, key, key_len);
+	
+	MUTEX_LOCK(mutex);
+	entry = sqfs_cache_add(cache, idx);
+	entry->key = copy;
+	entry->key_len = key_len;
+	entry->found = found;
+	if (found)
+		entry->inode = *inode;
+	sqfs_cache_charge(cache, idx, sizeof(sqfs_lookup_cache_entry) + key_len);
+	MUTEX_UNLOCK(mutex);
+	if (cache->budget)
+		sqfs_cache_budget_trim(cache->budget);
+}
+
+static void sqfs_lookup_key_prefix(char *key, sqfs_inode *inode,
+		short follow_link) {
+	uint32_t num = inode->base.inode_number;
+	memcpy(key, &num, sizeof(num));
+	key[sizeof(num)] = follow_link ? 1 : 0;
+}
+
+/* Replaces the directory *inode with its child name */
+static sqfs_err sqfs_lookup_name(sqfs *fs, sqfs_inode *inode,
+		const char *name, size_t size, sqfs_dir_entry *entry, short *found) {
+	char key[SQFS_LOOKUP_KEY_PREFIX + SQUASHFS_NAME_LEN];
+	size_t key_len = SQFS_LOOKUP_KEY_PREFIX + size;
+	short cacheable = size <= SQUASHFS_NAME_LEN;
+	sqfs_err err;
+	
+	if (cacheable) {
+		sqfs_lookup_key_prefix(key, inode, 0);
+		memcpy(key + SQFS_LOOKUP_KEY_PREFIX, name, size);
+		if (sqfs_lookup_cache_get(&fs->name_cache, key, key_len, found, inode))
+			return SQFS_OK;
+	}
+	
+	if ((err = sqfs_dir_lookup(fs, inode, name, size, entry, found)))
+		return err;
+	if (*found && (err = sqfs_inode_get(fs, inode, sqfs_dentry_inode(entry))))
+		return err;
+	if (cacheable)
+		sqfs_lookup_cache_add(&fs->name_cache, key, key_len, *found, inode);
+	return SQFS_OK;
+}
+
+void squash_lookup_stat(sqfs *fs, sqfs_cache_stats *paths,
+		sqfs_cache_stats *names) {
+	if (paths)
+		sqfs_cache_stat(&fs->path_cache, paths);
+	if (names)
+		sqfs_cache_stat(&fs->name_cache, names);
+}
+
 sqfs_err squash_follow_link(sqfs *fs, const char *path, sqfs_inode *node) {
 
 	sqfs_err error;
@@ -395,7 +583,8 @@ sqfs_err sqfs_lookup_path_inner(sqfs *fs, sqfs_inode *inode, const char *incomin
 	sqfs_name buf;
 	sqfs_path path_here;
 	sqfs_dir_entry entry;
-	char *path, *path0;
+	char *key, *path, *path0;
+	size_t key_len;
 	short is_last_component;
 	memset(&buf, 0, sizeof(sqfs_name));
 	memset(&entry, 0, sizeof(sqfs_dir_entry));
@@ -403,10 +592,14 @@ sqfs_err sqfs_lookup_path_inner(sqfs *fs, sqfs_inode *inode, const char *incomin
 	*found = 0;
 	sqfs_dentry_init(&entry, buf);
 
-	path = strdup(incoming_path);
-	if (NULL == path) {
+	/* The path is normalized in place behind the key prefix */
+	key = malloc(SQFS_LOOKUP_KEY_PREFIX + strlen(incoming_path) + 1);
+	if (NULL == key) {
 		return SQFS_ERR;
 	}
+	sqfs_lookup_key_prefix(key, inode, follow_link);
+	path = key + SQFS_LOOKUP_KEY_PREFIX;
+	strcpy(path, incoming_path);
 	path0 = path;
 
 	err = clear_dot_dot(path);
@@ -415,6 +608,18 @@ sqfs_err sqfs_lookup_path_inner(sqfs *fs, sqfs_inode *inode, const char *incomin
 		goto exit;
 	}
 	
+	if (fs->path_index && inode->base.inode_number == fs->path_index_root &&
+			sqfs_path_index_absent(fs, path0)) {
+		ret = SQFS_OK; /* not found */
+		goto exit;
+	}
+	
+	key_len = SQFS_LOOKUP_KEY_PREFIX + strlen(path0);
+	if (sqfs_lookup_cache_get(&fs->path_cache, key, key_len, found, inode)) {
+		ret = SQFS_OK;
+		goto exit;
+	}
+	
 	while (*path) {
 		const char *name;
 		size_t size;
@@ -435,18 +640,15 @@ sqfs_err sqfs_lookup_path_inner(sqfs *fs, sqfs_inode *inode, const char *incomin
 			/* interpret dot */
 			continue;
 		}
-		if ((err = sqfs_dir_lookup(fs, inode, name, size, &entry, found))) {
+		if ((err = sqfs_lookup_name(fs, inode, name, size, &entry, found))) {
 			ret = err;
 			goto exit;
 		}
 		if (!(*found)) {
+			sqfs_lookup_cache_add(&fs->path_cache, key, key_len, 0, NULL);
 			ret = SQFS_OK; /* not found */
 			goto exit;
 		}
-		if ((err = sqfs_inode_get(fs, inode, sqfs_dentry_inode(&entry)))) {
-			ret = err;
-			goto exit;
-		}
 		if (!*path) {
 			is_last_component = 1;
 		} else if (path0 + strlen(path0) - 1 == path) {
@@ -474,9 +676,10 @@ sqfs_err sqfs_lookup_path_inner(sqfs *fs, sqfs_inode *inode, const char *incomin
 	}
 	
 	*found = 1;
+	sqfs_lookup_cache_add(&fs->path_cache, key, key_len, 1, inode);
 	ret = SQFS_OK;
 exit:
-	free(path0);
+	free(key);
 	return ret;
 }
 
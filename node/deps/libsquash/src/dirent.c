@@ -8,6 +8,7 @@
 
 #include "squash.h"
 #include <stdlib.h>
+#include <stddef.h>
 
 #include <assert.h>
 
@@ -17,6 +18,8 @@ SQUASH_DIR *squash_opendir_inner(sqfs *fs, const char *filename, short follow_li
 	short found;
 	SQUASH_DIR *dir = calloc(1, sizeof(SQUASH_DIR));
 	int *handle;
+	short adopted = 0;
+	int saved_errno;
 	
 	if (NULL == dir)
 	{
@@ -32,12 +35,13 @@ SQUASH_DIR *squash_opendir_inner(sqfs *fs, const char *filename, short follow_li
 	{
 		goto failure;
 	}
-	handle = (int *)(squash_global_fdtable.fds[dir->fd]->payload);
-
-	MUTEX_LOCK(&squash_global_mutex);
+	handle = (int *)(SQUASH_VFD_FILE(dir->fd)->payload);
+	if (squash_vfd_set_payload(dir->fd, (void *)dir))
+	{
+		goto failure;
+	}
 	free(handle);
-	squash_global_fdtable.fds[dir->fd]->payload = (void *)dir;
-	MUTEX_UNLOCK(&squash_global_mutex);
+	adopted = 1;
 
 	dir->actual_nr = 0;
 	dir->loc = 0;
@@ -66,7 +70,16 @@ failure:
 	if (!errno) {
 		errno = ENOENT;
 	}
-	free(dir);
+	saved_errno = errno;
+	free(dir->filename);
+	if (-1 != dir->fd) {
+		// once adopted, dir is freed by squash_close as `payload`
+		squash_close(dir->fd);
+	}
+	if (!adopted) {
+		free(dir);
+	}
+	errno = saved_errno;
 	return NULL;
 }
 
@@ -96,6 +109,37 @@ int squash_closedir(SQUASH_DIR *dirp)
 	return 0;
 }
 
+// TODO special treatment of L types
+static unsigned char squash_dirent_type(int type)
+{
+	switch (type)
+	{
+	case SQUASHFS_DIR_TYPE:
+	case SQUASHFS_LDIR_TYPE:
+		return DT_DIR;
+	case SQUASHFS_REG_TYPE:
+	case SQUASHFS_LREG_TYPE:
+		return DT_REG;
+	case SQUASHFS_SYMLINK_TYPE:
+	case SQUASHFS_LSYMLINK_TYPE:
+		return DT_LNK;
+	case SQUASHFS_BLKDEV_TYPE:
+	case SQUASHFS_LBLKDEV_TYPE:
+		return DT_BLK;
+	case SQUASHFS_CHRDEV_TYPE:
+	case SQUASHFS_LCHRDEV_TYPE:
+		return DT_CHR;
+	case SQUASHFS_FIFO_TYPE:
+	case SQUASHFS_LFIFO_TYPE:
+		return DT_FIFO;
+	case SQUASHFS_SOCKET_TYPE:
+	case SQUASHFS_LSOCKET_TYPE:
+		return DT_SOCK;
+	default:
+		return DT_UNKNOWN;
+	}
+}
+
 struct SQUASH_DIRENT * squash_readdir(SQUASH_DIR *dirp)
 {
 	sqfs_err error;
@@ -148,41 +192,7 @@ struct SQUASH_DIRENT * squash_readdir(SQUASH_DIR *dirp)
 			sysentry->d_namlen = minsize;
 #endif
 			sysentry->d_name[minsize] = '\0';
-			// TODO special treatment of L types
-			switch (entry->type)
-			{	
-			case SQUASHFS_DIR_TYPE:
-			case SQUASHFS_LDIR_TYPE:
-				sysentry->d_type = DT_DIR;
-				break;
-			case SQUASHFS_REG_TYPE:
-			case SQUASHFS_LREG_TYPE:
-				sysentry->d_type = DT_REG;
-				break;
-			case SQUASHFS_SYMLINK_TYPE:
-			case SQUASHFS_LSYMLINK_TYPE:
-				sysentry->d_type = DT_LNK;
-				break;
-			case SQUASHFS_BLKDEV_TYPE:
-			case SQUASHFS_LBLKDEV_TYPE:
-				sysentry->d_type = DT_BLK;
-				break;
-			case SQUASHFS_CHRDEV_TYPE:
-			case SQUASHFS_LCHRDEV_TYPE:
-				sysentry->d_type = DT_CHR;
-				break;
-			case SQUASHFS_FIFO_TYPE:
-			case SQUASHFS_LFIFO_TYPE:
-				sysentry->d_type = DT_FIFO;
-				break;
-			case SQUASHFS_SOCKET_TYPE:
-			case SQUASHFS_LSOCKET_TYPE:
-				sysentry->d_type = DT_SOCK;
-				break;
-			default:
-				sysentry->d_type = DT_UNKNOWN;
-				break;
-			}
+			sysentry->d_type = squash_dirent_type(entry->type);
 			dirp->actual_nr += 1;
 		}
 	}
@@ -194,6 +204,58 @@ struct SQUASH_DIRENT * squash_readdir(SQUASH_DIR *dirp)
 	return &dirp->entries[dirp->loc - 1].sysentry;
 }
 
+/* Records are aligned for their d_ino */
+#define SQUASH_DENT_ALIGN(size) (((size) + sizeof(uint32_t) - 1) & ~(sizeof(uint32_t) - 1))
+
+struct squash_getdents_out {
+	char *buf;
+	size_t nbytes;
+	size_t filled;
+};
+
+static short squash_getdents_fill(sqfs_dir_entry *entry, void *arg)
+{
+	struct squash_getdents_out *out = (struct squash_getdents_out *)arg;
+	struct squash_dent *dent;
+	size_t reclen;
+
+	reclen = SQUASH_DENT_ALIGN(offsetof(struct squash_dent, d_name) + entry->name_size + 1);
+	if (out->nbytes - out->filled < reclen) {
+		return 1;
+	}
+	dent = (struct squash_dent *)(out->buf + out->filled);
+	dent->d_ino = entry->inode_number;
+	dent->d_reclen = (unsigned short)reclen;
+	dent->d_type = squash_dirent_type(entry->type);
+	memcpy(dent->d_name, entry->name, entry->name_size);
+	dent->d_name[entry->name_size] = '\0';
+	out->filled += reclen;
+	return 0;
+}
+
+ssize_t squash_getdents(SQUASH_DIR *dirp, void *buf, size_t nbytes)
+{
+	struct squash_getdents_out out;
+	sqfs_dir_entry entry;
+	sqfs_name name;
+	sqfs_dir saved = dirp->dir;
+
+	out.buf = (char *)buf;
+	out.nbytes = nbytes;
+	out.filled = 0;
+	sqfs_dentry_init(&entry, name);
+	if (SQFS_OK != sqfs_dir_each(dirp->fs, &dirp->dir, &entry, squash_getdents_fill, &out)) {
+		dirp->dir = saved;
+		errno = EIO;
+		return -1;
+	}
+	if (0 == out.filled && (dirp->dir.header.count || dirp->dir.offset < dirp->dir.total)) {
+		errno = EINVAL;
+		return -1;
+	}
+	return (ssize_t)out.filled;
+}
+
 long squash_telldir(SQUASH_DIR *dirp)
 {
 	return dirp->loc;
@@ -9,10 +9,13 @@
 #include "squash.h"
 #include <time.h>
 #include <stdlib.h>
+#include <fcntl.h>
 
 #ifdef _WIN32
 #include <Windows.h>
 #include <Shlwapi.h>
+#include <io.h>
+#include <limits.h>
 SQUASH_OS_PATH squash_tmpdir()
 {
 	const int squash_win32_buf_sz = 32767;
@@ -92,8 +95,22 @@ SQUASH_OS_PATH squash_tmpf(SQUASH_OS_PATH tmpdir, const char *ext_name)
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <sys/syscall.h>
+#ifdef SYS_memfd_create
+#define SQUASH_EXTRACT_HAVE_MEMFD
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+#ifndef MFD_EXEC
+#define MFD_EXEC 0x0010U
+#endif
+#endif
+#endif
+
 SQUASH_OS_PATH squash_tmpdir()
 {
 	char *try_try;
@@ -145,75 +162,669 @@ SQUASH_OS_PATH squash_tmpf(SQUASH_OS_PATH tmpdir, const char *ext_name)
 }
 #endif // _WIN32
 
-static SQUASH_OS_PATH squash_uncached_extract(sqfs *fs, const char *path, const char *ext_name)
+/* Files are copied by chunks of this many bytes, one chunk per write at
+ * an offset that is a multiple of it. A multiple of every block size. */
+#ifndef SQUASH_EXTRACT_CHUNK
+#define SQUASH_EXTRACT_CHUNK (1024 * 1024)
+#endif
+/* Upper bound of the number of threads copying a file */
+#define SQUASH_EXTRACT_THREADS_MAX 16
+#define SQUASH_EXTRACT_BUCKETS 64
+
+static size_t squash_extract_threads = SQUASH_EXTRACT_THREADS_DEFAULT;
+static short squash_extract_memfd_enabled = 1;
+
+void squash_set_extract_threads(size_t threads)
 {
-	static SQUASH_OS_PATH tmpdir = NULL;
-	FILE *fp;
-	int fd;
-	SQUASH_OS_PATH tmpf;
-	size_t size;
-	ssize_t ssize;
-	char buffer[16 * 1024];
-	sqfs_off_t offset;
-	struct squash_file *file;
+	squash_extract_threads = threads;
+}
 
-	fd = squash_open(fs, path);
-	if (-1 == fd) {
-		return NULL;
+void squash_set_extract_memfd(short enabled)
+{
+	squash_extract_memfd_enabled = enabled;
+}
+
+/* The environment variable SQUASH_EXTRACT_THREADS takes precedence over
+ * squash_set_extract_threads() */
+static size_t squash_extract_nthreads()
+{
+	const char *env = getenv("SQUASH_EXTRACT_THREADS");
+	size_t threads = squash_extract_threads;
+
+	if (env && *env) {
+		char *end;
+		unsigned long value = strtoul(env, &end, 10);
+		if ('\0' == *end)
+			threads = value;
+	}
+	if (threads < 1)
+		threads = 1;
+	if (threads > SQUASH_EXTRACT_THREADS_MAX)
+		threads = SQUASH_EXTRACT_THREADS_MAX;
+	return threads;
+}
+
+static volatile int64_t squash_extract_files;
+static volatile int64_t squash_extract_memfds;
+static volatile int64_t squash_extract_hits;
+static volatile int64_t squash_extract_reused;
+static volatile int64_t squash_extract_bytes;
+static volatile int64_t squash_extract_nanoseconds;
+
+void squash_extract_stat(struct squash_extract_stats *stats)
+{
+	stats->files = ATOMIC_ADD64(&squash_extract_files, 0);
+	stats->memfds = ATOMIC_ADD64(&squash_extract_memfds, 0);
+	stats->hits = ATOMIC_ADD64(&squash_extract_hits, 0);
+	stats->reused = ATOMIC_ADD64(&squash_extract_reused, 0);
+	stats->bytes = ATOMIC_ADD64(&squash_extract_bytes, 0);
+	stats->nanoseconds = ATOMIC_ADD64(&squash_extract_nanoseconds, 0);
+}
+
+static int64_t squash_extract_clock()
+{
+#ifdef _WIN32
+	LARGE_INTEGER counter, frequency;
+	QueryPerformanceCounter(&counter);
+	QueryPerformanceFrequency(&frequency);
+	return (int64_t)((double)counter.QuadPart * 1e9 / (double)frequency.QuadPart);
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (int64_t)tv.tv_sec * 1000000000 + (int64_t)tv.tv_usec * 1000;
+#endif
+}
+
+struct squash_extract_job {
+	int vfd;
+	const char *mapped;	/* the file, if stored uncompressed in the image */
+	sqfs_off_t size;
+	long nchunks;
+	volatile long next_chunk;
+	volatile long failed;
+	int saved_errno;
+	int out;
+#ifdef _WIN32
+	MUTEX write_mutex;	/* the file position is shared */
+#endif
+};
+
+static void squash_extract_fail(struct squash_extract_job *job, int error)
+{
+	if (1 == ATOMIC_INCREMENT(&job->failed)) {
+		job->saved_errno = error;
 	}
-	if (NULL == tmpdir) {
-		tmpdir = squash_tmpdir();
+}
+
+static int squash_extract_pwrite(struct squash_extract_job *job,
+	const char *data, size_t size, sqfs_off_t offset)
+{
+#ifdef _WIN32
+	int ret = 0;
+	MUTEX_LOCK(&job->write_mutex);
+	if (-1 == _lseeki64(job->out, offset, SEEK_SET)) {
+		ret = -1;
 	}
-	if (NULL == tmpdir) {
-		return NULL;
+	while (0 == ret && size > 0) {
+		int written = _write(job->out, data, size > INT_MAX ? INT_MAX : (unsigned)size);
+		if (written <= 0) {
+			ret = -1;
+			break;
+		}
+		data += written;
+		size -= written;
 	}
-	tmpf = squash_tmpf(tmpdir, ext_name);
-	if (NULL == tmpf) {
+	MUTEX_UNLOCK(&job->write_mutex);
+	return ret;
+#else
+	while (size > 0) {
+		ssize_t written = pwrite(job->out, data, size, offset);
+		if (-1 == written && EINTR == errno) {
+			continue;
+		}
+		if (written <= 0) {
+			return -1;
+		}
+		data += written;
+		size -= written;
+		offset += written;
+	}
+	return 0;
+#endif
+}
+
+/* Takes the next chunk not taken by any other thread, until none is left */
+static THREAD_RETURN squash_extract_worker(void *arg)
+{
+	struct squash_extract_job *job = (struct squash_extract_job *)arg;
+	char *buffer = NULL;
+	long chunk;
+
+	if (NULL == job->mapped) {
+		buffer = malloc(SQUASH_EXTRACT_CHUNK);
+		if (NULL == buffer) {
+			squash_extract_fail(job, ENOMEM);
+			return 0;
+		}
+	}
+	while (!job->failed && (chunk = ATOMIC_INCREMENT(&job->next_chunk) - 1) < job->nchunks) {
+		sqfs_off_t offset = (sqfs_off_t)chunk * SQUASH_EXTRACT_CHUNK;
+		size_t want = SQUASH_EXTRACT_CHUNK;
+		const char *data;
+
+		if (offset + (sqfs_off_t)want > job->size) {
+			want = (size_t)(job->size - offset);
+		}
+		if (job->mapped) {
+			data = job->mapped + offset;
+		} else {
+			if ((ssize_t)want != squash_pread(job->vfd, buffer, want, offset)) {
+				squash_extract_fail(job, EIO);
+				break;
+			}
+			data = buffer;
+		}
+		if (squash_extract_pwrite(job, data, want, offset)) {
+			squash_extract_fail(job, errno);
+			break;
+		}
+	}
+	free(buffer);
+	return 0;
+}
+
+/* Creates a temporary file that did not exist before */
+static int squash_extract_create(SQUASH_OS_PATH tmpdir, const char *ext_name, SQUASH_OS_PATH *tmpf)
+{
+	int out, try_cnt;
+
+	for (try_cnt = 0; try_cnt < 3; ++try_cnt) {
+		*tmpf = squash_tmpf(tmpdir, ext_name);
+		if (NULL == *tmpf) {
+			return -1;
+		}
+#ifdef _WIN32
+		out = _wopen(*tmpf, _O_WRONLY | _O_CREAT | _O_EXCL | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+		out = open(*tmpf, O_WRONLY | O_CREAT | O_EXCL, 0666);
+#endif
+		if (-1 != out || EEXIST != errno) {
+			if (-1 == out) {
+				free((void *)*tmpf);
+			}
+			return out;
+		}
+		/* another thread got the same name first */
+		free((void *)*tmpf);
+	}
+	return -1;
+}
+
+#ifdef SQUASH_EXTRACT_HAVE_MEMFD
+#define SQUASH_EXTRACT_MEMFD_PREFIX "/proc/self/fd/"
+
+/* The environment variable SQUASH_EXTRACT_MEMFD takes precedence over
+ * squash_set_extract_memfd() */
+static short squash_extract_memfd_wanted()
+{
+	const char *env = getenv("SQUASH_EXTRACT_MEMFD");
+
+	if (env && *env) {
+		return 0 != strcmp(env, "0");
+	}
+	return squash_extract_memfd_enabled;
+}
+
+/* Creates an anonymous file in memory named after path, which goes away
+ * along with the process, or returns -1 for the caller to fall back to
+ * the temporary folder, e.g. on kernels older than 3.17 */
+static int squash_extract_memfd_create(const char *path)
+{
+	char name[128];
+	const char *base = strrchr(path, '/');
+	int out;
+
+	strncpy(name, base ? base + 1 : path, sizeof(name) - 1);
+	name[sizeof(name) - 1] = '\0';
+	/* MFD_EXEC keeps it executable where vm.memfd_noexec would not */
+	out = (int)syscall(SYS_memfd_create, name, MFD_CLOEXEC | MFD_EXEC);
+	if (-1 == out && EINVAL == errno) {
+		out = (int)syscall(SYS_memfd_create, name, MFD_CLOEXEC);
+	}
+	return out;
+}
+
+/* Trades the writable descriptor of a filled memfd for a read-only one,
+ * since execve() fails with ETXTBSY while the file is open for writing,
+ * and returns the path through /proc that dlopen() and execve() take.
+ * The new descriptor is close-on-exec as well: a process spawning the
+ * file, or handing its path to an interpreter, lets only that child
+ * inherit it, see squash_extract_memfd(). */
+static SQUASH_OS_PATH squash_extract_memfd_seal(int out)
+{
+	char link[sizeof(SQUASH_EXTRACT_MEMFD_PREFIX) + 16];
+	char *ret;
+	int in;
+
+	snprintf(link, sizeof(link), SQUASH_EXTRACT_MEMFD_PREFIX "%d", out);
+	in = open(link, O_RDONLY | O_CLOEXEC);
+	close(out);
+	if (-1 == in) {
 		return NULL;
 	}
+	snprintf(link, sizeof(link), SQUASH_EXTRACT_MEMFD_PREFIX "%d", in);
+	ret = strdup(link);
+	if (NULL == ret) {
+		close(in);
+	}
+	return ret;
+}
+#endif
+
+int squash_extract_memfd(const char *path)
+{
+#ifdef SQUASH_EXTRACT_HAVE_MEMFD
+	char target[16];
+	const char *p;
+	ssize_t len;
+	int fd = 0;
+
+	if (NULL == path || 0 != strncmp(path, SQUASH_EXTRACT_MEMFD_PREFIX, sizeof(SQUASH_EXTRACT_MEMFD_PREFIX) - 1)) {
+		return -1;
+	}
+	/* no atoi(), which is not async-signal-safe */
+	for (p = path + sizeof(SQUASH_EXTRACT_MEMFD_PREFIX) - 1; '0' <= *p && *p <= '9'; ++p) {
+		fd = fd * 10 + (*p - '0');
+	}
+	if (*p || p == path + sizeof(SQUASH_EXTRACT_MEMFD_PREFIX) - 1) {
+		return -1;
+	}
+	/* rather than some other descriptor that the app named so */
+	len = readlink(path, target, sizeof(target));
+	if (len < (ssize_t)sizeof("/memfd:") - 1 ||
+			0 != memcmp(target, "/memfd:", sizeof("/memfd:") - 1)) {
+		return -1;
+	}
+	return fd;
+#else
+	return -1;
+#endif
+}
+
+/* Removes a file returned by squash_uncached_extract() */
+static void squash_extract_remove(SQUASH_OS_PATH tmpf)
+{
 #ifdef _WIN32
-	fp = _wfopen(tmpf, L"wb");
+	DeleteFileW(tmpf);
 #else
-	fp = fopen(tmpf, "wb");
+	int fd = squash_extract_memfd(tmpf);
+
+	if (-1 != fd) {
+		close(fd);
+		return;
+	}
+	unlink(tmpf);
 #endif
-	if (NULL == fp) {
-		free(tmpf);
+}
+
+/* Extracts path into a new file of dir, or of the temporary folder if
+ * dir is NULL, where a memfd may be used instead */
+static SQUASH_OS_PATH squash_uncached_extract(sqfs *fs, const char *path, const char *ext_name, SQUASH_OS_PATH dir)
+{
+	static SQUASH_OS_PATH tmpdir = NULL;
+	SQUASH_OS_PATH tmpf = NULL;
+	struct squash_extract_job job;
+	struct squash_file *file;
+	THREAD threads[SQUASH_EXTRACT_THREADS_MAX];
+	size_t nthreads, i, mapped_size;
+	int64_t started = squash_extract_clock();
+	short memfd = 0;
+	int closed;
+
+	memset(&job, 0, sizeof(job));
+	job.vfd = squash_open(fs, path);
+	if (-1 == job.vfd) {
+		return NULL;
+	}
+	file = SQUASH_VFD_FILE(job.vfd);
+	if (!S_ISREG(file->node.base.mode)) {
+		int error = S_ISDIR(file->node.base.mode) ? EISDIR : EINVAL;
+		squash_close(job.vfd);
+		errno = error;
 		return NULL;
 	}
-	file = SQUASH_VFD_FILE(fd);
-	offset = file->node.xtra.reg.file_size;
-	while (offset > 0) {
-		ssize = squash_read(fd, buffer, 16 * 1024);
-		if (ssize <= 0) {
-			fclose(fp);
-			free(tmpf);
+	job.size = file->node.xtra.reg.file_size;
+	job.nchunks = (long)((job.size + SQUASH_EXTRACT_CHUNK - 1) / SQUASH_EXTRACT_CHUNK);
+	/* stored files are copied straight out of the image */
+	job.mapped = squash_map(fs, path, &mapped_size);
+
+#ifdef SQUASH_EXTRACT_HAVE_MEMFD
+	/* a memfd has no name to give an extension to */
+	if (NULL == ext_name && NULL == dir && squash_extract_memfd_wanted()) {
+		job.out = squash_extract_memfd_create(path);
+		memfd = -1 != job.out;
+	}
+#endif
+	if (!memfd) {
+		if (NULL == dir) {
+			MUTEX_LOCK(&squash_global_mutex);
+			if (NULL == tmpdir) {
+				tmpdir = squash_tmpdir();
+			}
+			MUTEX_UNLOCK(&squash_global_mutex);
+			dir = tmpdir;
+		}
+		if (NULL == dir) {
+			squash_close(job.vfd);
 			return NULL;
 		}
-		offset -= ssize;
-		size = fwrite(buffer, ssize, 1, fp);
-		if (size != 1) {
-			fclose(fp);
-			free(tmpf);
+		job.out = squash_extract_create(dir, ext_name, &tmpf);
+		if (-1 == job.out) {
+			squash_close(job.vfd);
 			return NULL;
 		}
 	}
-	assert(0 == offset);
-	fclose(fp);
+
+	nthreads = squash_extract_nthreads();
+	if ((size_t)job.nchunks < nthreads) {
+		nthreads = job.nchunks;
+	}
+#ifdef _WIN32
+	MUTEX_INIT(&job.write_mutex);
+#endif
+	/* this thread is a worker too */
+	for (i = 0; i + 1 < nthreads; ++i) {
+		if (THREAD_CREATE(&threads[i], squash_extract_worker, &job)) {
+			break;
+		}
+	}
+	nthreads = i;
+	squash_extract_worker(&job);
+	for (i = 0; i < nthreads; ++i) {
+		THREAD_JOIN(&threads[i]);
+	}
+#ifdef _WIN32
+	MUTEX_DESTORY(&job.write_mutex);
+	closed = _close(job.out);
+#else
+	closed = 0;
+	if (!memfd) {
+		closed = close(job.out);
+	}
+#endif
+	squash_close(job.vfd);
+
+#ifdef SQUASH_EXTRACT_HAVE_MEMFD
+	if (memfd) {
+		if (job.failed) {
+			close(job.out);
+		} else if (NULL == (tmpf = squash_extract_memfd_seal(job.out))) {
+			closed = -1;
+		}
+	}
+#endif
+	if (job.failed || -1 == closed) {
+		if (tmpf) {
+			squash_extract_remove(tmpf);
+			free((void *)tmpf);
+		}
+		errno = job.failed ? job.saved_errno : EIO;
+		return NULL;
+	}
+	ATOMIC_ADD64(&squash_extract_files, 1);
+	if (memfd) {
+		ATOMIC_ADD64(&squash_extract_memfds, 1);
+	}
+	ATOMIC_ADD64(&squash_extract_bytes, job.size);
+	ATOMIC_ADD64(&squash_extract_nanoseconds, squash_extract_clock() - started);
 	return tmpf;
 }
 
+#ifndef _WIN32
+#include <sys/file.h>
+
+/* Files of the persistent cache are named by the hash of their content
+ * that squash_mkfs -content-hashes records. Images without it, such as
+ * those of mksquashfs, get a hash of what they hold of the file instead:
+ * its blocks as stored, compressed or not, and its tail as it reads, since
+ * the fragment holding it is shared with other files. Hashing the blocks
+ * as stored costs a read of the mapped image, but no decompression. */
+static uint64_t squash_extract_hash(uint64_t h, const uint8_t *data, size_t size)
+{
+	uint64_t word;
+
+	while (size >= sizeof(word)) {
+		memcpy(&word, data, sizeof(word));
+		h = (h ^ word) * 0x9e3779b97f4a7c15ULL;
+		h ^= h >> 29;
+		data += sizeof(word);
+		size -= sizeof(word);
+	}
+	while (size--) {
+		h = (h ^ *data++) * 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static sqfs_err squash_extract_key(sqfs *fs, sqfs_inode *inode, uint64_t *key)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	uint64_t file_size = inode->xtra.reg.file_size;
+	size_t xattr_size = sizeof(*key);
+	sqfs_blocklist bl;
+	sqfs_err err;
+
+	if (SQFS_OK == sqfs_xattr_get(fs, inode, SQUASHFS_XATTR_USER, SQFS_XATTR_HASH,
+			key, &xattr_size) && sizeof(*key) == xattr_size) {
+		return SQFS_OK;
+	}
+	h = squash_extract_hash(h, (const uint8_t *)&file_size, sizeof(file_size));
+	sqfs_blocklist_init(fs, inode, &bl);
+	while (bl.remain) {
+		short compressed;
+		uint32_t size;
+
+		if ((err = sqfs_blocklist_next(&bl))) {
+			return err;
+		}
+		sqfs_data_header(bl.header, &compressed, &size);
+		size |= compressed ? 0 : SQUASHFS_COMPRESSED_BIT_BLOCK;
+		h = squash_extract_hash(h, (const uint8_t *)&size, sizeof(size));
+		size &= ~SQUASHFS_COMPRESSED_BIT_BLOCK;
+		h = squash_extract_hash(h, fs->fd + fs->offset + bl.block, size);
+	}
+	if (SQUASHFS_INVALID_FRAG != inode->xtra.reg.frag_idx) {
+		sqfs_block *block;
+		size_t offset, size;
+
+		if ((err = sqfs_frag_block(fs, inode, &offset, &size, &block))) {
+			return err;
+		}
+		h = squash_extract_hash(h, (const uint8_t *)block->data + offset, size);
+		sqfs_block_dispose(block);
+	}
+	*key = h;
+	return SQFS_OK;
+}
+
+static char *squash_extract_cache_setting = NULL;
+
+void squash_set_extract_cache(const char *dir)
+{
+	free(squash_extract_cache_setting);
+	squash_extract_cache_setting = dir ? strdup(dir) : NULL;
+}
+
+/* Whether path is a file or directory of the user's own that nobody else
+ * may write to or read, a symbolic link being none of them */
+static short squash_extract_private(const char *path, mode_t type, struct stat *st)
+{
+	return 0 == lstat(path, st) && type == (st->st_mode & S_IFMT) &&
+		st->st_uid == geteuid() && S_IRWXU == (st->st_mode & 07777);
+}
+
+/* Returns the directory of the persistent cache, created if need be, or
+ * NULL if there is none or it is not private to the user; the environment
+ * variable SQUASH_EXTRACT_CACHE takes precedence over
+ * squash_set_extract_cache() */
+static char *squash_extract_cache_dir()
+{
+	const char *env = getenv("SQUASH_EXTRACT_CACHE");
+	const char *setting = squash_extract_cache_setting;
+	const char *base;
+	struct stat st;
+	char *ret;
+
+	if (env && *env) {
+		setting = 0 == strcmp(env, "0") ? NULL : 0 == strcmp(env, "1") ? "" : env;
+	}
+	if (NULL == setting) {
+		return NULL;
+	}
+	if (*setting) {
+		ret = strdup(setting);
+	} else {
+		/* a directory of the user's cache, such as ~/.cache/libsquash */
+		base = getenv("XDG_CACHE_HOME");
+		if (base && *base) {
+			ret = malloc(strlen(base) + sizeof("/libsquash"));
+			if (ret) {
+				sprintf(ret, "%s/libsquash", base);
+			}
+		} else if ((base = getenv("HOME")) && *base) {
+			ret = malloc(strlen(base) + sizeof("/.cache/libsquash"));
+			if (ret) {
+				sprintf(ret, "%s/.cache", base);
+				mkdir(ret, S_IRWXU);
+				strcat(ret, "/libsquash");
+			}
+		} else {
+			return NULL;
+		}
+	}
+	/* one that existed already may have been planted by someone else */
+	if (ret && ((-1 == mkdir(ret, S_IRWXU) && EEXIST != errno) ||
+			!squash_extract_private(ret, S_IFDIR, &st))) {
+		free(ret);
+		return NULL;
+	}
+	return ret;
+}
+
+/* Whether target is a complete file of the persistent cache */
+static short squash_extract_published(const char *target, uint64_t size)
+{
+	struct stat st;
+
+	return squash_extract_private(target, S_IFREG, &st) && (uint64_t)st.st_size == size;
+}
+
+/* Extracts path into the persistent cache in dir, unless it is there
+ * already. A file is extracted under a temporary name and renamed once
+ * complete, so that no process ever finds half of it; a lock on the side
+ * keeps processes starting together from extracting the same file twice.
+ * The lock is removed by whoever holds it last: a process still waiting
+ * on the removed one then finds the file published, or extracts it again
+ * into a name of its own. */
+static SQUASH_OS_PATH squash_persistent_extract(sqfs *fs, const char *path, const char *ext_name, const char *dir)
+{
+	sqfs_inode node;
+	short found;
+	uint64_t key, size;
+	char *target;
+	char *lock;
+	SQUASH_OS_PATH tmpf;
+	int lockfd;
+
+	if (SQFS_OK != sqfs_inode_get(fs, &node, sqfs_inode_root(fs)) ||
+			SQFS_OK != sqfs_lookup_path_inner(fs, &node, path, &found, 1) ||
+			!found || !S_ISREG(node.base.mode) ||
+			SQFS_OK != squash_extract_key(fs, &node, &key)) {
+		return NULL;
+	}
+	size = node.xtra.reg.file_size;
+	target = malloc(strlen(dir) + (ext_name ? strlen(ext_name) : 0) + 64);
+	lock = malloc(strlen(dir) + 64);
+	if (NULL == target || NULL == lock) {
+		free(target);
+		free(lock);
+		return NULL;
+	}
+	sprintf(target, "%s/%016llx-%llu%s%s", dir, (unsigned long long)key,
+		(unsigned long long)size, ext_name ? "." : "", ext_name ? ext_name : "");
+	sprintf(lock, "%s/%016llx-%llu.lock", dir, (unsigned long long)key,
+		(unsigned long long)size);
+
+	if (squash_extract_published(target, size)) {
+		free(lock);
+		ATOMIC_ADD64(&squash_extract_reused, 1);
+		return target;
+	}
+	lockfd = open(lock, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	while (-1 != lockfd && -1 == flock(lockfd, LOCK_EX) && EINTR == errno);
+	/* published by another process while this one waited */
+	if (squash_extract_published(target, size)) {
+		if (-1 != lockfd) {
+			unlink(lock);
+			close(lockfd);
+		}
+		free(lock);
+		ATOMIC_ADD64(&squash_extract_reused, 1);
+		return target;
+	}
+	tmpf = squash_uncached_extract(fs, path, ext_name, dir);
+	if (tmpf && (-1 == chmod(tmpf, S_IRWXU) || -1 == rename(tmpf, target))) {
+		unlink(tmpf);
+		free((void *)tmpf);
+		tmpf = NULL;
+	}
+	if (-1 != lockfd) {
+		unlink(lock);
+		close(lockfd);
+	}
+	free(lock);
+	if (NULL == tmpf) {
+		free(target);
+		return NULL;
+	}
+	free((void *)tmpf);
+	return target;
+}
+#else
+void squash_set_extract_cache(const char *dir)
+{
+}
+#endif // !_WIN32
+
 struct SquashExtractEntry {
 	sqfs *fs;
-	const char *path;
+	char *path;
 	SQUASH_OS_PATH ret;
+	short persistent;	/* ret outlives the process */
 	struct SquashExtractEntry *next;
 };
 
-static struct SquashExtractEntry* squash_extract_cache = NULL;
+/* Guarded by squash_global_mutex */
+static struct SquashExtractEntry* squash_extract_cache[SQUASH_EXTRACT_BUCKETS];
 
-static const struct SquashExtractEntry* squash_extract_cache_find(sqfs *fs, const char *path)
+static size_t squash_extract_bucket(sqfs *fs, const char *path)
 {
-	struct SquashExtractEntry* ptr = squash_extract_cache;
+	uint32_t h = 2166136261U ^ (uint32_t)(uintptr_t)fs;
+
+	while (*path) {
+		h ^= (uint8_t)*path++;
+		h *= 16777619U;
+	}
+	return h % SQUASH_EXTRACT_BUCKETS;
+}
+
+static struct SquashExtractEntry* squash_extract_cache_find(sqfs *fs, const char *path)
+{
+	struct SquashExtractEntry* ptr = squash_extract_cache[squash_extract_bucket(fs, path)];
 	while (NULL != ptr) {
 		if (fs == ptr->fs && 0 == strcmp(path, ptr->path)) {
 			return ptr;
@@ -222,44 +833,105 @@ static const struct SquashExtractEntry* squash_extract_cache_find(sqfs *fs, cons
 	}
 	return ptr;
 }
-static void squash_extract_cache_insert(sqfs *fs, const char *path, SQUASH_OS_PATH ret)
+
+/* Returns the entry of path, which another thread may have inserted meanwhile */
+static struct SquashExtractEntry* squash_extract_cache_insert(sqfs *fs, const char *path, SQUASH_OS_PATH ret, short persistent)
 {
-	struct SquashExtractEntry* ptr = malloc(sizeof(struct SquashExtractEntry));
+	struct SquashExtractEntry* ptr;
+	size_t bucket = squash_extract_bucket(fs, path);
+
+	ptr = squash_extract_cache_find(fs, path);
+	if (NULL != ptr) {
+		return ptr;
+	}
+	ptr = malloc(sizeof(struct SquashExtractEntry));
 	if (NULL == ptr) {
-		return;
+		return NULL;
+	}
+	ptr->path = strdup(path);
+	if (NULL == ptr->path) {
+		free(ptr);
+		return NULL;
 	}
 	ptr->fs = fs;
-	ptr->path = path;
 	ptr->ret = ret;
-	ptr->next = squash_extract_cache;
-	squash_extract_cache = ptr;
+	ptr->persistent = persistent;
+	ptr->next = squash_extract_cache[bucket];
+	squash_extract_cache[bucket] = ptr;
+	return ptr;
 }
 
 SQUASH_OS_PATH squash_extract(sqfs *fs, const char *path, const char *ext_name)
 {
-	SQUASH_OS_PATH ret;
-	static struct SquashExtractEntry* found;
+	SQUASH_OS_PATH ret = NULL;
+	struct SquashExtractEntry* found;
+	short persistent = 0;
+#ifndef _WIN32
+	char *dir;
+#endif
 
+	MUTEX_LOCK(&squash_global_mutex);
 	found = squash_extract_cache_find(fs, path);
+	MUTEX_UNLOCK(&squash_global_mutex);
 	if (NULL != found) {
+		ATOMIC_ADD64(&squash_extract_hits, 1);
 		return found->ret;
 	}
-	ret = squash_uncached_extract(fs, path, ext_name);
-	if (NULL != ret) {
-		squash_extract_cache_insert(fs, path, ret);
+	/* extracted without the lock, so that several files can be at once */
+#ifndef _WIN32
+	dir = squash_extract_cache_dir();
+	if (dir) {
+		ret = squash_persistent_extract(fs, path, ext_name, dir);
+		persistent = NULL != ret;
+		free(dir);
+	}
+#endif
+	/* a cache that cannot be written to is not in the way */
+	if (NULL == ret) {
+		ret = squash_uncached_extract(fs, path, ext_name, NULL);
+	}
+	if (NULL == ret) {
+		return NULL;
+	}
+	MUTEX_LOCK(&squash_global_mutex);
+	found = squash_extract_cache_insert(fs, path, ret, persistent);
+	MUTEX_UNLOCK(&squash_global_mutex);
+	if (NULL == found) {
+		/* nowhere to remember it, so that nobody would remove it */
+		if (!persistent) {
+			squash_extract_remove(ret);
+		}
+		free((void *)ret);
+		errno = ENOMEM;
+		return NULL;
+	}
+	if (found->ret != ret) {
+		/* lost the race to another thread extracting the same file */
+		if (!persistent) {
+			squash_extract_remove(ret);
+		}
+		free((void *)ret);
+		ret = found->ret;
 	}
 	return ret;
 }
 
 void squash_extract_clear_cache()
 {
-	struct SquashExtractEntry* ptr = squash_extract_cache;
-	while (NULL != ptr) {
-#ifdef _WIN32
-		DeleteFileW(ptr->ret);
-#else
-		unlink(ptr->ret);
-#endif
-		ptr = ptr->next;
+	struct SquashExtractEntry* ptr;
+	size_t i;
+
+	MUTEX_LOCK(&squash_global_mutex);
+	for (i = 0; i < SQUASH_EXTRACT_BUCKETS; ++i) {
+		while (NULL != (ptr = squash_extract_cache[i])) {
+			squash_extract_cache[i] = ptr->next;
+			if (!ptr->persistent) {
+				squash_extract_remove(ptr->ret);
+			}
+			free((void *)ptr->ret);
+			free(ptr->path);
+			free(ptr);
+		}
 	}
+	MUTEX_UNLOCK(&squash_global_mutex);
 }
@@ -9,17 +9,194 @@
 #include "squash.h"
 #include <stdlib.h>
 
-struct squash_fdtable squash_global_fdtable;
+struct squash_fdtable * volatile squash_global_fdtable = NULL;
 MUTEX squash_global_mutex;
 
+/*
+ * Payloads (SQUASH_DIR pointers, or the HANDLEs of win32) map back to
+ * their files through an open-addressing hash table, which is probed on
+ * every directory operation, including those on real DIR pointers.
+ * Readers take no lock: they retry if squash_payloads_seq changed
+ * while they were probing, or is odd because a writer is busy.
+ * Writers hold squash_global_mutex.
+ */
+struct squash_payload_slot {
+	void * volatile payload;
+	struct squash_file * volatile file;
+};
+
+struct squash_payload_table {
+	size_t mask;
+	size_t used;
+	struct squash_payload_table *retired;	/* the smaller table this one replaced */
+	struct squash_payload_slot slots[1];	/* mask + 1 slots */
+};
+
+static struct squash_payload_table * volatile squash_payloads = NULL;
+static volatile long squash_payloads_seq = 0;
+
+#define SQUASH_FDTABLE_MIN 64
+#define SQUASH_PAYLOADS_MIN 64
+
+static size_t squash_payload_hash(void *payload, size_t mask)
+{
+	uintptr_t x = (uintptr_t)payload;
+	x ^= x >> 17;
+	x *= (uintptr_t)0x9E3779B1u;
+	x ^= x >> 15;
+	return (size_t)x & mask;
+}
+
+static int squash_payload_insert(void *payload, struct squash_file *file)
+{
+	struct squash_payload_table *table = squash_payloads;
+	size_t i;
+
+	if (NULL == table || 2 * (table->used + 1) > table->mask + 1)
+	{
+		struct squash_payload_table *bigger;
+		size_t nr = table ? 2 * (table->mask + 1) : SQUASH_PAYLOADS_MIN;
+
+		bigger = calloc(1, sizeof(*bigger) + (nr - 1) * sizeof(bigger->slots[0]));
+		if (NULL == bigger)
+		{
+			errno = ENOMEM;
+			return -1;
+		}
+		bigger->mask = nr - 1;
+		bigger->retired = table;
+		if (table)
+		{
+			for (i = 0; i <= table->mask; ++i)
+			{
+				size_t j;
+				if (NULL == table->slots[i].payload)
+				{
+					continue;
+				}
+				j = squash_payload_hash(table->slots[i].payload, bigger->mask);
+				while (bigger->slots[j].payload)
+				{
+					j = (j + 1) & bigger->mask;
+				}
+				bigger->slots[j] = table->slots[i];
+			}
+			bigger->used = table->used;
+		}
+		ATOMIC_RELEASE();
+		squash_payloads = table = bigger;
+	}
+
+	ATOMIC_INCREMENT(&squash_payloads_seq);
+	i = squash_payload_hash(payload, table->mask);
+	while (table->slots[i].payload)
+	{
+		i = (i + 1) & table->mask;
+	}
+	table->slots[i].file = file;
+	table->slots[i].payload = payload;
+	table->used += 1;
+	ATOMIC_INCREMENT(&squash_payloads_seq);
+	return 0;
+}
+
+static void squash_payload_remove(void *payload)
+{
+	struct squash_payload_table *table = squash_payloads;
+	size_t i, j, k;
+
+	if (NULL == table)
+	{
+		return;
+	}
+	i = squash_payload_hash(payload, table->mask);
+	while (table->slots[i].payload != payload)
+	{
+		if (NULL == table->slots[i].payload)
+		{
+			return;
+		}
+		i = (i + 1) & table->mask;
+	}
+
+	ATOMIC_INCREMENT(&squash_payloads_seq);
+	// shift back the entries that probed past the hole
+	j = i;
+	for (;;)
+	{
+		j = (j + 1) & table->mask;
+		if (NULL == table->slots[j].payload)
+		{
+			break;
+		}
+		k = squash_payload_hash(table->slots[j].payload, table->mask);
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+		{
+			continue;
+		}
+		table->slots[i] = table->slots[j];
+		i = j;
+	}
+	table->slots[i].payload = NULL;
+	table->slots[i].file = NULL;
+	table->used -= 1;
+	ATOMIC_INCREMENT(&squash_payloads_seq);
+}
+
+struct squash_file *squash_vfd_file(int vfd)
+{
+	struct squash_fdtable *table = squash_global_fdtable;
+	struct squash_file *file;
+
+	if (vfd < 0 || NULL == table || (size_t)vfd >= table->nr)
+	{
+		return NULL;
+	}
+	file = table->fds[vfd];
+	ATOMIC_ACQUIRE();
+	return file;
+}
+
+// make sure that our global fd table is large enough for fd
+static int squash_fdtable_reserve(int fd)
+{
+	struct squash_fdtable *table = squash_global_fdtable;
+	struct squash_fdtable *bigger;
+	size_t nr;
+
+	if (table && (size_t)fd < table->nr)
+	{
+		return 0;
+	}
+	nr = table ? 2 * table->nr : SQUASH_FDTABLE_MIN;
+	if (nr < (size_t)fd + 1)
+	{
+		nr = (size_t)fd + 1;
+	}
+	bigger = calloc(1, sizeof(*bigger) + (nr - 1) * sizeof(bigger->fds[0]));
+	if (NULL == bigger)
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+	bigger->nr = nr;
+	bigger->retired = table;
+	if (table)
+	{
+		memcpy((void *)bigger->fds, (void *)table->fds, table->nr * sizeof(table->fds[0]));
+	}
+	ATOMIC_RELEASE();
+	squash_global_fdtable = bigger;
+	return 0;
+}
+
 int squash_open_inner(sqfs *fs, const char *path, short follow_link)
 {
 	sqfs_err error;
 	struct squash_file *file = calloc(1, sizeof(struct squash_file));
 	short found;
-	int fd;
-	size_t nr;
-	int *handle;
+	int fd = -1;
+	int *handle = NULL;
 
 	// try locating the file and fetching its stat
 	if (NULL == file)
@@ -50,33 +227,13 @@ int squash_open_inner(sqfs *fs, const char *path, short follow_link)
 	file->fs = fs;
 	file->pos = 0;
 
-	// get a dummy fd from the system
+	// get a dummy fd from the system: the kernel will not hand out
+	// the same number to anyone else while we hold it, so vfds never
+	// shadow real fds, and callers can treat them as ordinary ints
 	fd = dup(0);
 	if (-1 == fd) {
 		goto failure;
 	}
-	// make sure that our global fd table is large enough
-	nr = fd + 1;
-
-	MUTEX_LOCK(&squash_global_mutex);
-	if (squash_global_fdtable.nr < nr)
-	{
-		// we secretly extend the requested size
-		// in order to minimize the number of realloc calls
-		nr *= 10;
-		squash_global_fdtable.fds = realloc(squash_global_fdtable.fds,
-						    nr * sizeof(struct squash_file *));
-		if (NULL == squash_global_fdtable.fds)
-		{
-			errno = ENOMEM;
-			goto failure;
-		}
-		memset(squash_global_fdtable.fds + squash_global_fdtable.nr,
-		       0,
-		       (nr - squash_global_fdtable.nr) * sizeof(struct squash_file *));
-		squash_global_fdtable.nr = nr;
-	}
-	MUTEX_UNLOCK(&squash_global_mutex);
 
 	// construct a handle (mainly) for win32
 	handle = (int *)malloc(sizeof(int));
@@ -86,14 +243,19 @@ int squash_open_inner(sqfs *fs, const char *path, short follow_link)
 	}
 	*handle = fd;
 	file->payload = (void *)handle;
+	file->fd = fd;
+	// before the file is published, after which it may be closed
+	squash_profile_record(&file->node, path);
 
 	// insert the fd into the global fd table
-	file->fd = fd;
 	MUTEX_LOCK(&squash_global_mutex);
-	squash_global_fdtable.fds[fd] = file;
-        if (squash_global_fdtable.end < fd + 1) {
-        	squash_global_fdtable.end = fd + 1;
-        }
+	if (squash_fdtable_reserve(fd) || squash_payload_insert(handle, file))
+	{
+		MUTEX_UNLOCK(&squash_global_mutex);
+		goto failure;
+	}
+	ATOMIC_RELEASE();
+	squash_global_fdtable->fds[fd] = file;
 	MUTEX_UNLOCK(&squash_global_mutex);
 	return fd;
 
@@ -101,6 +263,10 @@ failure:
 	if (!errno) {
 		errno = ENOENT;
 	}
+	if (-1 != fd) {
+		close(fd);
+	}
+	free(handle);
 	free(file);
 	return -1;
 }
@@ -110,37 +276,81 @@ int squash_open(sqfs *fs, const char *path)
         return squash_open_inner(fs, path, 1);
 }
 
+int squash_vfd_set_payload(int vfd, void *payload)
+{
+	struct squash_file *file;
+	int ret = -1;
+
+	MUTEX_LOCK(&squash_global_mutex);
+	file = SQUASH_VFD_FILE(vfd);
+	if (NULL == file)
+	{
+		errno = EBADF;
+	}
+	else if (0 == squash_payload_insert(payload, file))
+	{
+		squash_payload_remove(file->payload);
+		file->payload = payload;
+		ret = 0;
+	}
+	MUTEX_UNLOCK(&squash_global_mutex);
+	return ret;
+}
+
 int squash_close(int vfd)
 {
-	int ret;
-        if (!SQUASH_VALID_VFD(vfd)) {
-                errno = EBADF;
-                return -1;
-        }
-        ret = close(vfd);
-	if (-1 == ret) {
+	struct squash_file *file;
+
+	MUTEX_LOCK(&squash_global_mutex);
+	file = SQUASH_VFD_FILE(vfd);
+	if (NULL == file)
+	{
+		MUTEX_UNLOCK(&squash_global_mutex);
+		errno = EBADF;
 		return -1;
 	}
-        MUTEX_LOCK(&squash_global_mutex);
-        if (S_ISDIR(squash_global_fdtable.fds[vfd]->st.st_mode)) {
-                SQUASH_DIR *dir = (SQUASH_DIR *) (squash_global_fdtable.fds[vfd]->payload);
-                free(dir);
-        } else {
-                int *handle = (int *) (squash_global_fdtable.fds[vfd]->payload);
-                free(handle);
-        }
-        free(squash_global_fdtable.fds[vfd]);
-        squash_global_fdtable.fds[vfd] = NULL;
-        if (vfd + 1 == squash_global_fdtable.end) {
-                while (vfd >= 0 && NULL == squash_global_fdtable.fds[vfd]) {
-                        vfd -= 1;
-                }
-                squash_global_fdtable.end = vfd + 1;
-        } else {
-                assert(squash_global_fdtable.end > vfd + 1);
-        }
-        MUTEX_UNLOCK(&squash_global_mutex);
-        return 0;
+	squash_global_fdtable->fds[vfd] = NULL;
+	squash_payload_remove(file->payload);
+	MUTEX_UNLOCK(&squash_global_mutex);
+
+	// the payload is either a SQUASH_DIR or the handle
+	free(file->payload);
+	free(file);
+	// only now may the kernel reuse the number
+	return close(vfd);
+}
+
+/*
+ * Once a read starts where the previous one ended, the blocks that follow
+ * are queued to be decompressed ahead of the reader, which then finds them
+ * in the data cache. Readers racing on the same vfd may only spoil the guess.
+ */
+static void squash_file_readahead(struct squash_file *file, sqfs_off_t offset, sqfs_off_t nbyte)
+{
+	size_t depth = squash_readahead_depth();
+	size_t block_size, next, until, from;
+	uint64_t end = (uint64_t)offset + nbyte;
+	short sequential = ((uint64_t)offset == file->readahead_next);
+
+	file->readahead_next = end;
+	if (!depth || !sequential)
+	{
+		return;
+	}
+	block_size = file->fs->sb->block_size;
+	// the block holding the end was just read, unless the end is on its boundary
+	next = (size_t)((end + block_size - 1) / block_size);
+	until = next + depth;
+	if (until > sqfs_blocklist_count(file->fs, &file->node))
+	{
+		until = sqfs_blocklist_count(file->fs, &file->node);
+	}
+	from = next > file->readahead_block ? next : file->readahead_block;
+	if (from < until)
+	{
+		squash_readahead(file->fs, &file->node, from, until - from);
+		file->readahead_block = until;
+	}
 }
 
 ssize_t squash_read(int vfd, void *buf, sqfs_off_t nbyte)
@@ -148,18 +358,19 @@ ssize_t squash_read(int vfd, void *buf, sqfs_off_t nbyte)
 	sqfs_err error;
 	struct squash_file *file;
 
-	if (!SQUASH_VALID_VFD(vfd))
+	file = SQUASH_VFD_FILE(vfd);
+	if (NULL == file)
 	{
 		errno = EBADF;
 		goto failure;
 	}
-	file = squash_global_fdtable.fds[vfd];
 
 	error = sqfs_read_range(file->fs, &file->node, file->pos, &nbyte, buf);
 	if (SQFS_OK != error)
 	{
 		goto failure;
 	}
+	squash_file_readahead(file, file->pos, nbyte);
 	file->pos += nbyte;
 	return nbyte;
 failure:
@@ -169,15 +380,86 @@ failure:
 	return -1;
 }
 
+ssize_t squash_preadv(int vfd, const struct SQUASH_IOVEC *iov, int iovcnt, sqfs_off_t offset)
+{
+	sqfs_err error;
+	struct squash_file *file;
+	sqfs_off_t nbyte;
+
+	file = SQUASH_VFD_FILE(vfd);
+	if (NULL == file)
+	{
+		errno = EBADF;
+		return -1;
+	}
+	if (S_ISDIR(file->st.st_mode))
+	{
+		errno = EISDIR;
+		return -1;
+	}
+	if (!S_ISREG(file->st.st_mode) || offset < 0 || iovcnt < 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	if ((uint64_t)offset >= file->node.xtra.reg.file_size)
+	{
+		return 0;
+	}
+
+	// file->pos is left alone, so that concurrent calls do not race
+	error = sqfs_read_rangev(file->fs, &file->node, offset, iov, iovcnt, &nbyte);
+	if (SQFS_OK != error)
+	{
+		errno = EIO;
+		return -1;
+	}
+	squash_file_readahead(file, offset, nbyte);
+	return nbyte;
+}
+
+ssize_t squash_pread(int vfd, void *buf, sqfs_off_t nbyte, sqfs_off_t offset)
+{
+	struct SQUASH_IOVEC iov;
+
+	if (nbyte < 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	iov.iov_base = buf;
+	iov.iov_len = (size_t)nbyte;
+	return squash_preadv(vfd, &iov, 1, offset);
+}
+
+ssize_t squash_readv(int vfd, const struct SQUASH_IOVEC *iov, int iovcnt)
+{
+	struct squash_file *file;
+	ssize_t ret;
+
+	file = SQUASH_VFD_FILE(vfd);
+	if (NULL == file)
+	{
+		errno = EBADF;
+		return -1;
+	}
+	ret = squash_preadv(vfd, iov, iovcnt, file->pos);
+	if (ret > 0)
+	{
+		file->pos += ret;
+	}
+	return ret;
+}
+
 off_t squash_lseek(int vfd, off_t offset, int whence)
 {
 	struct squash_file *file;
-	if (!SQUASH_VALID_VFD(vfd))
+	file = SQUASH_VFD_FILE(vfd);
+	if (NULL == file)
 	{
 		errno = EBADF;
 		return -1;
 	}
-	file = squash_global_fdtable.fds[vfd];
 	if (SQUASH_SEEK_SET == whence)
 	{
 		file->pos = offset;
@@ -194,21 +476,38 @@ off_t squash_lseek(int vfd, off_t offset, int whence)
 	return file->pos;
 }
 
+/*
+ * Runs at exit, while other threads may still be inside squash_read(),
+ * squash_lseek() and friends, which look the tables up without a lock.
+ * The tables are only unpublished, later calls failing with EBADF, and
+ * their memory is left to the system along with squash_global_mutex.
+ */
 static void squash_halt()
 {
-	if (squash_global_fdtable.fds) {
-		free(squash_global_fdtable.fds);
-	}
-	MUTEX_DESTORY(&squash_global_mutex);
+	MUTEX_LOCK(&squash_global_mutex);
+	squash_global_fdtable = NULL;
+	ATOMIC_INCREMENT(&squash_payloads_seq);
+	squash_payloads = NULL;
+	ATOMIC_INCREMENT(&squash_payloads_seq);
+	MUTEX_UNLOCK(&squash_global_mutex);
+	squash_readahead_halt();
+	/* take squash_global_mutex */
 	squash_extract_clear_cache();
+	squash_profile_stop();
+	squash_overlay_clear();
 }
 
 sqfs_err squash_start()
 {
 	int ret;
-	squash_global_fdtable.nr = 0;
-	squash_global_fdtable.fds = NULL;
+	const char *profile = getenv("SQUASH_PROFILE");
+	squash_global_fdtable = NULL;
+	squash_payloads = NULL;
 	MUTEX_INIT(&squash_global_mutex);
+	squash_readahead_init();
+	if (profile && *profile) {
+		squash_profile_start(profile);
+	}
 	ret = atexit(squash_halt);
 	if (0 == ret) {
 		return SQFS_OK;
@@ -219,15 +518,32 @@ sqfs_err squash_start()
 
 struct squash_file * squash_find_entry(void *ptr)
 {
+	struct squash_payload_table *table;
+	struct squash_file *ret;
+	long seq;
 	size_t i;
-	struct squash_file * ret = NULL;
-	MUTEX_LOCK(&squash_global_mutex);
-	for (i = 0; i < squash_global_fdtable.end; ++i) {
-		if (squash_global_fdtable.fds[i] && ptr == squash_global_fdtable.fds[i]->payload) {
-			ret = squash_global_fdtable.fds[i];
-			break;
-		}
+
+	if (NULL == ptr) {
+		return NULL;
 	}
-	MUTEX_UNLOCK(&squash_global_mutex);
+	do {
+		while ((seq = squash_payloads_seq) & 1) {
+			// a writer is busy
+		}
+		ATOMIC_ACQUIRE();
+		ret = NULL;
+		table = squash_payloads;
+		if (table) {
+			for (i = squash_payload_hash(ptr, table->mask);
+			     table->slots[i].payload;
+			     i = (i + 1) & table->mask) {
+				if (ptr == table->slots[i].payload) {
+					ret = table->slots[i].file;
+					break;
+				}
+			}
+		}
+		ATOMIC_ACQUIRE();
+	} while (seq != squash_payloads_seq);
 	return ret;
 }
@@ -107,6 +107,17 @@ sqfs_err sqfs_blocklist_next(sqfs_blocklist *bl) {
 
 sqfs_err sqfs_read_range(sqfs *fs, sqfs_inode *inode, sqfs_off_t start,
 		sqfs_off_t *size, void *buf) {
+	struct SQUASH_IOVEC iov;
+	
+	if (*size < 0)
+		return SQFS_ERR;
+	iov.iov_base = buf;
+	iov.iov_len = (size_t)(*size);
+	return sqfs_read_rangev(fs, inode, start, &iov, 1, size);
+}
+
+sqfs_err sqfs_read_rangev(sqfs *fs, sqfs_inode *inode, sqfs_off_t start,
+		const struct SQUASH_IOVEC *iov, int iovcnt, sqfs_off_t *size) {
 	sqfs_err err = SQFS_OK;
 	
 	sqfs_off_t file_size;
@@ -114,31 +125,37 @@ sqfs_err sqfs_read_range(sqfs *fs, sqfs_inode *inode, sqfs_off_t start,
 	sqfs_blocklist bl;
 	
 	size_t read_off;
-	char *buf_orig;
+	sqfs_off_t want = 0, got = 0;
+	int i;
+	size_t iov_off = 0;
 	
+	*size = 0;
 	if (!S_ISREG(inode->base.mode))
 		return SQFS_ERR;
 	
 	file_size = inode->xtra.reg.file_size;
 	block_size = fs->sb->block_size;
 	
-	if (*size < 0 || start > file_size)
+	if (start < 0 || start > file_size || iovcnt < 0)
 		return SQFS_ERR;
-	if (start == file_size) {
-		*size = 0;
+	for (i = 0; i < iovcnt; ++i)
+		want += iov[i].iov_len;
+	if (want > file_size - start)
+		want = file_size - start;
+	if (want == 0)
 		return SQFS_OK;
-	}
 	
 	err = sqfs_blockidx_blocklist(fs, inode, &bl, start);
 	if (err)
 		return err;
 	
 	read_off = start % block_size;
-	buf_orig = buf;
-	while (*size > 0) {
+	i = 0;
+	while (got < want) {
 		sqfs_block *block = NULL;
 		size_t data_off, data_size;
 		size_t take;
+		const char *src = NULL;
 		
 		short fragment = (bl.remain == 0);
 		if (fragment) { /* fragment */
@@ -159,6 +176,24 @@ sqfs_err sqfs_read_range(sqfs *fs, sqfs_inode *inode, sqfs_off_t start,
 				if (data_size > block_size)
 					data_size = block_size;
 			} else {
+				/* a whole block landing in one buffer is decompressed
+				 * there, rather than into the cache and copied out */
+				data_size = (size_t)(file_size - bl.pos);
+				if (data_size > block_size)
+					data_size = block_size;
+				if (read_off == 0 && i < iovcnt && (sqfs_off_t)data_size <= want - got
+						&& data_size <= iov[i].iov_len - iov_off) {
+					err = sqfs_data_block_read_into(fs, &fs->data_cache,
+						bl.block, bl.header,
+						(char*)iov[i].iov_base + iov_off, &data_size);
+					if (!err) {
+						iov_off += data_size;
+						got += data_size;
+						continue;
+					}
+					if (err != SQFS_UNSUP)
+						return err;
+				}
 				err = sqfs_data_cache(fs, &fs->data_cache, bl.block,
 					bl.header, &block);
 				if (err)
@@ -168,24 +203,123 @@ sqfs_err sqfs_read_range(sqfs *fs, sqfs_inode *inode, sqfs_off_t start,
 		}
 		
 		take = data_size - read_off;
-		if (take > *size)
-			take = (size_t)(*size);
-		if (block) {
-			memcpy(buf, (char*)block->data + data_off + read_off, take);
-			/* BLOCK CACHED, DON'T DISPOSE */
-		} else {
-			memset(buf, 0, take);
+		if (take > want - got)
+			take = (size_t)(want - got);
+		if (block)
+			src = (char*)block->data + data_off + read_off;
+		/* spread this block over as many buffers as it takes */
+		while (take > 0) {
+			size_t n = iov[i].iov_len - iov_off;
+			char *dst = (char*)iov[i].iov_base + iov_off;
+			
+			if (n == 0) {
+				++i;
+				iov_off = 0;
+				continue;
+			}
+			if (n > take)
+				n = take;
+			if (src) {
+				memcpy(dst, src, n);
+				src += n;
+			} else {
+				memset(dst, 0, n);
+			}
+			iov_off += n;
+			got += n;
+			take -= n;
 		}
+		if (block)
+			sqfs_block_dispose(block);
 		read_off = 0;
-		*size -= take;
-		buf = (char*)buf + take;
 		
 		if (fragment)
 			break;
 	}
 	
-	*size = (char*)buf - buf_orig;
-	return *size ? SQFS_OK : SQFS_ERR;
+	*size = got;
+	return got ? SQFS_OK : SQFS_ERR;
+}
+
+sqfs_err sqfs_read_span(sqfs *fs, sqfs_inode *inode, sqfs_off_t start,
+		sqfs_off_t *size, const void **span) {
+	sqfs_err err = SQFS_OK;
+	
+	sqfs_off_t file_size;
+	size_t block_size;
+	sqfs_blocklist bl;
+	
+	size_t read_off;
+	const char *base = NULL, *data;
+	sqfs_off_t got = 0;
+	
+	if (!S_ISREG(inode->base.mode))
+		return SQFS_ERR;
+	
+	file_size = inode->xtra.reg.file_size;
+	block_size = fs->sb->block_size;
+	
+	if (*size < 0 || start > file_size)
+		return SQFS_ERR;
+	if (start == file_size || *size == 0) {
+		*size = 0;
+		*span = NULL;
+		return SQFS_OK;
+	}
+	if (*size > file_size - start)
+		*size = file_size - start;
+	
+	err = sqfs_blockidx_blocklist(fs, inode, &bl, start);
+	if (err)
+		return err;
+	
+	read_off = start % block_size;
+	while (got < *size) {
+		short compressed;
+		uint32_t data_size;
+		
+		if (bl.remain == 0) { /* fragment */
+			struct squashfs_fragment_entry frag;
+			
+			/* The tail lives elsewhere, so it never extends a run of blocks */
+			if (base || inode->xtra.reg.frag_idx == SQUASHFS_INVALID_FRAG)
+				break;
+			err = sqfs_frag_entry(fs, &frag, inode->xtra.reg.frag_idx);
+			if (err)
+				return err;
+			sqfs_data_header(frag.size, &compressed, &data_size);
+			if (compressed)
+				break;
+			data_size = (uint32_t)(file_size % block_size);
+			base = (const char *)fs->fd + fs->offset + frag.start_block
+				+ inode->xtra.reg.frag_off + read_off;
+			got = data_size - read_off;
+			break;
+		}
+		
+		if ((err = sqfs_blocklist_next(&bl)))
+			return err;
+		if ((sqfs_off_t)(bl.pos + block_size) <= start)
+			continue;
+		
+		sqfs_data_header(bl.header, &compressed, &data_size);
+		if (compressed || data_size == 0) /* compressed or a hole */
+			break;
+		data = (const char *)fs->fd + fs->offset + bl.block;
+		if (!base)
+			base = data + read_off;
+		else if (base + got != data)
+			break;
+		got += data_size - read_off;
+		read_off = 0;
+	}
+	
+	if (!base)
+		return SQFS_UNSUP;
+	if (got < *size)
+		*size = got;
+	*span = base;
+	return SQFS_OK;
 }
 
 
@@ -277,8 +411,11 @@ sqfs_err sqfs_blockidx_blocklist(sqfs *fs, sqfs_inode *inode, sqfs_blocklist *bl
 	sqfs_blockidx_entry *blockidx, **bp;
 	sqfs_cache_idx idx;
 	sqfs_err ret;
+	MUTEX *mutex;
 
-	MUTEX_LOCK(&fs->blockidx.mutex);
+	idx = inode->base.inode_number + 1; /* zero means invalid index */
+	mutex = sqfs_cache_mutex(&fs->blockidx, idx);
+	MUTEX_LOCK(mutex);
 
 	sqfs_blocklist_init(fs, inode, bl);
 	block = (size_t)(start / fs->sb->block_size);
@@ -301,7 +438,6 @@ sqfs_err sqfs_blockidx_blocklist(sqfs *fs, sqfs_inode *inode, sqfs_blocklist *bl
 	}
 	
 	/* Get the index, creating it if necessary */
-	idx = inode->base.inode_number + 1; /* zero means invalid index */
 	if ((bp = sqfs_cache_get(&fs->blockidx, idx))) {
 		blockidx = *bp;
 	} else {
@@ -323,7 +459,7 @@ sqfs_err sqfs_blockidx_blocklist(sqfs *fs, sqfs_inode *inode, sqfs_blocklist *bl
 	ret = SQFS_OK;
 
 exit:
-	MUTEX_UNLOCK(&fs->blockidx.mutex);
+	MUTEX_UNLOCK(mutex);
 	return ret;
 }
 
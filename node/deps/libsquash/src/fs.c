@@ -24,16 +24,56 @@
  */
 #include "squash/fs.h"
 
+#include "squash/dir.h"
 #include "squash/file.h"
+#include "squash/readahead.h"
 
 
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 
 
 
+/* Lower bounds of the number of cached blocks, whatever the budget */
 #define DATA_CACHED_BLKS 1
 #define FRAG_CACHED_BLKS 3
+/* Number of cached path lookups and path components */
+#define PATH_CACHED 2048
+#define NAME_CACHED 2048
+
+static size_t sqfs_cache_mb = SQFS_CACHE_MB_DEFAULT;
+
+void squash_set_cache_mb(size_t mb) {
+	sqfs_cache_mb = mb;
+}
+
+/* The environment variable SQUASH_CACHE_MB takes precedence over
+ * squash_set_cache_mb(); budgets past what size_t holds are clamped,
+ * e.g. to 4095 MB on 32-bit targets */
+static size_t sqfs_cache_bytes() {
+	const char *env = getenv("SQUASH_CACHE_MB");
+	size_t mb = sqfs_cache_mb;
+	
+	if (env && *env) {
+		char *end;
+		unsigned long value;
+		errno = 0;
+		value = strtoul(env, &end, 10);
+		if ('\0' == *end)
+			mb = ERANGE == errno ? SIZE_MAX : value;
+	}
+	if (mb < 1)
+		mb = 1;
+	if (mb > SIZE_MAX / (1024 * 1024))
+		mb = SIZE_MAX / (1024 * 1024);
+	return mb * 1024 * 1024;
+}
+
+static size_t sqfs_cache_count(size_t bytes, size_t block_size, size_t min) {
+	size_t count = bytes / block_size;
+	return count < min ? min : count;
+}
 
 void sqfs_version_supported(int *min_major, int *min_minor, int *max_major,
 		int *max_minor) {
@@ -53,6 +93,7 @@ sqfs_compression_type sqfs_compression(sqfs *fs) {
 
 sqfs_err sqfs_init(sqfs *fs, sqfs_fd_t fd, size_t offset) {
 	sqfs_err err;
+	size_t cache_bytes;
 	memset(fs, 0, sizeof(*fs));
 	
 	fs->fd = fd;
@@ -77,10 +118,40 @@ sqfs_err sqfs_init(sqfs *fs, sqfs_fd_t fd, size_t offset) {
 		err |= sqfs_table_init(&fs->export_table, fd, fs->sb->lookup_table_start + fs->offset,
 			sizeof(uint64_t), fs->sb->inodes);
 	}
-	err |= sqfs_block_cache_init(&fs->md_cache, SQUASHFS_CACHED_BLKS);
-	err |= sqfs_block_cache_init(&fs->data_cache, DATA_CACHED_BLKS);
-	err |= sqfs_block_cache_init(&fs->frag_cache, FRAG_CACHED_BLKS);
+	if (fs->sb->xattr_id_table_start != (uint64_t)SQUASHFS_INVALID_BLK) {
+		struct squashfs_xattr_id_table ids;
+		memcpy(&ids, fd + fs->offset + fs->sb->xattr_id_table_start, sizeof(ids));
+		fs->xattr_ids = ids.xattr_ids;
+		fs->xattr_start = ids.xattr_table_start;
+		err |= sqfs_table_init(&fs->xattr_table, fd,
+			fs->sb->xattr_id_table_start + sizeof(ids) + fs->offset,
+			sizeof(struct squashfs_xattr_id), ids.xattr_ids);
+	}
+	
+	/* Every block cache may grow up to the whole budget, they take bytes
+	 * from each other as the access pattern shifts */
+	err |= sqfs_pool_init(&fs->md_pool, SQUASHFS_METADATA_SIZE);
+	err |= sqfs_pool_init(&fs->data_pool, fs->sb->block_size);
+	err |= sqfs_pool_init(&fs->stored_pool, 0);
+	
+	cache_bytes = sqfs_cache_bytes();
+	err |= sqfs_cache_budget_init(&fs->cache_budget, cache_bytes);
+	err |= sqfs_block_cache_init(&fs->md_cache, sqfs_cache_count(cache_bytes,
+		SQUASHFS_METADATA_SIZE, SQUASHFS_CACHED_BLKS));
+	err |= sqfs_block_cache_init(&fs->data_cache, sqfs_cache_count(cache_bytes,
+		fs->sb->block_size, DATA_CACHED_BLKS));
+	err |= sqfs_block_cache_init(&fs->frag_cache, sqfs_cache_count(cache_bytes,
+		fs->sb->block_size, FRAG_CACHED_BLKS));
 	err |= sqfs_blockidx_init(&fs->blockidx);
+	err |= sqfs_lookup_cache_init(&fs->path_cache, PATH_CACHED);
+	err |= sqfs_lookup_cache_init(&fs->name_cache, NAME_CACHED);
+	if (!err) {
+		err |= sqfs_cache_budget_attach(&fs->cache_budget, &fs->md_cache);
+		err |= sqfs_cache_budget_attach(&fs->cache_budget, &fs->data_cache);
+		err |= sqfs_cache_budget_attach(&fs->cache_budget, &fs->frag_cache);
+		err |= sqfs_cache_budget_attach(&fs->cache_budget, &fs->path_cache);
+		err |= sqfs_cache_budget_attach(&fs->cache_budget, &fs->name_cache);
+	}
 	if (err) {
 		sqfs_destroy(fs);
 		return SQFS_ERR;
@@ -90,14 +161,24 @@ sqfs_err sqfs_init(sqfs *fs, sqfs_fd_t fd, size_t offset) {
 }
 
 void sqfs_destroy(sqfs *fs) {
+	squash_readahead_cancel(fs);
 	sqfs_table_destroy(&fs->id_table);
 	sqfs_table_destroy(&fs->frag_table);
 	if (sqfs_export_ok(fs))
 		sqfs_table_destroy(&fs->export_table);
+	sqfs_table_destroy(&fs->xattr_table);
 	sqfs_cache_destroy(&fs->md_cache);
 	sqfs_cache_destroy(&fs->data_cache);
 	sqfs_cache_destroy(&fs->frag_cache);
 	sqfs_cache_destroy(&fs->blockidx);
+	sqfs_cache_destroy(&fs->path_cache);
+	sqfs_cache_destroy(&fs->name_cache);
+	if (fs->cache_budget.limit)
+		sqfs_cache_budget_destroy(&fs->cache_budget);
+	/* after the caches, which give their blocks back */
+	sqfs_pool_destroy(&fs->md_pool);
+	sqfs_pool_destroy(&fs->data_pool);
+	sqfs_pool_destroy(&fs->stored_pool);
 }
 
 void sqfs_md_header(uint16_t hdr, short *compressed, uint16_t *size) {
@@ -112,38 +193,58 @@ void sqfs_data_header(uint32_t hdr, short *compressed, uint32_t *size) {
 	*size = hdr & ~SQUASHFS_COMPRESSED_BIT_BLOCK;
 }
 
+/* Blocks of the usual sizes come from the pools, others are malloc'd */
+static sqfs_block *sqfs_block_alloc(sqfs *fs, short compressed, size_t outsize) {
+	sqfs_block *block;
+	sqfs_pool *pool = NULL;
+	
+	if (!compressed)
+		pool = &fs->stored_pool;
+	else if (outsize == fs->data_pool.size)
+		pool = &fs->data_pool;
+	else if (outsize == fs->md_pool.size)
+		pool = &fs->md_pool;
+	if (pool && pool->max_free)
+		return sqfs_pool_get(pool);
+	
+	if (!(block = malloc(sizeof(*block))))
+		return NULL;
+	block->data = NULL;
+	block->size = 0;
+	block->data_need_freeing = 0;
+	block->refcount = 1;
+	block->pool = NULL;
+	if (compressed) {
+		if (!(block->data = malloc(outsize))) {
+			free(block);
+			return NULL;
+		}
+		block->data_need_freeing = 1;
+	}
+	return block;
+}
+
 sqfs_err sqfs_block_read(sqfs *fs, sqfs_off_t pos, short compressed,
 		uint32_t size, size_t outsize, sqfs_block **block) {
-	sqfs_err err = SQFS_ERR;
-	if (!(*block = malloc(sizeof(**block))))
+	sqfs_err err;
+	void *in = (void *)((fs->fd) + (pos + fs->offset));
+	
+	if (!(*block = sqfs_block_alloc(fs, compressed, outsize)))
 		return SQFS_ERR;
 	
-	(*block)->data = (void *)((fs->fd) + (pos + fs->offset));
-	(*block)->data_need_freeing = 0;
-
 	if (compressed) {
-		char *decomp = malloc(outsize);
-		if (!decomp)
-			goto error;
-		
-		err = fs->decompressor((*block)->data, size, decomp, &outsize);
+		err = fs->decompressor(in, size, (*block)->data, &outsize);
 		if (err) {
-			free(decomp);
-			goto error;
+			sqfs_block_dispose(*block);
+			*block = NULL;
+			return err;
 		}
-		(*block)->data = decomp;
 		(*block)->size = outsize;
-		(*block)->data_need_freeing = 1;
 	} else {
+		(*block)->data = in;
 		(*block)->size = size;
 	}
-
 	return SQFS_OK;
-
-error:
-	sqfs_block_dispose(*block);
-	*block = NULL;
-	return err;
 }
 
 sqfs_err sqfs_md_block_read(sqfs *fs, sqfs_off_t pos, size_t *data_size,
@@ -176,49 +277,120 @@ sqfs_err sqfs_data_block_read(sqfs *fs, sqfs_off_t pos, uint32_t hdr,
 		fs->sb->block_size, block);
 }
 
+/* Put a freshly read block into the cache, unless another reader raced us
+ * to it. Either way *block ends up holding a reference to the cached copy. */
+static void sqfs_block_cache_insert(sqfs_cache *cache, sqfs_cache_idx idx,
+		size_t data_size, sqfs_block **block, size_t *cached_size) {
+	sqfs_block_cache_entry *entry;
+	sqfs_block *fresh = *block;
+	
+	entry = sqfs_cache_get(cache, idx);
+	if (entry) {
+		*block = entry->block;
+		sqfs_block_ref(*block);
+	} else {
+		entry = sqfs_cache_add(cache, idx);
+		entry->block = fresh;
+		entry->data_size = data_size;
+		sqfs_block_ref(fresh);
+		sqfs_cache_charge(cache, idx, sizeof(sqfs_block) +
+			(fresh->pool ? fresh->pool->size :
+			fresh->data_need_freeing ? fresh->size : 0));
+		fresh = NULL;
+	}
+	*cached_size = entry->data_size;
+	if (fresh)
+		sqfs_block_dispose(fresh);
+}
+
 sqfs_err sqfs_md_cache(sqfs *fs, sqfs_off_t *pos, sqfs_block **block) {
 	sqfs_block_cache_entry *entry;
 	sqfs_err ret;
-	MUTEX_LOCK(&fs->md_cache.mutex);
-
+	size_t data_size;
+	MUTEX *mutex = sqfs_cache_mutex(&fs->md_cache, *pos);
+	
+	MUTEX_LOCK(mutex);
 	entry = sqfs_cache_get(&fs->md_cache, *pos);
-	if (!entry) {
-		entry = sqfs_cache_add(&fs->md_cache, *pos);
-		ret = sqfs_md_block_read(fs, *pos, &entry->data_size, &entry->block);
-		if (ret) {
-			goto exit;
-		}
+	if (entry) {
+		*block = entry->block;
+		sqfs_block_ref(*block);
+		*pos += entry->data_size;
+		MUTEX_UNLOCK(mutex);
+		return SQFS_OK;
 	}
-	*block = entry->block;
-	*pos += entry->data_size;
-	ret = SQFS_OK;
-exit:
-	MUTEX_UNLOCK(&fs->md_cache.mutex);
-	return ret;
+	MUTEX_UNLOCK(mutex);
+	
+	/* Decompress without holding the lock */
+	ret = sqfs_md_block_read(fs, *pos, &data_size, block);
+	if (ret)
+		return ret;
+	
+	MUTEX_LOCK(mutex);
+	sqfs_block_cache_insert(&fs->md_cache, *pos, data_size, block, &data_size);
+	MUTEX_UNLOCK(mutex);
+	sqfs_cache_budget_trim(&fs->cache_budget);
+	*pos += data_size;
+	return SQFS_OK;
 }
 
 sqfs_err sqfs_data_cache(sqfs *fs, sqfs_cache *cache, sqfs_off_t pos,
 		uint32_t hdr, sqfs_block **block) {
 	sqfs_block_cache_entry *entry;
 	sqfs_err ret;
-	MUTEX_LOCK(&cache->mutex);
-
+	size_t data_size;
+	MUTEX *mutex = sqfs_cache_mutex(cache, pos);
+	
+	MUTEX_LOCK(mutex);
 	entry = sqfs_cache_get(cache, pos);
-	if (!entry) {
-		entry = sqfs_cache_add(cache, pos);
-		ret = sqfs_data_block_read(fs, pos, hdr, &entry->block);
-		if (ret) {
-			goto exit;
-		}
+	if (entry) {
+		*block = entry->block;
+		sqfs_block_ref(*block);
+		MUTEX_UNLOCK(mutex);
+		return SQFS_OK;
 	}
-	*block = entry->block;
-	ret = SQFS_OK;
-exit:
-	MUTEX_UNLOCK(&cache->mutex);
-	return ret;
+	MUTEX_UNLOCK(mutex);
+	
+	ret = sqfs_data_block_read(fs, pos, hdr, block);
+	if (ret)
+		return ret;
+	
+	MUTEX_LOCK(mutex);
+	sqfs_block_cache_insert(cache, pos, 0, block, &data_size);
+	MUTEX_UNLOCK(mutex);
+	if (cache->budget)
+		sqfs_cache_budget_trim(cache->budget);
+	return SQFS_OK;
+}
+
+sqfs_err sqfs_data_block_read_into(sqfs *fs, sqfs_cache *cache, sqfs_off_t pos,
+		uint32_t hdr, void *out, size_t *outsize) {
+	short compressed, cached;
+	uint32_t size;
+	MUTEX *mutex = sqfs_cache_mutex(cache, pos);
+	
+	sqfs_data_header(hdr, &compressed, &size);
+	if (!compressed)
+		return SQFS_UNSUP;
+	MUTEX_LOCK(mutex);
+	cached = NULL != sqfs_cache_get(cache, pos);
+	MUTEX_UNLOCK(mutex);
+	if (cached)
+		return SQFS_UNSUP;
+	return fs->decompressor((void *)((fs->fd) + (pos + fs->offset)), size,
+		out, outsize);
+}
+
+void sqfs_block_ref(sqfs_block *block) {
+	ATOMIC_INCREMENT(&block->refcount);
 }
 
 void sqfs_block_dispose(sqfs_block *block) {
+	if (ATOMIC_DECREMENT(&block->refcount) > 0)
+		return;
+	if (block->pool) {
+		sqfs_pool_put(block->pool, block);
+		return;
+	}
 	if (block->data_need_freeing) {
 		free(block->data);
 	}
@@ -244,7 +416,6 @@ sqfs_err sqfs_md_read(sqfs *fs, sqfs_md_cursor *cur, void *buf, size_t size) {
 			take = size;
 		if (buf)
 			memcpy(buf, (char*)block->data + cur->offset, take);
-		/* BLOCK CACHED, DON'T DISPOSE */
 		
 		if (buf)
 			buf = (char*)buf + take;
@@ -254,6 +425,7 @@ sqfs_err sqfs_md_read(sqfs *fs, sqfs_md_cursor *cur, void *buf, size_t size) {
 			cur->block = pos;
 			cur->offset = 0;
 		}
+		sqfs_block_dispose(block);
 	}
 	return SQFS_OK;
 }
@@ -313,6 +485,67 @@ sqfs_err sqfs_export_inode(sqfs *fs, sqfs_inode_num n, sqfs_inode_id *i) {
 	return SQFS_OK;
 }
 
+/* Reads a name or value of size bytes at cur into buf, which holds *size
+ * bytes, and sets *size to its length */
+static sqfs_err sqfs_xattr_read(sqfs *fs, sqfs_md_cursor *cur, size_t size,
+		void *buf, size_t *bufsize) {
+	size_t take = size < *bufsize ? size : *bufsize;
+	sqfs_err err = sqfs_md_read(fs, cur, buf, take);
+	
+	if (!err && take < size)
+		err = sqfs_md_read(fs, cur, NULL, size - take);
+	*bufsize = size;
+	return err;
+}
+
+sqfs_err sqfs_xattr_get(sqfs *fs, sqfs_inode *inode, int type,
+		const char *name, void *value, size_t *size) {
+	struct squashfs_xattr_id id;
+	sqfs_md_cursor cur;
+	size_t len = strlen(name);
+	uint32_t i;
+	sqfs_err err;
+	
+	if (inode->xattr == SQUASHFS_INVALID_XATTR || inode->xattr >= fs->xattr_ids)
+		return SQFS_UNSUP;
+	if ((err = sqfs_table_get(&fs->xattr_table, fs, inode->xattr, &id)))
+		return err;
+	
+	sqfs_md_cursor_inode(&cur, id.xattr, fs->xattr_start);
+	for (i = 0; i < id.count; ++i) {
+		struct squashfs_xattr_entry entry;
+		struct squashfs_xattr_val val;
+		char buf[256];
+		size_t got = sizeof(buf);
+		short match;
+		
+		if ((err = sqfs_md_read(fs, &cur, &entry, sizeof(entry))))
+			return err;
+		if ((err = sqfs_xattr_read(fs, &cur, entry.size, buf, &got)))
+			return err;
+		match = (entry.type & SQUASHFS_XATTR_PREFIX_MASK) == type &&
+			got == len && got <= sizeof(buf) && 0 == memcmp(buf, name, len);
+		if ((err = sqfs_md_read(fs, &cur, &val, sizeof(val))))
+			return err;
+		if (!match) {
+			if ((err = sqfs_md_read(fs, &cur, NULL, val.vsize)))
+				return err;
+			continue;
+		}
+		if (entry.type & SQUASHFS_XATTR_VALUE_OOL) {
+			/* the value is elsewhere, shared by several inodes */
+			uint64_t ref;
+			if ((err = sqfs_md_read(fs, &cur, &ref, sizeof(ref))))
+				return err;
+			sqfs_md_cursor_inode(&cur, ref, fs->xattr_start);
+			if ((err = sqfs_md_read(fs, &cur, &val, sizeof(val))))
+				return err;
+		}
+		return sqfs_xattr_read(fs, &cur, val.vsize, value, size);
+	}
+	return SQFS_UNSUP;
+}
+
 sqfs_inode_id sqfs_inode_root(sqfs *fs) {
 	return fs->sb->root_inode;
 }
@@ -336,6 +569,7 @@ sqfs_err sqfs_inode_get(sqfs *fs, sqfs_inode *inode, sqfs_inode_id id) {
 	sqfs_err err;
 	
 	memset(inode, 0, sizeof(*inode));
+	inode->xattr = SQUASHFS_INVALID_XATTR;
 	
 	sqfs_md_cursor_inode(&cur, id, fs->sb->inode_table_start);
 	inode->next = cur;
@@ -362,6 +596,7 @@ sqfs_err sqfs_inode_get(sqfs *fs, sqfs_inode *inode, sqfs_inode_id id) {
 			inode->xtra.reg.file_size = x.file_size;
 			inode->xtra.reg.frag_idx = x.fragment;
 			inode->xtra.reg.frag_off = x.offset;
+			inode->xattr = x.xattr;
 			break;
 		}
 		case SQUASHFS_DIR_TYPE: {
@@ -381,6 +616,7 @@ sqfs_err sqfs_inode_get(sqfs *fs, sqfs_inode *inode, sqfs_inode_id id) {
 			inode->xtra.dir.offset = x.offset;
 			inode->xtra.dir.dir_size = x.file_size;
 			inode->xtra.dir.idx_count = x.i_count;
+			inode->xattr = x.xattr;
 			inode->xtra.dir.parent_inode = x.parent_inode;
 			break;
 		}
@@ -410,6 +646,7 @@ sqfs_err sqfs_inode_get(sqfs *fs, sqfs_inode *inode, sqfs_inode_id id) {
 		case SQUASHFS_LCHRDEV_TYPE: {
 			INODE_TYPE(ldev);
 			inode->nlink = x.nlink;
+			inode->xattr = x.xattr;
 			sqfs_decode_dev(inode, x.rdev);
 			break;
 		}
@@ -423,6 +660,7 @@ sqfs_err sqfs_inode_get(sqfs *fs, sqfs_inode *inode, sqfs_inode_id id) {
 		case SQUASHFS_LFIFO_TYPE: {
 			INODE_TYPE(lipc);
 			inode->nlink = x.nlink;
+			inode->xattr = x.xattr;
 			break;
 		}
 		
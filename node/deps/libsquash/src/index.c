@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2017 Minqi Pan <pmq2001@gmail.com>
+ *                    Shengyuan Liu <sounder.liu@gmail.com>
+ *
+ * This file is part of libsquash, distributed under the MIT License
+ * For full terms see the included LICENSE file
+ */
+
+#include "squash/index.h"
+
+#include "squash/fs.h"
+
+#include <string.h>
+
+uint32_t sqfs_path_index_hash(uint32_t seed, const char *key, size_t len) {
+	uint32_t h = 2166136261U ^ seed;
+	size_t i;
+	
+	for (i = 0; i < len; ++i) {
+		h ^= (uint8_t)key[i];
+		h *= 16777619U;
+	}
+	/* the finalizer of MurmurHash3, so that the low bits depend on every
+	 * bit of the seed and of the path */
+	h ^= h >> 16;
+	h *= 0x85ebca6bU;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35U;
+	h ^= h >> 16;
+	return h;
+}
+
+sqfs_err sqfs_path_index_set(sqfs *fs, const sqfs_path_index *index) {
+	sqfs_inode root;
+	sqfs_err err;
+	
+	if (index->mkfs_time != fs->sb->mkfs_time ||
+			index->bytes_used != fs->sb->bytes_used || 0 == index->count)
+		return SQFS_BADFORMAT;
+	if ((err = sqfs_inode_get(fs, &root, sqfs_inode_root(fs))))
+		return err;
+	fs->path_index_root = root.base.inode_number;
+	fs->path_index = index;
+	return SQFS_OK;
+}
+
+/* The slot of the first len characters of path, or -1 */
+static long sqfs_path_index_find(const sqfs_path_index *index,
+		const char *path, size_t len) {
+	int32_t d;
+	uint32_t slot;
+	const char *candidate;
+	
+	d = index->displacements[sqfs_path_index_hash(0, path, len) % index->count];
+	if (d < 0)
+		slot = (uint32_t)(-(d + 1));
+	else
+		slot = sqfs_path_index_hash((uint32_t)d, path, len) % index->count;
+	
+	candidate = index->paths[slot];
+	if (strncmp(candidate, path, len) || '\0' != candidate[len])
+		return -1;
+	return (long)slot;
+}
+
+short sqfs_path_index_absent(sqfs *fs, const char *path) {
+	const sqfs_path_index *index = fs->path_index;
+	size_t len, i;
+	long slot;
+	
+	if (!index || '/' != path[0])
+		return 0;
+	len = strlen(path);
+	/* Left to the directory walk, which knows how to interpret them */
+	if ((len > 1 && '/' == path[len - 1]) || strstr(path, "//") ||
+			strstr(path, "/./") || (len > 1 && 0 == strcmp(path + len - 2, "/.")))
+		return 0;
+	
+	if (sqfs_path_index_find(index, path, len) >= 0)
+		return 0;
+	
+	/* Absent, unless one of its parents is a symbolic link: the index
+	 * knows the paths inside the image, not where links lead to */
+	for (i = 1; i < len; ++i) {
+		if ('/' != path[i])
+			continue;
+		slot = sqfs_path_index_find(index, path, i);
+		if (slot < 0)
+			return 1;
+		if (SQFS_PATH_INDEX_DIR != index->types[slot])
+			return 0;
+	}
+	return 1;
+}
@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2017 Minqi Pan <pmq2001@gmail.com>
+ *                    Shengyuan Liu <sounder.liu@gmail.com>
+ *
+ * This file is part of libsquash, distributed under the MIT License
+ * For full terms see the included LICENSE file
+ */
+
+#include "squash.h"
+
+#include <stdlib.h>
+
+/* Looks up the regular file path, following links */
+static short squash_map_lookup(sqfs *fs, const char *path, sqfs_inode *node)
+{
+	sqfs_err error;
+	short found;
+
+	error = sqfs_inode_get(fs, node, sqfs_inode_root(fs));
+	if (SQFS_OK != error) {
+		return 0;
+	}
+	error = sqfs_lookup_path_inner(fs, node, path, &found, 1);
+	if (SQFS_OK != error) {
+		return 0;
+	}
+	if (!found) {
+		errno = ENOENT;
+		return 0;
+	}
+	if (S_ISDIR(node->base.mode)) {
+		errno = EISDIR;
+		return 0;
+	}
+	if (!S_ISREG(node->base.mode)) {
+		errno = EINVAL;
+		return 0;
+	}
+	if ((uint64_t)node->xtra.reg.file_size > (size_t)-1) {
+		errno = EFBIG;
+		return 0;
+	}
+	return 1;
+}
+
+const void *squash_map(sqfs *fs, const char *path, size_t *size)
+{
+	static const char empty[1] = "";
+	sqfs_err error;
+	sqfs_inode node;
+	sqfs_off_t file_size, span_size;
+	const void *span;
+
+	if (!squash_map_lookup(fs, path, &node)) {
+		goto failure;
+	}
+	file_size = node.xtra.reg.file_size;
+	if (0 == file_size) {
+		*size = 0;
+		return empty;
+	}
+	span_size = file_size;
+	error = sqfs_read_span(fs, &node, 0, &span_size, &span);
+	if (SQFS_OK != error || span_size != file_size) {
+		// compressed, sparse or split into a fragment
+		errno = EINVAL;
+		goto failure;
+	}
+	*size = (size_t)file_size;
+	squash_profile_record(&node, path);
+	return span;
+failure:
+	if (!errno) {
+		errno = ENOENT;
+	}
+	return NULL;
+}
+
+void *squash_readfile(sqfs *fs, const char *path, size_t *size)
+{
+	sqfs_err error;
+	sqfs_inode node;
+	sqfs_off_t file_size, read_size;
+	char *buf;
+
+	if (!squash_map_lookup(fs, path, &node)) {
+		goto failure;
+	}
+	file_size = node.xtra.reg.file_size;
+	buf = malloc(file_size ? (size_t)file_size : 1);
+	if (NULL == buf) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	read_size = file_size;
+	error = sqfs_read_range(fs, &node, 0, &read_size, buf);
+	if (SQFS_OK != error || read_size != file_size) {
+		free(buf);
+		errno = EIO;
+		return NULL;
+	}
+	*size = (size_t)file_size;
+	squash_profile_record(&node, path);
+	return buf;
+failure:
+	if (!errno) {
+		errno = ENOENT;
+	}
+	return NULL;
+}
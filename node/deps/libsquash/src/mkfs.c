@@ -0,0 +1,1215 @@
+/*
+ * Copyright (c) 2017 Minqi Pan <pmq2001@gmail.com>
+ *                    Shengyuan Liu <sounder.liu@gmail.com>
+ *
+ * This file is part of libsquash, distributed under the MIT License
+ * For full terms see the included LICENSE file
+ */
+
+#include "squash/mkfs.h"
+#include "squash/fs.h"
+
+#include "squash/squashfs_fs.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#endif
+
+/* The image is laid out as mksquashfs does:
+ *   superblock, compressor options, data blocks and fragments,
+ *   inode table, directory table, fragment table, id table
+ * The inodes are written children first, so that a directory listing
+ * knows where the inodes of its entries are. */
+
+#define SQFS_MKFS_THREADS_MAX 64
+/* Data blocks compressed at once, per thread */
+#define SQFS_MKFS_BATCH 8
+#define SQFS_MKFS_DEDUP_BUCKETS 4096
+/* Entries under one directory header */
+#define SQFS_MKFS_DIR_RUN 256
+#define SQFS_MKFS_INVALID_XATTR 0xffffffffU
+#define SQFS_MKFS_SUPERBLOCK_SIZE 96
+/* Images are padded to a multiple of this, as mksquashfs does */
+#define SQFS_MKFS_PADDING 4096
+
+/* A content of one or more files */
+typedef struct sqfs_mkfs_data {
+	struct sqfs_mkfs_data *next;	/* in its dedup bucket */
+	uint64_t hash;
+	uint64_t size;
+	short compress;	/* files stored uncompressed share only with their kind */
+	const char *path;	/* of the first file of this content */
+	size_t first_block;	/* in sqfs_mkfs_state.blocks, the blocks follow each other */
+	size_t nblocks;
+	uint32_t frag_idx;
+	uint32_t frag_off;
+	uint32_t xattr;	/* the index of its content hash in the xattr ids */
+} sqfs_mkfs_data;
+
+typedef struct sqfs_mkfs_node {
+	char *name;
+	char *path;	/* on disk */
+	int type;	/* SQUASHFS_DIR_TYPE, SQUASHFS_REG_TYPE or SQUASHFS_SYMLINK_TYPE */
+	uint16_t mode;
+	uint16_t uid_idx, gid_idx;
+	uint32_t mtime;
+	uint64_t size;
+	uint32_t inode_number;
+	sqfs_inode_id inode_ref;
+
+	struct sqfs_mkfs_node **children;	/* sorted by name */
+	size_t nchildren;
+
+	sqfs_mkfs_data *data;
+
+	char *target;
+	size_t target_size;
+} sqfs_mkfs_node;
+
+typedef struct {
+	uint64_t start;
+	uint32_t header;
+} sqfs_mkfs_block;
+
+typedef struct {
+	unsigned char *in, *out;
+	size_t size;
+	short compress;
+	size_t index;	/* in sqfs_mkfs_state.blocks */
+	/* set by the worker */
+	uint32_t header;
+	const unsigned char *data;
+} sqfs_mkfs_job;
+
+/* A metadata table being built in memory */
+typedef struct {
+	unsigned char *out;
+	size_t size, capacity;
+	unsigned char block[SQUASHFS_METADATA_SIZE];
+	size_t fill;
+	uint64_t total;	/* bytes put, uncompressed */
+	short compress;
+} sqfs_mkfs_md;
+
+typedef struct {
+	const sqfs_mkfs_options *options;
+	sqfs_compressor compressor;
+	size_t block_size;
+	FILE *fp;
+	uint64_t offset;
+
+	sqfs_mkfs_node *root;
+	uint32_t inodes;
+	uint32_t *ids;
+	size_t nids;
+
+	sqfs_mkfs_block *blocks;
+	size_t nblocks, blocks_capacity;
+	size_t *fragments;	/* the block of each fragment */
+	size_t nfragments, fragments_capacity;
+	unsigned char *fragment;	/* being filled */
+	size_t fragment_fill;
+
+	sqfs_mkfs_job *jobs;
+	size_t njobs, max_jobs;
+	size_t threads;
+	volatile long next_job;
+
+	sqfs_mkfs_data *dedup[SQFS_MKFS_DEDUP_BUCKETS];
+
+	sqfs_mkfs_md inode_table;
+	sqfs_mkfs_md dir_table;
+	sqfs_mkfs_md xattr_table;	/* names and values */
+	unsigned char *xattr_ids;	/* struct squashfs_xattr_id each */
+	size_t nxattrs, xattr_ids_capacity;
+} sqfs_mkfs_state;
+
+void sqfs_mkfs_options_init(sqfs_mkfs_options *options) {
+	memset(options, 0, sizeof(*options));
+	options->compression = ZLIB_COMPRESSION;
+	options->block_size = SQUASHFS_FILE_SIZE;
+	options->threads = 1;
+}
+
+static void sqfs_mkfs_le16(unsigned char *p, uint16_t v) {
+	p[0] = (unsigned char)v;
+	p[1] = (unsigned char)(v >> 8);
+}
+
+static void sqfs_mkfs_le32(unsigned char *p, uint32_t v) {
+	sqfs_mkfs_le16(p, (uint16_t)v);
+	sqfs_mkfs_le16(p + 2, (uint16_t)(v >> 16));
+}
+
+static void sqfs_mkfs_le64(unsigned char *p, uint64_t v) {
+	sqfs_mkfs_le32(p, (uint32_t)v);
+	sqfs_mkfs_le32(p + 4, (uint32_t)(v >> 32));
+}
+
+/* 64-bit FNV-1a */
+static uint64_t sqfs_mkfs_hash(const unsigned char *data, size_t size) {
+	uint64_t h = 14695981039346656037ULL;
+	size_t i;
+
+	for (i = 0; i < size; ++i) {
+		h ^= data[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+static sqfs_err sqfs_mkfs_grow(void **array, size_t *capacity, size_t need,
+		size_t each) {
+	size_t capacity2;
+	void *array2;
+
+	if (need <= *capacity)
+		return SQFS_OK;
+	capacity2 = *capacity ? *capacity * 2 : 64;
+	while (capacity2 < need)
+		capacity2 *= 2;
+	if (!(array2 = realloc(*array, capacity2 * each)))
+		return SQFS_ERR;
+	*array = array2;
+	*capacity = capacity2;
+	return SQFS_OK;
+}
+
+/* ---- Files, paths are UTF-8 ---- */
+
+#ifdef _WIN32
+static wchar_t *sqfs_mkfs_wide(const char *path) {
+	int length = MultiByteToWideChar(CP_UTF8, 0, path, -1, NULL, 0);
+	wchar_t *ret;
+
+	if (0 == length)
+		return NULL;
+	if (!(ret = malloc(length * sizeof(wchar_t))))
+		return NULL;
+	MultiByteToWideChar(CP_UTF8, 0, path, -1, ret, length);
+	return ret;
+}
+#endif
+
+static FILE *sqfs_mkfs_fopen(const char *path, const char *mode) {
+#ifdef _WIN32
+	wchar_t *wpath = sqfs_mkfs_wide(path);
+	wchar_t wmode[8];
+	FILE *fp;
+
+	if (!wpath)
+		return NULL;
+	MultiByteToWideChar(CP_UTF8, 0, mode, -1, wmode, 8);
+	fp = _wfopen(wpath, wmode);
+	free(wpath);
+	return fp;
+#else
+	return fopen(path, mode);
+#endif
+}
+
+static char *sqfs_mkfs_join(const char *dir, const char *name) {
+	size_t dlen = strlen(dir), nlen = strlen(name);
+	char *ret = malloc(dlen + 1 + nlen + 1);
+
+	if (!ret)
+		return NULL;
+	memcpy(ret, dir, dlen);
+	ret[dlen] = '/';
+	memcpy(ret + dlen + 1, name, nlen + 1);
+	return ret;
+}
+
+static sqfs_err sqfs_mkfs_id(sqfs_mkfs_state *mkfs, uint32_t id, uint16_t *idx) {
+	size_t i, capacity = mkfs->nids;
+
+	for (i = 0; i < mkfs->nids; ++i) {
+		if (mkfs->ids[i] == id) {
+			*idx = (uint16_t)i;
+			return SQFS_OK;
+		}
+	}
+	if (mkfs->nids == SQUASHFS_IDS) {
+		errno = EOVERFLOW;
+		return SQFS_ERR;
+	}
+	if (sqfs_mkfs_grow((void **)&mkfs->ids, &capacity, mkfs->nids + 1,
+			sizeof(uint32_t)))
+		return SQFS_ERR;
+	*idx = (uint16_t)mkfs->nids;
+	mkfs->ids[mkfs->nids++] = id;
+	return SQFS_OK;
+}
+
+/* Fills in everything but the name and the children */
+static sqfs_err sqfs_mkfs_stat(sqfs_mkfs_state *mkfs, sqfs_mkfs_node *node) {
+#ifdef _WIN32
+	struct _stat64 st;
+	wchar_t *wpath = sqfs_mkfs_wide(node->path);
+	int ret;
+
+	if (!wpath)
+		return SQFS_ERR;
+	ret = _wstat64(wpath, &st);
+	free(wpath);
+	if (ret)
+		return SQFS_ERR;
+	if (st.st_mode & _S_IFDIR) {
+		node->type = SQUASHFS_DIR_TYPE;
+		node->mode = 0755;
+	} else if (st.st_mode & _S_IFREG) {
+		node->type = SQUASHFS_REG_TYPE;
+		node->mode = (st.st_mode & _S_IEXEC) ? 0755 : 0644;
+	} else {
+		node->type = 0;
+		return SQFS_OK;
+	}
+	node->size = st.st_size;
+#else
+	struct stat st;
+
+	if (lstat(node->path, &st))
+		return SQFS_ERR;
+	node->mode = st.st_mode & 07777;
+	node->size = st.st_size;
+	if (S_ISDIR(st.st_mode)) {
+		node->type = SQUASHFS_DIR_TYPE;
+	} else if (S_ISREG(st.st_mode)) {
+		node->type = SQUASHFS_REG_TYPE;
+	} else if (S_ISLNK(st.st_mode)) {
+		ssize_t got;
+
+		node->type = SQUASHFS_SYMLINK_TYPE;
+		if (!(node->target = malloc(st.st_size + 1)))
+			return SQFS_ERR;
+		got = readlink(node->path, node->target, st.st_size + 1);
+		if (got < 0)
+			return SQFS_ERR;
+		if (got > st.st_size) {
+			/* changed since lstat */
+			errno = EAGAIN;
+			return SQFS_ERR;
+		}
+		node->target_size = got;
+	} else {
+		node->type = 0;
+		return SQFS_OK;
+	}
+#endif
+	node->mtime = (uint32_t)st.st_mtime;
+	if (sqfs_mkfs_id(mkfs, (uint32_t)st.st_uid, &node->uid_idx))
+		return SQFS_ERR;
+	if (sqfs_mkfs_id(mkfs, (uint32_t)st.st_gid, &node->gid_idx))
+		return SQFS_ERR;
+	return SQFS_OK;
+}
+
+static void sqfs_mkfs_node_free(sqfs_mkfs_node *node) {
+	size_t i;
+
+	if (!node)
+		return;
+	for (i = 0; i < node->nchildren; ++i)
+		sqfs_mkfs_node_free(node->children[i]);
+	free(node->children);
+	free(node->name);
+	free(node->path);
+	free(node->target);
+	free(node);
+}
+
+static int sqfs_mkfs_node_cmp(const void *a, const void *b) {
+	return strcmp((*(sqfs_mkfs_node * const *)a)->name,
+		(*(sqfs_mkfs_node * const *)b)->name);
+}
+
+/* The node of a path inside the image, NULL if there is none or it goes
+ * through a symbolic link or ".." */
+static sqfs_mkfs_node *sqfs_mkfs_find(sqfs_mkfs_node *root, const char *path) {
+	sqfs_mkfs_node *node = root, key, *pkey = &key, **found;
+	char name[SQUASHFS_NAME_LEN + 1];
+	size_t len;
+
+	for (;;) {
+		while ('/' == *path)
+			++path;
+		if (!(len = strcspn(path, "/")))
+			return node;
+		if (SQUASHFS_DIR_TYPE != node->type || len > SQUASHFS_NAME_LEN)
+			return NULL;
+		memcpy(name, path, len);
+		name[len] = '\0';
+		path += len;
+		if (0 == strcmp(name, "."))
+			continue;
+		if (!node->nchildren)
+			return NULL;
+		key.name = name;
+		found = bsearch(&pkey, node->children, node->nchildren,
+			sizeof(sqfs_mkfs_node *), sqfs_mkfs_node_cmp);
+		if (!found)
+			return NULL;
+		node = *found;
+	}
+}
+
+static sqfs_err sqfs_mkfs_scan(sqfs_mkfs_state *mkfs, sqfs_mkfs_node *dir);
+
+static sqfs_err sqfs_mkfs_add_child(sqfs_mkfs_state *mkfs, sqfs_mkfs_node *dir,
+		const char *name, size_t *capacity) {
+	sqfs_mkfs_node *node;
+
+	if (strlen(name) > SQUASHFS_NAME_LEN) {
+		errno = ENAMETOOLONG;
+		return SQFS_ERR;
+	}
+	if (!(node = calloc(1, sizeof(*node))))
+		return SQFS_ERR;
+	if (!(node->name = strdup(name)) ||
+			!(node->path = sqfs_mkfs_join(dir->path, name)) ||
+			sqfs_mkfs_stat(mkfs, node)) {
+		sqfs_mkfs_node_free(node);
+		return SQFS_ERR;
+	}
+	if (0 == node->type) {
+		sqfs_mkfs_node_free(node);
+		return SQFS_OK;
+	}
+	if (sqfs_mkfs_grow((void **)&dir->children, capacity, dir->nchildren + 1,
+			sizeof(sqfs_mkfs_node *))) {
+		sqfs_mkfs_node_free(node);
+		return SQFS_ERR;
+	}
+	dir->children[dir->nchildren++] = node;
+	return SQFS_OK;
+}
+
+/* Reads the whole tree under dir, but no file contents */
+static sqfs_err sqfs_mkfs_scan(sqfs_mkfs_state *mkfs, sqfs_mkfs_node *dir) {
+	size_t capacity = 0, i;
+	sqfs_err err = SQFS_OK;
+#ifdef _WIN32
+	WIN32_FIND_DATAW data;
+	HANDLE handle;
+	char *pattern = sqfs_mkfs_join(dir->path, "*");
+	wchar_t *wpattern = pattern ? sqfs_mkfs_wide(pattern) : NULL;
+
+	free(pattern);
+	if (!wpattern)
+		return SQFS_ERR;
+	handle = FindFirstFileW(wpattern, &data);
+	free(wpattern);
+	if (INVALID_HANDLE_VALUE == handle)
+		return SQFS_ERR;
+	do {
+		char name[SQUASHFS_NAME_LEN * 4 + 1];
+
+		if (0 == wcscmp(data.cFileName, L".") || 0 == wcscmp(data.cFileName, L".."))
+			continue;
+		if (0 == WideCharToMultiByte(CP_UTF8, 0, data.cFileName, -1, name,
+				sizeof(name), NULL, NULL)) {
+			errno = ENAMETOOLONG;
+			err = SQFS_ERR;
+			break;
+		}
+		if ((err = sqfs_mkfs_add_child(mkfs, dir, name, &capacity)))
+			break;
+	} while (FindNextFileW(handle, &data));
+	FindClose(handle);
+#else
+	DIR *dp = opendir(dir->path);
+	struct dirent *entry;
+
+	if (!dp)
+		return SQFS_ERR;
+	while ((entry = readdir(dp))) {
+		if (0 == strcmp(entry->d_name, ".") || 0 == strcmp(entry->d_name, ".."))
+			continue;
+		if ((err = sqfs_mkfs_add_child(mkfs, dir, entry->d_name, &capacity)))
+			break;
+	}
+	closedir(dp);
+#endif
+	if (err)
+		return err;
+
+	if (dir->nchildren)
+		qsort(dir->children, dir->nchildren, sizeof(sqfs_mkfs_node *),
+			sqfs_mkfs_node_cmp);
+	for (i = 0; i < dir->nchildren; ++i) {
+		if (SQUASHFS_DIR_TYPE == dir->children[i]->type &&
+				(err = sqfs_mkfs_scan(mkfs, dir->children[i])))
+			return err;
+	}
+	return SQFS_OK;
+}
+
+/* ---- Data blocks ---- */
+
+static void sqfs_mkfs_compress(sqfs_mkfs_state *mkfs, sqfs_mkfs_job *job) {
+	size_t outsz = SQFS_COMPRESS_BOUND(job->size);
+
+	if (job->compress && SQFS_OK == mkfs->compressor(job->in, job->size,
+			job->out, &outsz) && outsz < job->size) {
+		job->header = (uint32_t)outsz;
+		job->data = job->out;
+	} else {
+		job->header = (uint32_t)job->size | SQUASHFS_COMPRESSED_BIT_BLOCK;
+		job->data = job->in;
+	}
+}
+
+static THREAD_RETURN sqfs_mkfs_worker(void *arg) {
+	sqfs_mkfs_state *mkfs = (sqfs_mkfs_state *)arg;
+	long i;
+
+	while ((i = ATOMIC_INCREMENT(&mkfs->next_job) - 1) < (long)mkfs->njobs)
+		sqfs_mkfs_compress(mkfs, &mkfs->jobs[i]);
+	return 0;
+}
+
+static sqfs_err sqfs_mkfs_write(sqfs_mkfs_state *mkfs, const void *data, size_t size) {
+	if (size && 1 != fwrite(data, size, 1, mkfs->fp))
+		return SQFS_ERR;
+	mkfs->offset += size;
+	return SQFS_OK;
+}
+
+/* Compresses the pending blocks and writes them in the order they came */
+static sqfs_err sqfs_mkfs_flush_jobs(sqfs_mkfs_state *mkfs) {
+	THREAD threads[SQFS_MKFS_THREADS_MAX];
+	size_t nthreads = mkfs->threads, started = 0, i;
+
+	if (nthreads > mkfs->njobs)
+		nthreads = mkfs->njobs;
+	mkfs->next_job = 0;
+	for (i = 1; i < nthreads; ++i) {
+		if (THREAD_CREATE(&threads[started], sqfs_mkfs_worker, mkfs))
+			break;
+		++started;
+	}
+	/* the calling thread takes its share, and all of it if no thread started */
+	sqfs_mkfs_worker(mkfs);
+	for (i = 0; i < started; ++i)
+		THREAD_JOIN(&threads[i]);
+
+	for (i = 0; i < mkfs->njobs; ++i) {
+		sqfs_mkfs_job *job = &mkfs->jobs[i];
+		mkfs->blocks[job->index].start = mkfs->offset;
+		mkfs->blocks[job->index].header = job->header;
+		if (sqfs_mkfs_write(mkfs, job->data,
+				job->header & ~SQUASHFS_COMPRESSED_BIT_BLOCK))
+			return SQFS_ERR;
+	}
+	mkfs->njobs = 0;
+	return SQFS_OK;
+}
+
+static sqfs_err sqfs_mkfs_submit(sqfs_mkfs_state *mkfs, const unsigned char *data,
+		size_t size, short compress, size_t *index) {
+	sqfs_mkfs_job *job;
+
+	if (mkfs->njobs == mkfs->max_jobs && sqfs_mkfs_flush_jobs(mkfs))
+		return SQFS_ERR;
+	if (sqfs_mkfs_grow((void **)&mkfs->blocks, &mkfs->blocks_capacity,
+			mkfs->nblocks + 1, sizeof(sqfs_mkfs_block)))
+		return SQFS_ERR;
+	*index = mkfs->nblocks++;
+	job = &mkfs->jobs[mkfs->njobs++];
+	memcpy(job->in, data, size);
+	job->size = size;
+	job->compress = compress;
+	job->index = *index;
+	return SQFS_OK;
+}
+
+static sqfs_err sqfs_mkfs_flush_fragment(sqfs_mkfs_state *mkfs) {
+	size_t index;
+
+	if (0 == mkfs->fragment_fill)
+		return SQFS_OK;
+	if (sqfs_mkfs_grow((void **)&mkfs->fragments, &mkfs->fragments_capacity,
+			mkfs->nfragments + 1, sizeof(size_t)))
+		return SQFS_ERR;
+	if (sqfs_mkfs_submit(mkfs, mkfs->fragment, mkfs->fragment_fill, 1, &index))
+		return SQFS_ERR;
+	mkfs->fragments[mkfs->nfragments++] = index;
+	mkfs->fragment_fill = 0;
+	return SQFS_OK;
+}
+
+/* Whether name matches *.ext of an extension to store uncompressed,
+ * which may itself have dots, e.g. tar.gz */
+static short sqfs_mkfs_uncompressed(sqfs_mkfs_state *mkfs, const char *name) {
+	const char * const *ext = mkfs->options->uncompressed;
+	size_t namelen = strlen(name);
+	size_t extlen;
+
+	if (!ext)
+		return 0;
+	for (; *ext; ++ext) {
+		extlen = strlen(*ext);
+		if (namelen > extlen && '.' == name[namelen - extlen - 1] &&
+				0 == strcmp(name + namelen - extlen, *ext))
+			return 1;
+	}
+	return 0;
+}
+
+static sqfs_err sqfs_mkfs_read_file(const char *path, unsigned char *buf,
+		uint64_t size) {
+	FILE *fp = sqfs_mkfs_fopen(path, "rb");
+	size_t got;
+	int extra;
+
+	if (!fp)
+		return SQFS_ERR;
+	got = size ? fread(buf, 1, (size_t)size, fp) : 0;
+	extra = fgetc(fp);
+	fclose(fp);
+	if (got != size || EOF != extra) {
+		/* changed since it was scanned */
+		errno = EAGAIN;
+		return SQFS_ERR;
+	}
+	return SQFS_OK;
+}
+
+static short sqfs_mkfs_same(const char *path, const unsigned char *data,
+		uint64_t size) {
+	unsigned char buf[65536];
+	FILE *fp = sqfs_mkfs_fopen(path, "rb");
+	short same = 1;
+
+	if (!fp)
+		return 0;
+	while (same && size > 0) {
+		size_t want = size < sizeof(buf) ? (size_t)size : sizeof(buf);
+		if (want != fread(buf, 1, want, fp) || memcmp(buf, data, want))
+			same = 0;
+		data += want;
+		size -= want;
+	}
+	fclose(fp);
+	return same;
+}
+
+static sqfs_err sqfs_mkfs_add_file(sqfs_mkfs_state *mkfs, sqfs_mkfs_node *node) {
+	uint64_t size = node->size, hash, pos;
+	size_t bs = mkfs->block_size, tail, index;
+	sqfs_mkfs_data *data, **bucket;
+	unsigned char *buf;
+	short compress;
+
+	if ((uint64_t)(size_t)size != size) {
+		errno = EFBIG;
+		return SQFS_ERR;
+	}
+	if (!(buf = malloc(size ? (size_t)size : 1)))
+		return SQFS_ERR;
+	if (sqfs_mkfs_read_file(node->path, buf, size)) {
+		free(buf);
+		return SQFS_ERR;
+	}
+
+	/* files stored uncompressed keep their tail in a block of its own,
+	 * so that they are a single run in the image */
+	compress = !sqfs_mkfs_uncompressed(mkfs, node->name);
+	hash = sqfs_mkfs_hash(buf, (size_t)size);
+	bucket = &mkfs->dedup[hash % SQFS_MKFS_DEDUP_BUCKETS];
+	for (data = *bucket; data; data = data->next) {
+		if (data->hash == hash && data->size == size && data->compress == compress &&
+				sqfs_mkfs_same(data->path, buf, size)) {
+			node->data = data;
+			free(buf);
+			return SQFS_OK;
+		}
+	}
+
+	if (!(data = calloc(1, sizeof(*data)))) {
+		free(buf);
+		return SQFS_ERR;
+	}
+	data->hash = hash;
+	data->size = size;
+	data->compress = compress;
+	data->path = node->path;
+	data->first_block = mkfs->nblocks;
+	data->frag_idx = SQUASHFS_INVALID_FRAG;
+	data->xattr = SQFS_MKFS_INVALID_XATTR;
+	data->next = *bucket;
+	*bucket = data;
+	node->data = data;
+
+	tail = compress ? (size_t)(size % bs) : 0;
+	for (pos = 0; pos < size - tail; pos += bs) {
+		size_t take = size - pos < bs ? (size_t)(size - pos) : bs;
+		if (sqfs_mkfs_submit(mkfs, buf + pos, take, compress, &index)) {
+			free(buf);
+			return SQFS_ERR;
+		}
+		++data->nblocks;
+	}
+	if (tail) {
+		if (mkfs->fragment_fill + tail > bs && sqfs_mkfs_flush_fragment(mkfs)) {
+			free(buf);
+			return SQFS_ERR;
+		}
+		data->frag_idx = (uint32_t)mkfs->nfragments;
+		data->frag_off = (uint32_t)mkfs->fragment_fill;
+		memcpy(mkfs->fragment + mkfs->fragment_fill, buf + (size - tail), tail);
+		mkfs->fragment_fill += tail;
+	}
+	free(buf);
+	return SQFS_OK;
+}
+
+static sqfs_err sqfs_mkfs_add_files(sqfs_mkfs_state *mkfs, sqfs_mkfs_node *dir) {
+	size_t i;
+
+	for (i = 0; i < dir->nchildren; ++i) {
+		sqfs_mkfs_node *node = dir->children[i];
+		sqfs_err err = SQFS_OK;
+
+		if (SQUASHFS_REG_TYPE == node->type && !node->data)
+			err = sqfs_mkfs_add_file(mkfs, node);
+		else if (SQUASHFS_DIR_TYPE == node->type)
+			err = sqfs_mkfs_add_files(mkfs, node);
+		if (err)
+			return err;
+	}
+	return SQFS_OK;
+}
+
+/* ---- Metadata ---- */
+
+/* Compresses a metadata block of size bytes into out, which holds
+ * SQFS_COMPRESS_BOUND(SQUASHFS_METADATA_SIZE) + 2 bytes, or stores it */
+static size_t sqfs_mkfs_md_block(sqfs_mkfs_state *mkfs, const unsigned char *in,
+		size_t size, short compress, unsigned char *out) {
+	size_t outsz = SQFS_COMPRESS_BOUND(SQUASHFS_METADATA_SIZE);
+
+	if (compress && SQFS_OK == mkfs->compressor((void *)in, size, out + 2, &outsz) &&
+			outsz < size) {
+		sqfs_mkfs_le16(out, (uint16_t)outsz);
+		return 2 + outsz;
+	}
+	sqfs_mkfs_le16(out, (uint16_t)(size | SQUASHFS_COMPRESSED_BIT));
+	memcpy(out + 2, in, size);
+	return 2 + size;
+}
+
+static sqfs_err sqfs_mkfs_md_flush(sqfs_mkfs_state *mkfs, sqfs_mkfs_md *md) {
+	unsigned char out[SQFS_COMPRESS_BOUND(SQUASHFS_METADATA_SIZE) + 2];
+	size_t size;
+
+	if (0 == md->fill)
+		return SQFS_OK;
+	size = sqfs_mkfs_md_block(mkfs, md->block, md->fill, md->compress, out);
+	if (sqfs_mkfs_grow((void **)&md->out, &md->capacity, md->size + size, 1))
+		return SQFS_ERR;
+	memcpy(md->out + md->size, out, size);
+	md->size += size;
+	md->fill = 0;
+	return SQFS_OK;
+}
+
+static sqfs_err sqfs_mkfs_md_put(sqfs_mkfs_state *mkfs, sqfs_mkfs_md *md,
+		const void *data, size_t size) {
+	const unsigned char *p = (const unsigned char *)data;
+
+	while (size > 0) {
+		size_t take = SQUASHFS_METADATA_SIZE - md->fill;
+		if (take > size)
+			take = size;
+		memcpy(md->block + md->fill, p, take);
+		md->fill += take;
+		md->total += take;
+		p += take;
+		size -= take;
+		/* a full block is written at once, so that the position of
+		 * what comes next is at the start of the next block */
+		if (SQUASHFS_METADATA_SIZE == md->fill && sqfs_mkfs_md_flush(mkfs, md))
+			return SQFS_ERR;
+	}
+	return SQFS_OK;
+}
+
+/* As an inode id, the start of the block and the offset in it */
+static sqfs_inode_id sqfs_mkfs_md_pos(sqfs_mkfs_md *md) {
+	return ((sqfs_inode_id)md->size << 16) | md->fill;
+}
+
+static size_t sqfs_mkfs_inode_base(sqfs_mkfs_node *node, int type,
+		unsigned char *p) {
+	sqfs_mkfs_le16(p, (uint16_t)type);
+	sqfs_mkfs_le16(p + 2, node->mode);
+	sqfs_mkfs_le16(p + 4, node->uid_idx);
+	sqfs_mkfs_le16(p + 6, node->gid_idx);
+	sqfs_mkfs_le32(p + 8, node->mtime);
+	sqfs_mkfs_le32(p + 12, node->inode_number);
+	return 16;
+}
+
+/* Records the content hash of data as the xattr user.squash.hash, once
+ * for all the files sharing it */
+static sqfs_err sqfs_mkfs_xattr_hash(sqfs_mkfs_state *mkfs, sqfs_mkfs_data *data) {
+	size_t len = sizeof(SQFS_XATTR_HASH) - 1;
+	unsigned char buf[4 + sizeof(SQFS_XATTR_HASH) - 1 + 4 + 8];
+	unsigned char *id;
+
+	if (SQFS_MKFS_INVALID_XATTR != data->xattr)
+		return SQFS_OK;
+	if (sqfs_mkfs_grow((void **)&mkfs->xattr_ids, &mkfs->xattr_ids_capacity,
+			mkfs->nxattrs + 1, sizeof(struct squashfs_xattr_id)))
+		return SQFS_ERR;
+	id = mkfs->xattr_ids + mkfs->nxattrs * sizeof(struct squashfs_xattr_id);
+	sqfs_mkfs_le64(id, sqfs_mkfs_md_pos(&mkfs->xattr_table));
+	sqfs_mkfs_le32(id + 8, 1);	/* count */
+	/* the size of the name with its prefix, and of the value */
+	sqfs_mkfs_le32(id + 12, (uint32_t)(sizeof("user.") - 1 + len + 8));
+
+	sqfs_mkfs_le16(buf, SQUASHFS_XATTR_USER);
+	sqfs_mkfs_le16(buf + 2, (uint16_t)len);
+	memcpy(buf + 4, SQFS_XATTR_HASH, len);
+	sqfs_mkfs_le32(buf + 4 + len, 8);
+	sqfs_mkfs_le64(buf + 8 + len, data->hash);
+	if (sqfs_mkfs_md_put(mkfs, &mkfs->xattr_table, buf, sizeof(buf)))
+		return SQFS_ERR;
+	data->xattr = (uint32_t)mkfs->nxattrs++;
+	return SQFS_OK;
+}
+
+static sqfs_err sqfs_mkfs_write_file_inode(sqfs_mkfs_state *mkfs, sqfs_mkfs_node *node) {
+	unsigned char buf[64];
+	size_t n, i;
+	sqfs_mkfs_data *data = node->data;
+	uint64_t start = data->nblocks ? mkfs->blocks[data->first_block].start : 0;
+
+	if (mkfs->options->content_hashes && sqfs_mkfs_xattr_hash(mkfs, data))
+		return SQFS_ERR;
+	node->inode_ref = sqfs_mkfs_md_pos(&mkfs->inode_table);
+	if (start <= 0xffffffffU && data->size <= 0xffffffffU &&
+			SQFS_MKFS_INVALID_XATTR == data->xattr) {
+		n = sqfs_mkfs_inode_base(node, SQUASHFS_REG_TYPE, buf);
+		sqfs_mkfs_le32(buf + n, (uint32_t)start);
+		sqfs_mkfs_le32(buf + n + 4, data->frag_idx);
+		sqfs_mkfs_le32(buf + n + 8, data->frag_off);
+		sqfs_mkfs_le32(buf + n + 12, (uint32_t)data->size);
+		n += 16;
+	} else {
+		n = sqfs_mkfs_inode_base(node, SQUASHFS_LREG_TYPE, buf);
+		sqfs_mkfs_le64(buf + n, start);
+		sqfs_mkfs_le64(buf + n + 8, data->size);
+		sqfs_mkfs_le64(buf + n + 16, 0);	/* sparse */
+		sqfs_mkfs_le32(buf + n + 24, 1);	/* nlink */
+		sqfs_mkfs_le32(buf + n + 28, data->frag_idx);
+		sqfs_mkfs_le32(buf + n + 32, data->frag_off);
+		sqfs_mkfs_le32(buf + n + 36, data->xattr);
+		n += 40;
+	}
+	if (sqfs_mkfs_md_put(mkfs, &mkfs->inode_table, buf, n))
+		return SQFS_ERR;
+	for (i = 0; i < data->nblocks; ++i) {
+		sqfs_mkfs_le32(buf, mkfs->blocks[data->first_block + i].header);
+		if (sqfs_mkfs_md_put(mkfs, &mkfs->inode_table, buf, 4))
+			return SQFS_ERR;
+	}
+	return SQFS_OK;
+}
+
+static sqfs_err sqfs_mkfs_write_link_inode(sqfs_mkfs_state *mkfs, sqfs_mkfs_node *node) {
+	unsigned char buf[32];
+	size_t n;
+
+	node->inode_ref = sqfs_mkfs_md_pos(&mkfs->inode_table);
+	n = sqfs_mkfs_inode_base(node, SQUASHFS_SYMLINK_TYPE, buf);
+	sqfs_mkfs_le32(buf + n, 1);	/* nlink */
+	sqfs_mkfs_le32(buf + n + 4, (uint32_t)node->target_size);
+	n += 8;
+	if (sqfs_mkfs_md_put(mkfs, &mkfs->inode_table, buf, n))
+		return SQFS_ERR;
+	return sqfs_mkfs_md_put(mkfs, &mkfs->inode_table, node->target,
+		node->target_size);
+}
+
+/* Entries go in runs sharing a header, each run within one block of
+ * inodes and within reach of a 16-bit difference of inode numbers */
+static sqfs_err sqfs_mkfs_write_listing(sqfs_mkfs_state *mkfs, sqfs_mkfs_node *dir) {
+	size_t i = 0;
+
+	while (i < dir->nchildren) {
+		sqfs_mkfs_node *first = dir->children[i];
+		uint32_t block = (uint32_t)(first->inode_ref >> 16);
+		size_t count = 1, j;
+		unsigned char buf[12];
+
+		while (i + count < dir->nchildren && count < SQFS_MKFS_DIR_RUN) {
+			sqfs_mkfs_node *node = dir->children[i + count];
+			long diff = (long)node->inode_number - (long)first->inode_number;
+			if ((uint32_t)(node->inode_ref >> 16) != block ||
+					diff > 32767 || diff < -32768)
+				break;
+			++count;
+		}
+
+		sqfs_mkfs_le32(buf, (uint32_t)(count - 1));
+		sqfs_mkfs_le32(buf + 4, block);
+		sqfs_mkfs_le32(buf + 8, first->inode_number);
+		if (sqfs_mkfs_md_put(mkfs, &mkfs->dir_table, buf, 12))
+			return SQFS_ERR;
+		for (j = i; j < i + count; ++j) {
+			sqfs_mkfs_node *node = dir->children[j];
+			size_t len = strlen(node->name);
+			sqfs_mkfs_le16(buf, (uint16_t)(node->inode_ref & 0xffff));
+			sqfs_mkfs_le16(buf + 2,
+				(uint16_t)(int16_t)(node->inode_number - first->inode_number));
+			sqfs_mkfs_le16(buf + 4, (uint16_t)node->type);
+			sqfs_mkfs_le16(buf + 6, (uint16_t)(len - 1));
+			if (sqfs_mkfs_md_put(mkfs, &mkfs->dir_table, buf, 8) ||
+					sqfs_mkfs_md_put(mkfs, &mkfs->dir_table, node->name, len))
+				return SQFS_ERR;
+		}
+		i += count;
+	}
+	return SQFS_OK;
+}
+
+static sqfs_err sqfs_mkfs_write_dir(sqfs_mkfs_state *mkfs, sqfs_mkfs_node *dir,
+		uint32_t parent_inode) {
+	unsigned char buf[48];
+	size_t i, n;
+	uint32_t nlink = 2;
+	sqfs_inode_id listing;
+	uint64_t listing_size;
+	sqfs_err err;
+
+	for (i = 0; i < dir->nchildren; ++i) {
+		sqfs_mkfs_node *node = dir->children[i];
+		if (SQUASHFS_DIR_TYPE == node->type) {
+			++nlink;
+			err = sqfs_mkfs_write_dir(mkfs, node, dir->inode_number);
+		} else if (SQUASHFS_REG_TYPE == node->type) {
+			err = sqfs_mkfs_write_file_inode(mkfs, node);
+		} else {
+			err = sqfs_mkfs_write_link_inode(mkfs, node);
+		}
+		if (err)
+			return err;
+	}
+
+	listing = sqfs_mkfs_md_pos(&mkfs->dir_table);
+	listing_size = mkfs->dir_table.total;
+	if ((err = sqfs_mkfs_write_listing(mkfs, dir)))
+		return err;
+	/* plus 3, as mksquashfs does */
+	listing_size = mkfs->dir_table.total - listing_size + 3;
+
+	dir->inode_ref = sqfs_mkfs_md_pos(&mkfs->inode_table);
+	if (listing_size <= 0xffff) {
+		n = sqfs_mkfs_inode_base(dir, SQUASHFS_DIR_TYPE, buf);
+		sqfs_mkfs_le32(buf + n, (uint32_t)(listing >> 16));
+		sqfs_mkfs_le32(buf + n + 4, nlink);
+		sqfs_mkfs_le16(buf + n + 8, (uint16_t)listing_size);
+		sqfs_mkfs_le16(buf + n + 10, (uint16_t)(listing & 0xffff));
+		sqfs_mkfs_le32(buf + n + 12, parent_inode);
+		n += 16;
+	} else {
+		n = sqfs_mkfs_inode_base(dir, SQUASHFS_LDIR_TYPE, buf);
+		sqfs_mkfs_le32(buf + n, nlink);
+		sqfs_mkfs_le32(buf + n + 4, (uint32_t)listing_size);
+		sqfs_mkfs_le32(buf + n + 8, (uint32_t)(listing >> 16));
+		sqfs_mkfs_le32(buf + n + 12, parent_inode);
+		sqfs_mkfs_le16(buf + n + 16, 0);	/* no index */
+		sqfs_mkfs_le16(buf + n + 18, (uint16_t)(listing & 0xffff));
+		sqfs_mkfs_le32(buf + n + 20, SQFS_MKFS_INVALID_XATTR);
+		n += 24;
+	}
+	return sqfs_mkfs_md_put(mkfs, &mkfs->inode_table, buf, n);
+}
+
+/* The entries of a directory get consecutive inode numbers,
+ * after those of everything below them */
+static void sqfs_mkfs_number(sqfs_mkfs_state *mkfs, sqfs_mkfs_node *dir) {
+	size_t i;
+
+	for (i = 0; i < dir->nchildren; ++i) {
+		if (SQUASHFS_DIR_TYPE == dir->children[i]->type)
+			sqfs_mkfs_number(mkfs, dir->children[i]);
+	}
+	for (i = 0; i < dir->nchildren; ++i)
+		dir->children[i]->inode_number = ++mkfs->inodes;
+}
+
+/* A table of fixed-size entries: metadata blocks, then the header of the
+ * table if any and the position of each block, which is where *start points */
+static sqfs_err sqfs_mkfs_write_table(sqfs_mkfs_state *mkfs, const unsigned char *data,
+		size_t size, const unsigned char *header, size_t header_size, uint64_t *start) {
+	unsigned char out[SQFS_COMPRESS_BOUND(SQUASHFS_METADATA_SIZE) + 2];
+	size_t nblocks = (size + SQUASHFS_METADATA_SIZE - 1) / SQUASHFS_METADATA_SIZE;
+	unsigned char *index = malloc(nblocks ? nblocks * 8 : 1);
+	size_t i;
+
+	if (!index)
+		return SQFS_ERR;
+	for (i = 0; i < nblocks; ++i) {
+		size_t take = size - i * SQUASHFS_METADATA_SIZE;
+		if (take > SQUASHFS_METADATA_SIZE)
+			take = SQUASHFS_METADATA_SIZE;
+		sqfs_mkfs_le64(index + i * 8, mkfs->offset);
+		if (sqfs_mkfs_write(mkfs, out, sqfs_mkfs_md_block(mkfs,
+				data + i * SQUASHFS_METADATA_SIZE, take, 1, out))) {
+			free(index);
+			return SQFS_ERR;
+		}
+	}
+	*start = mkfs->offset;
+	if ((header_size && sqfs_mkfs_write(mkfs, header, header_size)) ||
+			sqfs_mkfs_write(mkfs, index, nblocks * 8)) {
+		free(index);
+		return SQFS_ERR;
+	}
+	free(index);
+	return SQFS_OK;
+}
+
+static sqfs_err sqfs_mkfs_write_tables(sqfs_mkfs_state *mkfs, unsigned char *sb) {
+	unsigned char *table;
+	size_t i, size;
+	uint64_t start;
+	sqfs_err err;
+
+	sqfs_mkfs_le64(sb + 64, mkfs->offset);	/* inode_table_start */
+	if (sqfs_mkfs_write(mkfs, mkfs->inode_table.out, mkfs->inode_table.size))
+		return SQFS_ERR;
+	sqfs_mkfs_le64(sb + 72, mkfs->offset);	/* directory_table_start */
+	if (sqfs_mkfs_write(mkfs, mkfs->dir_table.out, mkfs->dir_table.size))
+		return SQFS_ERR;
+
+	size = mkfs->nfragments * sizeof(struct squashfs_fragment_entry);
+	if (!(table = calloc(1, size ? size : 1)))
+		return SQFS_ERR;
+	for (i = 0; i < mkfs->nfragments; ++i) {
+		sqfs_mkfs_block *block = &mkfs->blocks[mkfs->fragments[i]];
+		sqfs_mkfs_le64(table + i * 16, block->start);
+		sqfs_mkfs_le32(table + i * 16 + 8, block->header);
+	}
+	err = sqfs_mkfs_write_table(mkfs, table, size, NULL, 0, &start);
+	free(table);
+	if (err)
+		return err;
+	sqfs_mkfs_le64(sb + 80, start);	/* fragment_table_start */
+
+	size = mkfs->nids * sizeof(uint32_t);
+	if (!(table = malloc(size ? size : 1)))
+		return SQFS_ERR;
+	for (i = 0; i < mkfs->nids; ++i)
+		sqfs_mkfs_le32(table + i * 4, mkfs->ids[i]);
+	err = sqfs_mkfs_write_table(mkfs, table, size, NULL, 0, &start);
+	free(table);
+	if (err)
+		return err;
+	sqfs_mkfs_le64(sb + 48, start);	/* id_table_start */
+
+	sqfs_mkfs_le64(sb + 56, (uint64_t)-1);	/* no xattrs */
+	if (mkfs->nxattrs) {
+		unsigned char header[sizeof(struct squashfs_xattr_id_table)];
+		sqfs_mkfs_le64(header, mkfs->offset);	/* xattr_table_start */
+		sqfs_mkfs_le32(header + 8, (uint32_t)mkfs->nxattrs);
+		sqfs_mkfs_le32(header + 12, 0);
+		if (sqfs_mkfs_write(mkfs, mkfs->xattr_table.out, mkfs->xattr_table.size))
+			return SQFS_ERR;
+		if ((err = sqfs_mkfs_write_table(mkfs, mkfs->xattr_ids,
+				mkfs->nxattrs * sizeof(struct squashfs_xattr_id),
+				header, sizeof(header), &start)))
+			return err;
+		sqfs_mkfs_le64(sb + 56, start);	/* xattr_id_table_start */
+	}
+	return SQFS_OK;
+}
+
+static uint32_t sqfs_mkfs_time() {
+	const char *env = getenv("SOURCE_DATE_EPOCH");
+
+	if (env && *env) {
+		char *end;
+		unsigned long value = strtoul(env, &end, 10);
+		if ('\0' == *end)
+			return (uint32_t)value;
+	}
+	return (uint32_t)time(NULL);
+}
+
+static sqfs_err sqfs_mkfs_build(sqfs_mkfs_state *mkfs, const char *source) {
+	unsigned char sb[SQFS_MKFS_SUPERBLOCK_SIZE];
+	unsigned char padding[SQFS_MKFS_PADDING];
+	uint16_t flags = 1 << SQUASHFS_DUPLICATE;
+	uint16_t block_log = 0;
+	const char * const *order;
+	size_t i;
+	sqfs_err err;
+
+	while (((size_t)1 << block_log) < mkfs->block_size)
+		++block_log;
+	if (mkfs->options->uncompressed_metadata)
+		flags |= (1 << SQUASHFS_NOI) | (1 << SQUASHFS_NOD);
+
+	/* the tree */
+	if (!(mkfs->root = calloc(1, sizeof(sqfs_mkfs_node))))
+		return SQFS_ERR;
+	if (!(mkfs->root->path = strdup(source)) ||
+			!(mkfs->root->name = strdup("")))
+		return SQFS_ERR;
+	if ((err = sqfs_mkfs_stat(mkfs, mkfs->root)))
+		return err;
+	if (SQUASHFS_DIR_TYPE != mkfs->root->type) {
+		errno = ENOTDIR;
+		return SQFS_ERR;
+	}
+	if ((err = sqfs_mkfs_scan(mkfs, mkfs->root)))
+		return err;
+	sqfs_mkfs_number(mkfs, mkfs->root);
+	mkfs->root->inode_number = ++mkfs->inodes;
+
+	/* the superblock comes last, when everything else is known */
+	memset(sb, 0, sizeof(sb));
+	if (sqfs_mkfs_write(mkfs, sb, sizeof(sb)))
+		return SQFS_ERR;
+	if (LZ4_COMPRESSION == mkfs->options->compression) {
+		/* LZ4 images always carry their options: version 1, LZ4_HC */
+		unsigned char options[2 + 8];
+		sqfs_mkfs_le16(options, 8 | SQUASHFS_COMPRESSED_BIT);
+		sqfs_mkfs_le32(options + 2, 1);
+		sqfs_mkfs_le32(options + 6, 1);
+		if (sqfs_mkfs_write(mkfs, options, sizeof(options)))
+			return SQFS_ERR;
+		flags |= 1 << SQUASHFS_COMP_OPT;
+	}
+
+	/* the data, the files of options->order first so that they are
+	 * contiguous, and their tails share fragments */
+	for (order = mkfs->options->order; order && *order; ++order) {
+		sqfs_mkfs_node *node = sqfs_mkfs_find(mkfs->root, *order);
+		if (node && SQUASHFS_REG_TYPE == node->type && !node->data &&
+				(err = sqfs_mkfs_add_file(mkfs, node)))
+			return err;
+	}
+	if ((err = sqfs_mkfs_add_files(mkfs, mkfs->root)))
+		return err;
+	if ((err = sqfs_mkfs_flush_fragment(mkfs)))
+		return err;
+	if ((err = sqfs_mkfs_flush_jobs(mkfs)))
+		return err;
+
+	/* the metadata, the root directory is the last inode written */
+	if ((err = sqfs_mkfs_write_dir(mkfs, mkfs->root, mkfs->inodes + 1)))
+		return err;
+	if (sqfs_mkfs_md_flush(mkfs, &mkfs->inode_table) ||
+			sqfs_mkfs_md_flush(mkfs, &mkfs->dir_table) ||
+			sqfs_mkfs_md_flush(mkfs, &mkfs->xattr_table))
+		return SQFS_ERR;
+	if ((err = sqfs_mkfs_write_tables(mkfs, sb)))
+		return err;
+
+	sqfs_mkfs_le32(sb, SQUASHFS_MAGIC);
+	sqfs_mkfs_le32(sb + 4, mkfs->inodes);
+	sqfs_mkfs_le32(sb + 8, sqfs_mkfs_time());
+	sqfs_mkfs_le32(sb + 12, (uint32_t)mkfs->block_size);
+	sqfs_mkfs_le32(sb + 16, (uint32_t)mkfs->nfragments);
+	sqfs_mkfs_le16(sb + 20, (uint16_t)mkfs->options->compression);
+	sqfs_mkfs_le16(sb + 22, block_log);
+	sqfs_mkfs_le16(sb + 24, flags);
+	sqfs_mkfs_le16(sb + 26, (uint16_t)mkfs->nids);
+	sqfs_mkfs_le16(sb + 28, SQUASHFS_MAJOR);
+	sqfs_mkfs_le16(sb + 30, SQUASHFS_MINOR);
+	sqfs_mkfs_le64(sb + 32, mkfs->root->inode_ref);
+	sqfs_mkfs_le64(sb + 40, mkfs->offset);	/* bytes_used */
+	sqfs_mkfs_le64(sb + 88, (uint64_t)-1);	/* no export table */
+
+	memset(padding, 0, sizeof(padding));
+	i = (size_t)(mkfs->offset % SQFS_MKFS_PADDING);
+	if (i && sqfs_mkfs_write(mkfs, padding, SQFS_MKFS_PADDING - i))
+		return SQFS_ERR;
+	if (fseek(mkfs->fp, 0, SEEK_SET) || 1 != fwrite(sb, sizeof(sb), 1, mkfs->fp))
+		return SQFS_ERR;
+	return SQFS_OK;
+}
+
+static void sqfs_mkfs_destroy(sqfs_mkfs_state *mkfs) {
+	size_t i;
+
+	for (i = 0; i < SQFS_MKFS_DEDUP_BUCKETS; ++i) {
+		sqfs_mkfs_data *data = mkfs->dedup[i];
+		while (data) {
+			sqfs_mkfs_data *next = data->next;
+			free(data);
+			data = next;
+		}
+	}
+	sqfs_mkfs_node_free(mkfs->root);
+	for (i = 0; i < mkfs->max_jobs; ++i) {
+		free(mkfs->jobs[i].in);
+		free(mkfs->jobs[i].out);
+	}
+	free(mkfs->jobs);
+	free(mkfs->blocks);
+	free(mkfs->fragments);
+	free(mkfs->fragment);
+	free(mkfs->ids);
+	free(mkfs->inode_table.out);
+	free(mkfs->dir_table.out);
+	free(mkfs->xattr_table.out);
+	free(mkfs->xattr_ids);
+}
+
+sqfs_err sqfs_mkfs(const char *source, const char *image,
+		const sqfs_mkfs_options *options) {
+	sqfs_mkfs_state mkfs;
+	sqfs_err err = SQFS_ERR;
+	size_t bs = options->block_size, i;
+
+	if (bs < 4096 || bs > SQUASHFS_FILE_MAX_SIZE || (bs & (bs - 1))) {
+		errno = EINVAL;
+		return SQFS_ERR;
+	}
+	memset(&mkfs, 0, sizeof(mkfs));
+	mkfs.options = options;
+	mkfs.block_size = bs;
+	if (!(mkfs.compressor = sqfs_compressor_get(options->compression)))
+		return SQFS_BADCOMP;
+	mkfs.threads = options->threads;
+	if (mkfs.threads < 1)
+		mkfs.threads = 1;
+	if (mkfs.threads > SQFS_MKFS_THREADS_MAX)
+		mkfs.threads = SQFS_MKFS_THREADS_MAX;
+	mkfs.inode_table.compress = !options->uncompressed_metadata;
+	mkfs.dir_table.compress = !options->uncompressed_metadata;
+	mkfs.xattr_table.compress = 1;
+
+	mkfs.max_jobs = mkfs.threads * SQFS_MKFS_BATCH;
+	if (!(mkfs.jobs = calloc(mkfs.max_jobs, sizeof(sqfs_mkfs_job))) ||
+			!(mkfs.fragment = malloc(bs)))
+		goto exit;
+	for (i = 0; i < mkfs.max_jobs; ++i) {
+		if (!(mkfs.jobs[i].in = malloc(bs)) ||
+				!(mkfs.jobs[i].out = malloc(SQFS_COMPRESS_BOUND(bs))))
+			goto exit;
+	}
+
+	if (!(mkfs.fp = sqfs_mkfs_fopen(image, "wb")))
+		goto exit;
+	err = sqfs_mkfs_build(&mkfs, source);
+	if (fclose(mkfs.fp) && !err)
+		err = SQFS_ERR;
+exit:
+	sqfs_mkfs_destroy(&mkfs);
+	return err;
+}
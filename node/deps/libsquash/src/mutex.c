@@ -8,6 +8,10 @@
 
 #include "squash/mutex.h"
 
+#ifndef _WIN32
+#include <sched.h>
+#endif
+
 
 int MUTEX_INIT(MUTEX *mutex)
 {
@@ -47,3 +51,122 @@ int MUTEX_DESTORY(MUTEX *mutex)
     return pthread_mutex_destroy(mutex);
 #endif
 }
+
+int COND_INIT(COND *cond)
+{
+#ifdef _WIN32
+    // auto-reset, so that a signal before the wait is not lost
+    *cond = CreateEvent(NULL, FALSE, FALSE, NULL);
+    return (*cond==0);
+#else
+    return pthread_cond_init(cond, NULL);
+#endif
+}
+
+int COND_WAIT(COND *cond, MUTEX *mutex)
+{
+#ifdef _WIN32
+    if (SignalObjectAndWait(*mutex, *cond, INFINITE, FALSE)==WAIT_FAILED)
+        return 1;
+    return (WaitForSingleObject(*mutex, INFINITE)==WAIT_FAILED?1:0);
+#else
+    return pthread_cond_wait(cond, mutex);
+#endif
+}
+
+int COND_SIGNAL(COND *cond)
+{
+#ifdef _WIN32
+    return (SetEvent(*cond)==0);
+#else
+    return pthread_cond_signal(cond);
+#endif
+}
+
+int COND_DESTROY(COND *cond)
+{
+#ifdef _WIN32
+    return CloseHandle(*cond);
+#else
+    return pthread_cond_destroy(cond);
+#endif
+}
+
+int THREAD_CREATE(THREAD *thread, THREAD_START start, void *arg)
+{
+#ifdef _WIN32
+    *thread = (HANDLE)_beginthreadex(NULL, 0, start, arg, 0, NULL);
+    return (*thread==0);
+#else
+    return pthread_create(thread, NULL, start, arg);
+#endif
+}
+
+int THREAD_JOIN(THREAD *thread)
+{
+#ifdef _WIN32
+    if (WaitForSingleObject(*thread, INFINITE)==WAIT_FAILED)
+        return 1;
+    return (CloseHandle(*thread)==0);
+#else
+    return pthread_join(*thread, NULL);
+#endif
+}
+
+void THREAD_YIELD()
+{
+#ifdef _WIN32
+    Sleep(0);
+#else
+    sched_yield();
+#endif
+}
+
+long ATOMIC_INCREMENT(volatile long *value)
+{
+#ifdef _WIN32
+    return InterlockedIncrement(value);
+#else
+    return __sync_add_and_fetch(value, 1);
+#endif
+}
+
+long ATOMIC_DECREMENT(volatile long *value)
+{
+#ifdef _WIN32
+    return InterlockedDecrement(value);
+#else
+    return __sync_sub_and_fetch(value, 1);
+#endif
+}
+
+int64_t ATOMIC_ADD64(volatile int64_t *value, int64_t delta)
+{
+#ifdef _WIN32
+    return InterlockedExchangeAdd64(value, delta) + delta;
+#else
+    return __sync_add_and_fetch(value, delta);
+#endif
+}
+
+void ATOMIC_ACQUIRE()
+{
+#ifdef _WIN32
+    MemoryBarrier();
+#elif defined(__ATOMIC_ACQUIRE)
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+#else
+    __sync_synchronize();
+#endif
+}
+
+void ATOMIC_RELEASE()
+{
+#ifdef _WIN32
+    MemoryBarrier();
+#elif defined(__ATOMIC_RELEASE)
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+#else
+    __sync_synchronize();
+#endif
+}
@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2017 Minqi Pan <pmq2001@gmail.com>
+ *                    Shengyuan Liu <sounder.liu@gmail.com>
+ *
+ * This file is part of libsquash, distributed under the MIT License
+ * For full terms see the included LICENSE file
+ */
+
+#include "squash.h"
+#include "squash/hash.h"
+
+/*
+ * The overlay index remembers the paths written through the hooks, keyed
+ * by a hash of the path, so that every other lookup is answered without
+ * asking the disk. A collision or a path it cannot tell apart, e.g. one
+ * with "..", only costs the caller the stat() it would have done anyway.
+ */
+#define SQUASH_OVERLAY_EXACT 1
+#define SQUASH_OVERLAY_SUBTREE 2
+
+static sqfs_hash squash_overlay_index;
+static volatile size_t squash_overlay_entries = 0;
+
+#define SQUASH_OVERLAY_FNV_BASIS 2166136261U
+#define SQUASH_OVERLAY_FNV_PRIME 16777619U
+
+/* Hashes the components of path, calling visit on the hash of every
+ * proper prefix and returning that of the whole path; repeated and
+ * trailing slashes are ignored */
+static sqfs_hash_key squash_overlay_hash(const char *path, short *dots,
+	short (*visit)(sqfs_hash_key key))
+{
+	sqfs_hash_key key = SQUASH_OVERLAY_FNV_BASIS;
+	const char *p = path;
+
+	*dots = 0;
+	while (*p) {
+		const char *name;
+
+		while ('/' == *p) {
+			++p;
+		}
+		if (!*p) {
+			break;
+		}
+		if (p != path && visit && visit(key)) {
+			return key;
+		}
+		name = p;
+		key = (key ^ '/') * SQUASH_OVERLAY_FNV_PRIME;
+		while (*p && '/' != *p) {
+			key = (key ^ (unsigned char)*p) * SQUASH_OVERLAY_FNV_PRIME;
+			++p;
+		}
+		if ('.' == name[0] && (p == name + 1 || ('.' == name[1] && p == name + 2))) {
+			*dots = 1;
+		}
+	}
+	return key;
+}
+
+static short squash_overlay_subtree(sqfs_hash_key key)
+{
+	char *flags = sqfs_hash_get(&squash_overlay_index, key);
+	return flags && (*flags & SQUASH_OVERLAY_SUBTREE);
+}
+
+int squash_overlay_add(const char *path, short subtree)
+{
+	char flags = subtree ? SQUASH_OVERLAY_SUBTREE | SQUASH_OVERLAY_EXACT : SQUASH_OVERLAY_EXACT;
+	sqfs_hash_key key;
+	char *found;
+	short dots;
+
+	key = squash_overlay_hash(path, &dots, NULL);
+	MUTEX_LOCK(&squash_global_mutex);
+	if (0 == squash_overlay_entries && sqfs_hash_init(&squash_overlay_index, 1, 64)) {
+		MUTEX_UNLOCK(&squash_global_mutex);
+		errno = ENOMEM;
+		return -1;
+	}
+	found = sqfs_hash_get(&squash_overlay_index, key);
+	if (found) {
+		*found |= flags;
+	} else if (sqfs_hash_add(&squash_overlay_index, key, &flags)) {
+		if (0 == squash_overlay_entries) {
+			sqfs_hash_destroy(&squash_overlay_index);
+		}
+		MUTEX_UNLOCK(&squash_global_mutex);
+		errno = ENOMEM;
+		return -1;
+	} else {
+		++squash_overlay_entries;
+	}
+	MUTEX_UNLOCK(&squash_global_mutex);
+	return 0;
+}
+
+short squash_overlay_lookup(const char *path)
+{
+	sqfs_hash_key key;
+	char *flags;
+	short dots;
+	short ret;
+
+	// nothing was ever written, the common case
+	if (0 == squash_overlay_entries) {
+		return 0;
+	}
+	MUTEX_LOCK(&squash_global_mutex);
+	if (0 == squash_overlay_entries) {
+		ret = 0;
+	} else {
+		key = squash_overlay_hash(path, &dots, squash_overlay_subtree);
+		flags = sqfs_hash_get(&squash_overlay_index, key);
+		ret = dots || (flags && *flags) || squash_overlay_subtree(key);
+	}
+	MUTEX_UNLOCK(&squash_global_mutex);
+	return ret;
+}
+
+void squash_overlay_clear()
+{
+	MUTEX_LOCK(&squash_global_mutex);
+	if (squash_overlay_entries) {
+		sqfs_hash_destroy(&squash_overlay_index);
+		squash_overlay_entries = 0;
+	}
+	MUTEX_UNLOCK(&squash_global_mutex);
+}
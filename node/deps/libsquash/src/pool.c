@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2017 Minqi Pan <pmq2001@gmail.com>
+ *                    Shengyuan Liu <sounder.liu@gmail.com>
+ *
+ * This file is part of libsquash, distributed under the MIT License
+ * For full terms see the included LICENSE file
+ */
+
+#include "squash/pool.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+sqfs_err sqfs_pool_init(sqfs_pool *pool, size_t size) {
+	memset(pool, 0, sizeof(*pool));
+	pool->size = size;
+	pool->max_free = size ? SQFS_POOL_MAX_FREE_BYTES / size : 1024;
+	if (pool->max_free < 4)
+		pool->max_free = 4;
+	if (MUTEX_INIT(&pool->mutex)) {
+		pool->max_free = 0;
+		return SQFS_ERR;
+	}
+	return SQFS_OK;
+}
+
+void sqfs_pool_destroy(sqfs_pool *pool) {
+	if (!pool->max_free)
+		return;
+	while (pool->free_list) {
+		sqfs_block *block = pool->free_list;
+		pool->free_list = (sqfs_block *)block->data;
+		free(block);
+	}
+	pool->nfree = 0;
+	pool->max_free = 0;
+	MUTEX_DESTORY(&pool->mutex);
+}
+
+sqfs_block *sqfs_pool_get(sqfs_pool *pool) {
+	sqfs_block *block;
+	
+	MUTEX_LOCK(&pool->mutex);
+	block = pool->free_list;
+	if (block) {
+		pool->free_list = (sqfs_block *)block->data;
+		--pool->nfree;
+		++pool->reuses;
+	} else {
+		++pool->allocs;
+	}
+	MUTEX_UNLOCK(&pool->mutex);
+	
+	if (!block && !(block = malloc(sizeof(sqfs_block) + pool->size)))
+		return NULL;
+	
+	block->data = pool->size ? (void *)(block + 1) : NULL;
+	block->size = pool->size;
+	block->data_need_freeing = 0;
+	block->refcount = 1;
+	block->pool = pool;
+	return block;
+}
+
+void sqfs_pool_put(sqfs_pool *pool, sqfs_block *block) {
+	MUTEX_LOCK(&pool->mutex);
+	if (pool->nfree < pool->max_free) {
+		block->data = pool->free_list;
+		pool->free_list = block;
+		++pool->nfree;
+		block = NULL;
+	}
+	MUTEX_UNLOCK(&pool->mutex);
+	free(block);
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2017 Minqi Pan <pmq2001@gmail.com>
+ *                    Shengyuan Liu <sounder.liu@gmail.com>
+ *
+ * This file is part of libsquash, distributed under the MIT License
+ * For full terms see the included LICENSE file
+ */
+
+#include "squash.h"
+#include "squash/hash.h"
+#include <stdio.h>
+
+/*
+ * The profile lists the files whose data was read, one path per line,
+ * in the order they were first opened or mapped. It is what
+ * sqfs_mkfs_options.order takes to lay those files out together.
+ * Readers check squash_profile_fp without a lock, so that nothing but
+ * a load is paid when no profile is being recorded.
+ */
+static FILE * volatile squash_profile_fp = NULL;
+static sqfs_hash squash_profile_seen;	/* inode numbers recorded */
+
+static void squash_profile_stop_inner()
+{
+	if (squash_profile_fp) {
+		fclose(squash_profile_fp);
+		squash_profile_fp = NULL;
+		sqfs_hash_destroy(&squash_profile_seen);
+	}
+}
+
+int squash_profile_start(const char *profile)
+{
+	FILE *fp;
+
+	MUTEX_LOCK(&squash_global_mutex);
+	squash_profile_stop_inner();
+	fp = fopen(profile, "w");
+	if (NULL == fp) {
+		MUTEX_UNLOCK(&squash_global_mutex);
+		return -1;
+	}
+	if (sqfs_hash_init(&squash_profile_seen, 1, 1024)) {
+		fclose(fp);
+		MUTEX_UNLOCK(&squash_global_mutex);
+		errno = ENOMEM;
+		return -1;
+	}
+	ATOMIC_RELEASE();
+	squash_profile_fp = fp;
+	MUTEX_UNLOCK(&squash_global_mutex);
+	return 0;
+}
+
+void squash_profile_stop()
+{
+	MUTEX_LOCK(&squash_global_mutex);
+	squash_profile_stop_inner();
+	MUTEX_UNLOCK(&squash_global_mutex);
+}
+
+void squash_profile_record(sqfs_inode *node, const char *path)
+{
+	char seen = 1;
+
+	if (NULL == squash_profile_fp || !S_ISREG(node->base.mode)) {
+		return;
+	}
+	MUTEX_LOCK(&squash_global_mutex);
+	if (squash_profile_fp &&
+			NULL == sqfs_hash_get(&squash_profile_seen, node->base.inode_number) &&
+			SQFS_OK == sqfs_hash_add(&squash_profile_seen, node->base.inode_number, &seen)) {
+		// flushed line by line, so that a process that never exits
+		// normally still leaves the profile of its startup behind
+		fprintf(squash_profile_fp, "%s\n", path);
+		fflush(squash_profile_fp);
+	}
+	MUTEX_UNLOCK(&squash_global_mutex);
+}
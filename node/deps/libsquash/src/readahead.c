@@ -0,0 +1,232 @@
+/*
+ * Copyright (c) 2017 Minqi Pan <pmq2001@gmail.com>
+ *                    Shengyuan Liu <sounder.liu@gmail.com>
+ *
+ * This file is part of libsquash, distributed under the MIT License
+ * For full terms see the included LICENSE file
+ */
+
+#include "squash.h"
+#include "squash/readahead.h"
+#include <stdlib.h>
+
+/*
+ * A single thread, started by the first request, decompresses the data
+ * blocks that sequential readers are about to ask for into the data cache.
+ * Requests wait in a ring, and are dropped when it is full, since a reader
+ * that got that far ahead of the thread gains nothing from more of them.
+ */
+#define SQUASH_READAHEAD_QUEUE 64
+
+struct squash_readahead_request {
+	sqfs *fs;
+	sqfs_inode inode;
+	size_t block;
+	size_t count;
+};
+
+static size_t squash_readahead_blocks = SQUASH_READAHEAD_DEFAULT;
+static long squash_readahead_env = -1;	/* SQUASH_READAHEAD, if set */
+
+static short squash_readahead_ready = 0;
+static MUTEX squash_readahead_mutex;
+static COND squash_readahead_cond;
+static THREAD squash_readahead_thread;
+static short squash_readahead_started = 0;
+static short squash_readahead_stopping = 0;
+/* guarded by squash_readahead_mutex */
+static struct squash_readahead_request squash_readahead_queue[SQUASH_READAHEAD_QUEUE];
+static size_t squash_readahead_head = 0;
+static size_t squash_readahead_count = 0;
+static sqfs *squash_readahead_busy = NULL;	/* the fs being read ahead */
+
+static volatile int64_t squash_readahead_requests;
+static volatile int64_t squash_readahead_dropped;
+static volatile int64_t squash_readahead_decompressed;
+static volatile int64_t squash_readahead_cached;
+
+void squash_set_readahead(size_t blocks)
+{
+	squash_readahead_blocks = blocks;
+}
+
+size_t squash_readahead_depth()
+{
+	size_t blocks = squash_readahead_env >= 0 ?
+		(size_t)squash_readahead_env : squash_readahead_blocks;
+	return blocks > SQUASH_READAHEAD_MAX ? SQUASH_READAHEAD_MAX : blocks;
+}
+
+void squash_readahead_stat(struct squash_readahead_stats *stats)
+{
+	stats->requests = ATOMIC_ADD64(&squash_readahead_requests, 0);
+	stats->dropped = ATOMIC_ADD64(&squash_readahead_dropped, 0);
+	stats->blocks = ATOMIC_ADD64(&squash_readahead_decompressed, 0);
+	stats->cached = ATOMIC_ADD64(&squash_readahead_cached, 0);
+}
+
+/* Whether the block at pos is in the data cache of fs, without taking it */
+static short squash_readahead_cached_block(sqfs *fs, sqfs_off_t pos)
+{
+	MUTEX *mutex = sqfs_cache_mutex(&fs->data_cache, pos);
+	short cached;
+
+	MUTEX_LOCK(mutex);
+	cached = NULL != sqfs_cache_get(&fs->data_cache, pos);
+	MUTEX_UNLOCK(mutex);
+	return cached;
+}
+
+static void squash_readahead_run(struct squash_readahead_request *request)
+{
+	sqfs *fs = request->fs;
+	size_t block_size = fs->sb->block_size;
+	uint64_t start = (uint64_t)request->block * block_size;
+	size_t done = 0;
+	sqfs_blocklist bl;
+
+	if (sqfs_blockidx_blocklist(fs, &request->inode, &bl, start)) {
+		return;
+	}
+	while (done < request->count && bl.remain) {
+		sqfs_block *block;
+		short compressed;
+		uint32_t size;
+
+		if (sqfs_blocklist_next(&bl)) {
+			return;
+		}
+		if (bl.pos < start) {
+			continue;
+		}
+		++done;
+		sqfs_data_header(bl.header, &compressed, &size);
+		// holes and stored blocks cost nothing to read
+		if (0 == size || !compressed) {
+			continue;
+		}
+		if (squash_readahead_cached_block(fs, bl.block)) {
+			ATOMIC_ADD64(&squash_readahead_cached, 1);
+			continue;
+		}
+		if (SQFS_OK != sqfs_data_cache(fs, &fs->data_cache, bl.block, bl.header, &block)) {
+			return;
+		}
+		sqfs_block_dispose(block);
+		ATOMIC_ADD64(&squash_readahead_decompressed, 1);
+	}
+}
+
+static THREAD_RETURN squash_readahead_worker(void *arg)
+{
+	struct squash_readahead_request request;
+
+	(void)arg;
+	MUTEX_LOCK(&squash_readahead_mutex);
+	for (;;) {
+		while (0 == squash_readahead_count && !squash_readahead_stopping) {
+			COND_WAIT(&squash_readahead_cond, &squash_readahead_mutex);
+		}
+		if (squash_readahead_stopping) {
+			break;
+		}
+		request = squash_readahead_queue[squash_readahead_head];
+		squash_readahead_head = (squash_readahead_head + 1) % SQUASH_READAHEAD_QUEUE;
+		--squash_readahead_count;
+		squash_readahead_busy = request.fs;
+		MUTEX_UNLOCK(&squash_readahead_mutex);
+
+		squash_readahead_run(&request);
+
+		MUTEX_LOCK(&squash_readahead_mutex);
+		squash_readahead_busy = NULL;
+	}
+	MUTEX_UNLOCK(&squash_readahead_mutex);
+	return 0;
+}
+
+void squash_readahead_init()
+{
+	const char *env = getenv("SQUASH_READAHEAD");
+
+	if (env && *env) {
+		char *end;
+		unsigned long value = strtoul(env, &end, 10);
+		if ('\0' == *end)
+			squash_readahead_env = (long)(value > SQUASH_READAHEAD_MAX ? SQUASH_READAHEAD_MAX : value);
+	}
+	MUTEX_INIT(&squash_readahead_mutex);
+	COND_INIT(&squash_readahead_cond);
+	squash_readahead_ready = 1;
+}
+
+void squash_readahead_halt()
+{
+	if (!squash_readahead_ready) {
+		return;
+	}
+	MUTEX_LOCK(&squash_readahead_mutex);
+	squash_readahead_stopping = 1;
+	COND_SIGNAL(&squash_readahead_cond);
+	MUTEX_UNLOCK(&squash_readahead_mutex);
+	if (squash_readahead_started) {
+		THREAD_JOIN(&squash_readahead_thread);
+		squash_readahead_started = 0;
+	}
+	squash_readahead_ready = 0;
+	COND_DESTROY(&squash_readahead_cond);
+	MUTEX_DESTORY(&squash_readahead_mutex);
+}
+
+void squash_readahead(sqfs *fs, sqfs_inode *inode, size_t block, size_t count)
+{
+	struct squash_readahead_request *request;
+
+	if (!squash_readahead_ready || 0 == count) {
+		return;
+	}
+	MUTEX_LOCK(&squash_readahead_mutex);
+	if (!squash_readahead_started && !squash_readahead_stopping) {
+		squash_readahead_started = !THREAD_CREATE(&squash_readahead_thread,
+			&squash_readahead_worker, NULL);
+	}
+	if (!squash_readahead_started || SQUASH_READAHEAD_QUEUE == squash_readahead_count) {
+		MUTEX_UNLOCK(&squash_readahead_mutex);
+		ATOMIC_ADD64(&squash_readahead_dropped, 1);
+		return;
+	}
+	request = &squash_readahead_queue[(squash_readahead_head + squash_readahead_count) % SQUASH_READAHEAD_QUEUE];
+	request->fs = fs;
+	request->inode = *inode;
+	request->block = block;
+	request->count = count;
+	++squash_readahead_count;
+	COND_SIGNAL(&squash_readahead_cond);
+	MUTEX_UNLOCK(&squash_readahead_mutex);
+	ATOMIC_ADD64(&squash_readahead_requests, 1);
+}
+
+void squash_readahead_cancel(sqfs *fs)
+{
+	size_t i, kept = 0;
+
+	if (!squash_readahead_ready) {
+		return;
+	}
+	MUTEX_LOCK(&squash_readahead_mutex);
+	for (i = 0; i < squash_readahead_count; ++i) {
+		struct squash_readahead_request *request =
+			&squash_readahead_queue[(squash_readahead_head + i) % SQUASH_READAHEAD_QUEUE];
+		if (request->fs != fs) {
+			squash_readahead_queue[(squash_readahead_head + kept++) % SQUASH_READAHEAD_QUEUE] = *request;
+		}
+	}
+	squash_readahead_count = kept;
+	// the thread is done with a request within a few blocks
+	while (fs == squash_readahead_busy) {
+		MUTEX_UNLOCK(&squash_readahead_mutex);
+		THREAD_YIELD();
+		MUTEX_LOCK(&squash_readahead_mutex);
+	}
+	MUTEX_UNLOCK(&squash_readahead_mutex);
+}
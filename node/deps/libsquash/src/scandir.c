@@ -17,9 +17,12 @@ int squash_scandir(sqfs *fs, const char *dirname, struct SQUASH_DIRENT ***nameli
 	int (*compar)(const struct SQUASH_DIRENT **, const struct SQUASH_DIRENT **))
 {
 	SQUASH_DIR * openeddir = 0;
-	size_t n = 0;
-	struct SQUASH_DIRENT **list = NULL;
-	struct SQUASH_DIRENT *ent = 0 ,*p = 0;
+	size_t n = 0, capacity = 64;
+	struct SQUASH_DIRENT **list = NULL, **grown;
+	struct SQUASH_DIRENT ent, *p = 0;
+	uint32_t buf[4096];	/* of records, aligned for their d_ino */
+	ssize_t filled;
+	int saved_errno;
 
 	if((dirname == NULL) || (namelist == NULL))
 		return -1;
@@ -28,25 +31,50 @@ int squash_scandir(sqfs *fs, const char *dirname, struct SQUASH_DIRENT ***nameli
 	if(openeddir == NULL)
 		return -1;
 
+	list = (struct SQUASH_DIRENT **)malloc(capacity*sizeof(struct SQUASH_DIRENT *));
+	if(list == NULL)
+		goto failure;
 
-	list = (struct SQUASH_DIRENT **)malloc(MAX_DIR_ENT*sizeof(struct SQUASH_DIRENT *));
-
-
-	while(( ent = squash_readdir(openeddir)) != NULL)
+	// the entries are read many at a time, straight out of the directory
+	while((filled = squash_getdents(openeddir, buf, sizeof(buf))) > 0)
 	{
-		if( select && !select(ent))
-			continue;
-
-		p = (struct SQUASH_DIRENT *)malloc(sizeof(struct SQUASH_DIRENT));
-
-		memcpy((void *)p,(void *)ent,sizeof(struct SQUASH_DIRENT));
-		list[n] = p;
-
-		n++;
-		if(n >= MAX_DIR_ENT)
-			break;
-
+		char *rec;
+
+		for(rec = (char *)buf; rec < (char *)buf + filled; rec += ((struct squash_dent *)rec)->d_reclen)
+		{
+			struct squash_dent *dent = (struct squash_dent *)rec;
+			size_t namelen = strlen(dent->d_name);
+
+			if(namelen >= sizeof(ent.d_name))
+				namelen = sizeof(ent.d_name) - 1;
+			memset(&ent, 0, sizeof(ent));
+			ent.d_ino = dent->d_ino;
+			ent.d_type = dent->d_type;
+			memcpy(ent.d_name, dent->d_name, namelen);
+#ifndef __linux__
+			ent.d_namlen = namelen;
+#endif
+			if( select && !select(&ent))
+				continue;
+
+			if(n >= capacity)
+			{
+				capacity *= 2;
+				grown = (struct SQUASH_DIRENT **)realloc((void *)list, capacity*sizeof(struct SQUASH_DIRENT *));
+				if(grown == NULL)
+					goto failure;
+				list = grown;
+			}
+			p = (struct SQUASH_DIRENT *)malloc(sizeof(struct SQUASH_DIRENT));
+			if(p == NULL)
+				goto failure;
+			memcpy((void *)p,(void *)&ent,sizeof(struct SQUASH_DIRENT));
+			list[n] = p;
+			n++;
+		}
 	}
+	if(filled < 0)
+		goto failure;
 
 	//close the squash_dir
 	squash_closedir(openeddir);
@@ -63,4 +91,12 @@ int squash_scandir(sqfs *fs, const char *dirname, struct SQUASH_DIRENT ***nameli
 
 	return n;
 
-}
\ No newline at end of file
+failure:
+	saved_errno = errno ? errno : ENOMEM;
+	while(n > 0)
+		free(list[--n]);
+	free(list);
+	squash_closedir(openeddir);
+	errno = saved_errno;
+	return -1;
+}
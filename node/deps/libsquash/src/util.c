@@ -68,7 +68,18 @@ sqfs_err sqfs_open_image(sqfs *fs, const uint8_t *image, size_t offset) {
 			break;
 		}
 		case SQFS_BADCOMP: {
-			fprintf(stderr, "Squashfs image uses ? compression");
+			char *name = sqfs_compression_name(sqfs_compression(fs));
+			sqfs_compression_type type;
+			short first = 1;
+			fprintf(stderr, "Squashfs image uses %s compression, this version "
+				"supports only", name ? name : "unknown");
+			for (type = SQFS_COMP_UNKNOWN + 1; type < SQFS_COMP_MAX; ++type) {
+				if (sqfs_decompressor_get(type)) {
+					fprintf(stderr, "%s %s", first ? "" : ",",
+						sqfs_compression_name(type));
+					first = 0;
+				}
+			}
 			fprintf(stderr, ".\n");
 			break;
 		}
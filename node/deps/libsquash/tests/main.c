@@ -12,9 +12,48 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <fcntl.h>
+#endif
 
 extern const uint8_t libsquash_fixture[];
 
+/* Generated from the fixture by nodec's lib/compiler/path_index.rb */
+static const char * const libsquash_fixture_index_paths[20] = {
+"/dir0/level3",
+"/dir1/@minqi/pan",
+"/dir1/.0.0.4@something4",
+"/dir1",
+"/bombing",
+"/dir1/@minqi/pan/node_modules/something",
+"/dir1/.bin",
+"/dir1/@minqi/pan/about",
+"/dir0/orifile",
+"/dir1/@minqi",
+"/dir0/sl1",
+"/dir0/level2",
+"/dir0/level1",
+"/dir0",
+"/dir0/sl2",
+"/dir0/sl3",
+"/",
+"/dir1/@minqi/pan/node_modules",
+"/dir1/something4",
+"/dir1/.0.0.4@something4/Egyptian",
+};
+static const uint8_t libsquash_fixture_index_types[20] = {
+2,1,1,1,0,2,1,0,0,1,2,2,2,1,2,2,1,1,2,0,
+};
+static const int32_t libsquash_fixture_index_displacements[20] = {
+0,1,0,-3,-5,3,-6,0,1,0,0,0,-7,0,1,1,-11,0,14,0,
+};
+static const sqfs_path_index libsquash_fixture_index = {
+  1484142037U, 1650ULL, 20,
+  libsquash_fixture_index_displacements, libsquash_fixture_index_paths, libsquash_fixture_index_types
+};
+
 static void expect(short condition, const char *reason)
 {
 	if (condition) {
@@ -361,6 +400,9 @@ static void test_dirent()
 	struct SQUASH_DIRENT **namelist;
 	int numEntries;
 	int i;
+	uint32_t dents[64];
+	struct squash_dent *dent;
+	ssize_t filled;
 
 	fprintf(stderr, "Testing dirent APIs\n");
 	fflush(stderr);
@@ -480,6 +522,36 @@ static void test_dirent()
 	}
 	free(namelist);
 
+	dir = squash_opendir(&fs, "/dir1");
+	filled = squash_getdents(dir, dents, sizeof(dents));
+	expect(filled > 0, "reads the entries in a batch");
+	dent = (struct squash_dent *)dents;
+	expect(0 == strcmp(".0.0.4@something4", dent->d_name) && DT_DIR == dent->d_type, "got .0.0.4@something4");
+	dent = (struct squash_dent *)((char *)dent + dent->d_reclen);
+	expect(0 == strcmp(".bin", dent->d_name) && DT_DIR == dent->d_type, "got .bin");
+	dent = (struct squash_dent *)((char *)dent + dent->d_reclen);
+	expect(0 == strcmp("@minqi", dent->d_name) && DT_DIR == dent->d_type, "got @minqi");
+	dent = (struct squash_dent *)((char *)dent + dent->d_reclen);
+	expect(0 == strcmp("something4", dent->d_name) && DT_LNK == dent->d_type, "got something4");
+	expect((char *)dent + dent->d_reclen == (char *)dents + filled, "got all of them");
+	expect(0 == squash_getdents(dir, dents, sizeof(dents)), "then reaches the end");
+	squash_closedir(dir);
+
+	dir = squash_opendir(&fs, "/dir1");
+	errno = 0;
+	expect(-1 == squash_getdents(dir, dents, 8) && EINVAL == errno, "needs room for an entry");
+	i = 0;
+	numEntries = 0;
+	while ((filled = squash_getdents(dir, dents, 32)) > 0) {
+		for (dent = (struct squash_dent *)dents; (char *)dent < (char *)dents + filled;
+				dent = (struct squash_dent *)((char *)dent + dent->d_reclen)) {
+			++numEntries;
+		}
+		++i;
+	}
+	expect(0 == filled && 4 == numEntries && i > 1, "reads on where a small buffer stopped");
+	squash_closedir(dir);
+
 	fprintf(stderr, "\n");
 	fflush(stderr);
 }
@@ -544,6 +616,1157 @@ static void test_open_read_with_links()
 	fflush(stderr);
 }
 
+static int test_cache_disposed;
+
+static void test_cache_dispose(void *data)
+{
+	(void)data;
+	++test_cache_disposed;
+}
+
+static void test_cache()
+{
+	sqfs fs;
+	sqfs_cache cache;
+	sqfs_cache_stats stats;
+	sqfs_cache_idx i;
+	int *entry;
+	int fd;
+	char buf[1024];
+
+	fprintf(stderr, "Testing the block cache\n");
+	fflush(stderr);
+
+	expect(SQFS_OK == sqfs_cache_init(&cache, sizeof(int), 4, &test_cache_dispose), "cache initialized");
+	expect(1 == cache.nshards, "small caches are not sharded");
+	for (i = 1; i <= 4; ++i) {
+		expect(NULL == sqfs_cache_get(&cache, i), "empty slot is a miss");
+		entry = sqfs_cache_add(&cache, i);
+		*entry = (int)i * 10;
+	}
+	entry = sqfs_cache_get(&cache, 1);
+	expect(entry && 10 == *entry, "cached entry is found");
+	entry = sqfs_cache_add(&cache, 5);
+	*entry = 50;
+	expect(1 == test_cache_disposed, "a full cache evicts one entry");
+	expect(NULL == sqfs_cache_get(&cache, 2), "the least recently used entry is evicted");
+	entry = sqfs_cache_get(&cache, 1);
+	expect(entry && 10 == *entry, "recently used entry survives");
+	entry = sqfs_cache_get(&cache, 5);
+	expect(entry && 50 == *entry, "new entry is found");
+	entry = sqfs_cache_add(&cache, 5);
+	expect(2 == test_cache_disposed, "re-adding an entry disposes of the old one");
+
+	sqfs_cache_stat(&cache, &stats);
+	expect(4 == stats.count && 4 == stats.used, "cache is full");
+	expect(3 == stats.hits, "hits are counted");
+	expect(6 == stats.misses, "misses are counted");
+	expect(1 == stats.evictions, "evictions are counted");
+	sqfs_cache_destroy(&cache);
+	expect(6 == test_cache_disposed, "destroy disposes of all entries");
+
+	expect(SQFS_OK == sqfs_cache_init(&cache, sizeof(int), 1024, &test_cache_dispose), "cache initialized");
+	expect(SQFS_CACHE_SHARDS == cache.nshards, "large caches are sharded");
+	sqfs_cache_destroy(&cache);
+
+	memset(&fs, 0, sizeof(sqfs));
+	sqfs_open_image(&fs, libsquash_fixture, 0);
+	for (i = 0; i < 2; ++i) {
+		fd = squash_open(&fs, "/dir1/something4/Egyptian");
+		expect(fd > 0, "successfully got a fd");
+		expect(551 == squash_read(fd, buf, sizeof(buf)), "we can read 551");
+		squash_close(fd);
+	}
+	sqfs_cache_stat(&fs.md_cache, &stats);
+	expect(stats.hits > 0, "metadata blocks are served from the cache");
+	sqfs_cache_stat(&fs.frag_cache, &stats);
+	expect(1 == stats.misses && 1 == stats.hits, "the fragment is inflated once");
+	expect(stats.bytes > 0, "the fragment is charged to the budget");
+	expect(fs.cache_budget.used > 0 && fs.cache_budget.used <= fs.cache_budget.limit, "the budget is kept");
+	sqfs_destroy(&fs);
+
+	fprintf(stderr, "\n");
+	fflush(stderr);
+}
+
+static void test_cache_budget()
+{
+	sqfs fs;
+	sqfs_cache_stats md, frag;
+	struct stat st;
+	int fd;
+	char buf[1024];
+
+	fprintf(stderr, "Testing the cache budget\n");
+	fflush(stderr);
+
+	squash_set_cache_mb(0);
+	memset(&fs, 0, sizeof(sqfs));
+	expect(SQFS_OK == sqfs_open_image(&fs, libsquash_fixture, 0), "sqfs_open_image should succeed");
+	expect(1024 * 1024 == fs.cache_budget.limit, "the budget is at least one megabyte");
+	expect(fs.frag_cache.count >= 3, "the fragment cache keeps its minimum size");
+	sqfs_destroy(&fs);
+
+	squash_set_cache_mb(SQFS_CACHE_MB_DEFAULT);
+	memset(&fs, 0, sizeof(sqfs));
+	sqfs_open_image(&fs, libsquash_fixture, 0);
+	expect(SQFS_CACHE_MB_DEFAULT * 1024 * 1024 == fs.cache_budget.limit, "the default budget");
+	expect(SQFS_CACHE_MB_DEFAULT * 1024 * 1024 / SQUASHFS_METADATA_SIZE <= fs.md_cache.count, "the metadata cache may take the whole budget");
+
+	/* squeeze the budget below what the fragment alone takes */
+	fs.cache_budget.limit = 1;
+	fd = squash_open(&fs, "/dir1/something4/Egyptian");
+	expect(fd > 0, "successfully got a fd");
+	expect(551 == squash_read(fd, buf, sizeof(buf)), "blocks evicted right away can still be read");
+	squash_close(fd);
+	expect(0 == squash_stat(&fs, "/bombing", &st), "stat still works");
+	sqfs_cache_stat(&fs.md_cache, &md);
+	sqfs_cache_stat(&fs.frag_cache, &frag);
+	expect(0 == md.used + frag.used, "everything above the budget is evicted");
+	expect(0 == fs.cache_budget.used, "the budget is given back");
+	sqfs_destroy(&fs);
+
+	fprintf(stderr, "\n");
+	fflush(stderr);
+}
+
+static void test_decompressors()
+{
+	static const char expected[] = "libsquash decompresses this sentence.\n"
+		"libsquash decompresses this sentence.\n"
+		"libsquash decompresses this sentence.\n"
+		"libsquash decompresses this sentence.\n";
+	static uint8_t zlib_sample[] = {
+		0x78, 0xda, 0xcb, 0xc9, 0x4c, 0x2a, 0x2e, 0x2c, 0x4d, 0x2c, 0xce, 0x50,
+		0x48, 0x49, 0x4d, 0xce, 0xcf, 0x2d, 0x28, 0x4a, 0x2d, 0x2e, 0x4e, 0x2d,
+		0x56, 0x28, 0xc9, 0xc8, 0x2c, 0x56, 0x28, 0x4e, 0xcd, 0x2b, 0x49, 0xcd,
+		0x4b, 0x4e, 0xd5, 0xe3, 0xca, 0xa1, 0xbb, 0x2a, 0x00, 0x84, 0x67, 0x39,
+		0xf9,
+	};
+	char out[1024];
+	size_t outsize;
+	sqfs_decompressor decompressor;
+
+	fprintf(stderr, "Testing decompressors\n");
+	fflush(stderr);
+
+	decompressor = sqfs_decompressor_get(ZLIB_COMPRESSION);
+	expect(NULL != decompressor, "zlib is always supported");
+	outsize = sizeof(out);
+	expect(SQFS_OK == decompressor(zlib_sample, sizeof(zlib_sample), out, &outsize), "zlib decompresses");
+	expect(sizeof(expected) - 1 == outsize && 0 == memcmp(expected, out, outsize), "zlib output matches");
+	outsize = 16;
+	expect(SQFS_OK != decompressor(zlib_sample, sizeof(zlib_sample), out, &outsize), "zlib respects the output size");
+	expect(0 == strcmp("zlib", sqfs_compression_name(ZLIB_COMPRESSION)), "zlib is named");
+	expect(0 == strcmp("zstd", sqfs_compression_name(ZSTD_COMPRESSION)), "zstd is named");
+	expect(NULL == sqfs_compression_name(SQFS_COMP_MAX), "unknown codecs are not named");
+	expect(NULL == sqfs_decompressor_get(SQFS_COMP_UNKNOWN), "unknown codecs are not supported");
+
+#ifdef SQFS_HAVE_XZ
+	{
+		static uint8_t xz_sample[] = {
+			0xfd, 0x37, 0x7a, 0x58, 0x5a, 0x00, 0x00, 0x01, 0x69, 0x22, 0xde, 0x36,
+			0x02, 0x00, 0x21, 0x01, 0x16, 0x00, 0x00, 0x00, 0x74, 0x2f, 0xe5, 0xa3,
+			0xe0, 0x00, 0x97, 0x00, 0x2a, 0x5d, 0x00, 0x36, 0x1a, 0x48, 0x6b, 0x68,
+			0xc5, 0x52, 0xfd, 0x44, 0x8c, 0x49, 0x3b, 0x76, 0x6d, 0x7a, 0xa0, 0x76,
+			0xd6, 0x36, 0xa6, 0x61, 0x95, 0xc3, 0x2c, 0x92, 0x98, 0xa4, 0x05, 0xe5,
+			0x12, 0xb4, 0xe5, 0x88, 0xe4, 0xdd, 0xd6, 0xf9, 0xf0, 0x9d, 0xa6, 0xe0,
+			0x00, 0x00, 0x00, 0x00, 0x72, 0x99, 0xad, 0xde, 0x00, 0x01, 0x42, 0x98,
+			0x01, 0x00, 0x00, 0x00, 0x0e, 0x74, 0x0f, 0xd8, 0x3e, 0x30, 0x0d, 0x8b,
+			0x02, 0x00, 0x00, 0x00, 0x00, 0x01, 0x59, 0x5a,
+		};
+		decompressor = sqfs_decompressor_get(XZ_COMPRESSION);
+		expect(NULL != decompressor, "xz is supported");
+		outsize = sizeof(out);
+		expect(SQFS_OK == decompressor(xz_sample, sizeof(xz_sample), out, &outsize), "xz decompresses");
+		expect(sizeof(expected) - 1 == outsize && 0 == memcmp(expected, out, outsize), "xz output matches");
+		outsize = sizeof(out);
+		expect(SQFS_OK != decompressor(xz_sample, sizeof(xz_sample) - 1, out, &outsize), "truncated xz is rejected");
+	}
+#endif
+
+	fprintf(stderr, "\n");
+	fflush(stderr);
+}
+
+static void test_pool()
+{
+	sqfs fs;
+	sqfs_pool pool;
+	sqfs_block *a, *b;
+	int fd, i;
+	char buf[1024];
+
+	fprintf(stderr, "Testing the block pool\n");
+	fflush(stderr);
+
+	expect(SQFS_OK == sqfs_pool_init(&pool, 16), "pool initialized");
+	a = sqfs_pool_get(&pool);
+	expect(a && 16 == a->size && a->data && 1 == a->refcount, "got a block with a buffer");
+	memset(a->data, 'x', 16);
+	sqfs_block_dispose(a);
+	expect(1 == pool.nfree, "the disposed block is kept");
+	b = sqfs_pool_get(&pool);
+	expect(a == b, "the block is reused");
+	expect(1 == pool.allocs && 1 == pool.reuses, "allocations and reuses are counted");
+	sqfs_block_dispose(b);
+	sqfs_pool_destroy(&pool);
+
+	memset(&fs, 0, sizeof(sqfs));
+	sqfs_open_image(&fs, libsquash_fixture, 0);
+	/* evict everything after use, so every read is a miss */
+	fs.cache_budget.limit = 1;
+	for (i = 0; i < 3; ++i) {
+		fd = squash_open(&fs, "/dir1/something4/Egyptian");
+		expect(fd > 0, "successfully got a fd");
+		expect(551 == squash_read(fd, buf, sizeof(buf)), "we can read 551");
+		squash_close(fd);
+	}
+	expect(fs.md_pool.reuses > 0, "metadata blocks are recycled");
+	expect(fs.data_pool.reuses > 0, "fragment blocks are recycled");
+	expect(fs.md_pool.allocs + fs.data_pool.allocs < 6, "few blocks are allocated");
+	sqfs_destroy(&fs);
+
+	fprintf(stderr, "\n");
+	fflush(stderr);
+}
+
+static void test_map()
+{
+	static uint8_t image[4096 + 2 * 8192];
+	sqfs fs;
+	sqfs_inode node;
+	sqfs_block *block;
+	struct squashfs_fragment_entry frag;
+	short found;
+	size_t frag_off, frag_size, size, i;
+	uint64_t frag_index;
+	uint16_t md_header;
+	const void *span;
+	sqfs_off_t span_size;
+	int fd;
+	char buf[1024];
+
+	fprintf(stderr, "Testing zero-copy mapping\n");
+	fflush(stderr);
+
+	memset(&fs, 0, sizeof(sqfs));
+	sqfs_open_image(&fs, libsquash_fixture, 0);
+	errno = 0;
+	expect(NULL == squash_map(&fs, "/dir1/something4/Egyptian", &size), "compressed files are not mapped");
+	expect(EINVAL == errno, "errno is EINVAL for compressed files");
+	errno = 0;
+	expect(NULL == squash_map(&fs, "/dir1", &size), "directories are not mapped");
+	expect(EISDIR == errno, "errno is EISDIR for directories");
+	errno = 0;
+	expect(NULL == squash_map(&fs, "/nonexistent", &size), "missing files are not mapped");
+	expect(ENOENT == errno, "errno is ENOENT for missing files");
+
+	/* rebuild the fixture with the fragment of Egyptian stored uncompressed */
+	fd = squash_open(&fs, "/dir1/something4/Egyptian");
+	expect(551 == squash_read(fd, buf, sizeof(buf)), "we can read 551");
+	squash_close(fd);
+	sqfs_inode_get(&fs, &node, sqfs_inode_root(&fs));
+	sqfs_lookup_path(&fs, &node, "/dir1/something4/Egyptian", &found);
+	expect(found, "Egyptian is found");
+	expect(SQFS_OK == sqfs_frag_block(&fs, &node, &frag_off, &frag_size, &block), "got the fragment block");
+	expect(fs.sb->fragments * sizeof(frag) <= SQUASHFS_METADATA_SIZE, "the fragment table fits one block");
+	memcpy(image, libsquash_fixture, 4096);
+	memcpy(image + 4096, block->data, block->size);
+	md_header = (uint16_t)(fs.sb->fragments * sizeof(frag)) | SQUASHFS_COMPRESSED_BIT;
+	memcpy(image + 4096 + 8192, &md_header, sizeof(md_header));
+	for (i = 0; i < fs.sb->fragments; ++i) {
+		sqfs_frag_entry(&fs, &frag, i);
+		if (i == node.xtra.reg.frag_idx) {
+			frag.start_block = 4096;
+			frag.size = block->size | SQUASHFS_COMPRESSED_BIT_BLOCK;
+		}
+		memcpy(image + 4096 + 8192 + sizeof(md_header) + i * sizeof(frag), &frag, sizeof(frag));
+	}
+	frag_index = 4096 + 8192;
+	memcpy(image + fs.sb->fragment_table_start, &frag_index, sizeof(frag_index));
+	sqfs_block_dispose(block);
+	sqfs_destroy(&fs);
+
+	memset(&fs, 0, sizeof(sqfs));
+	expect(SQFS_OK == sqfs_open_image(&fs, image, 0), "sqfs_open_image should succeed");
+	span = squash_map(&fs, "/dir1/something4/Egyptian", &size);
+	expect(image + 4096 + frag_off == span, "the span points into the image");
+	expect(551 == size && 0 == memcmp(buf, span, size), "the span holds the file");
+	sqfs_inode_get(&fs, &node, sqfs_inode_root(&fs));
+	sqfs_lookup_path(&fs, &node, "/dir1/something4/Egyptian", &found);
+	span_size = 1000;
+	expect(SQFS_OK == sqfs_read_span(&fs, &node, 500, &span_size, &span), "spans may start anywhere");
+	expect(51 == span_size && 0 == memcmp(buf + 500, span, 51), "spans end at the end of file");
+	fd = squash_open(&fs, "/dir1/something4/Egyptian");
+	expect(551 == squash_read(fd, buf, sizeof(buf)), "stored fragments can still be read");
+	squash_close(fd);
+	span = squash_map(&fs, "/bombing", &size);
+	expect(span && 998 == size, "files sharing the fragment are mapped as well");
+	sqfs_destroy(&fs);
+
+	fprintf(stderr, "\n");
+	fflush(stderr);
+}
+
+static void test_pread()
+{
+	sqfs fs;
+	int fd;
+	ssize_t ssize;
+	char whole[1024], buf[1024], a[10], b[1], c[1024];
+	struct SQUASH_IOVEC iov[4];
+
+	fprintf(stderr, "Testing positional and scatter reads\n");
+	fflush(stderr);
+
+	memset(&fs, 0, sizeof(sqfs));
+	sqfs_open_image(&fs, libsquash_fixture, 0);
+	fd = squash_open(&fs, "/bombing");
+	expect(fd > 0, "successfully got a fd");
+	expect(998 == squash_read(fd, whole, sizeof(whole)), "we can read 998");
+	expect(0 == squash_lseek(fd, 0, SQUASH_SEEK_SET), "rewound");
+
+	ssize = squash_pread(fd, buf, 100, 110);
+	expect(100 == ssize && 0 == memcmp(whole + 110, buf, 100), "pread reads at the offset");
+	expect(0 == squash_lseek(fd, 0, SQUASH_SEEK_CUR), "pread leaves the file pointer alone");
+	expect(48 == squash_pread(fd, buf, 100, 950), "pread stops at end-of-file");
+	expect(0 == squash_pread(fd, buf, 100, 998), "pread at end-of-file returns zero");
+	expect(0 == squash_pread(fd, buf, 100, 5000), "pread beyond end-of-file returns zero");
+	expect(-1 == squash_pread(fd, buf, 100, -1) && EINVAL == errno, "negative offsets are invalid");
+
+	iov[0].iov_base = a;
+	iov[0].iov_len = sizeof(a);
+	iov[1].iov_base = NULL;
+	iov[1].iov_len = 0;
+	iov[2].iov_base = b;
+	iov[2].iov_len = sizeof(b);
+	iov[3].iov_base = c;
+	iov[3].iov_len = sizeof(c);
+	ssize = squash_preadv(fd, iov, 4, 3);
+	expect(995 == ssize, "preadv fills the buffers up to end-of-file");
+	expect(0 == memcmp(whole + 3, a, 10) && whole[13] == b[0] && 0 == memcmp(whole + 14, c, 984), "preadv scatters in order");
+	expect(0 == squash_lseek(fd, 0, SQUASH_SEEK_CUR), "preadv leaves the file pointer alone");
+
+	ssize = squash_readv(fd, iov, 3);
+	expect(11 == ssize && 0 == memcmp(whole, a, 10) && whole[10] == b[0], "readv reads at the file pointer");
+	expect(11 == squash_lseek(fd, 0, SQUASH_SEEK_CUR), "readv advances the file pointer");
+	ssize = squash_readv(fd, iov, 4);
+	expect(987 == ssize && 0 == memcmp(whole + 22, c, 976), "readv continues where it left off");
+	expect(0 == squash_readv(fd, iov, 4), "readv at end-of-file returns zero");
+	squash_close(fd);
+
+	fd = squash_open(&fs, "/dir1");
+	expect(-1 == squash_pread(fd, buf, 100, 0) && EISDIR == errno, "directories cannot be pread");
+	squash_close(fd);
+	expect(-1 == squash_pread(fd, buf, 100, 0) && EBADF == errno, "closed fds cannot be pread");
+	sqfs_destroy(&fs);
+
+	fprintf(stderr, "\n");
+	fflush(stderr);
+}
+
+static void test_fdtable()
+{
+	sqfs fs;
+	int fds[200];
+	SQUASH_DIR *dirs[100];
+	int i, found;
+	char buf[16];
+
+	fprintf(stderr, "Testing the fd table\n");
+	fflush(stderr);
+
+	memset(&fs, 0, sizeof(sqfs));
+	sqfs_open_image(&fs, libsquash_fixture, 0);
+	for (i = 0; i < 200; ++i) {
+		fds[i] = squash_open(&fs, "/bombing");
+		expect(fds[i] > 0, "successfully got a fd");
+	}
+	for (i = 0; i < 100; ++i) {
+		dirs[i] = squash_opendir(&fs, "/dir1");
+		expect(NULL != dirs[i], "successfully got a dir");
+	}
+	found = 0;
+	for (i = 0; i < 200; ++i) {
+		found += (NULL != SQUASH_VFD_FILE(fds[i]) && fds[i] == SQUASH_VFD_FILE(fds[i])->fd);
+		found += (SQUASH_VFD_FILE(fds[i]) == squash_find_entry(SQUASH_VFD_FILE(fds[i])->payload));
+	}
+	expect(400 == found, "every fd survives the tables growing");
+	found = 0;
+	for (i = 0; i < 100; ++i) {
+		found += (NULL != squash_find_entry(dirs[i]));
+	}
+	expect(100 == found, "every dir is found by its pointer");
+	expect(NULL == squash_find_entry(buf), "foreign pointers are not ours");
+	expect(NULL == squash_find_entry(NULL), "NULL is not ours");
+	expect(!SQUASH_VALID_VFD(-1), "negative fds are not ours");
+
+	for (i = 0; i < 200; i += 2) {
+		expect(0 == squash_close(fds[i]), "closed a fd");
+	}
+	for (i = 0; i < 100; i += 2) {
+		expect(0 == squash_closedir(dirs[i]), "closed a dir");
+	}
+	found = 0;
+	for (i = 0; i < 200; ++i) {
+		found += SQUASH_VALID_VFD(fds[i]);
+	}
+	for (i = 0; i < 100; ++i) {
+		found += (NULL != squash_find_entry(dirs[i]));
+	}
+	expect(150 == found, "closed entries are gone, the others stay");
+	for (i = 1; i < 200; i += 2) {
+		expect(10 == squash_read(fds[i], buf, 10), "the rest can still be read");
+		squash_close(fds[i]);
+	}
+	for (i = 1; i < 100; i += 2) {
+		expect(NULL != squash_readdir(dirs[i]), "the rest can still be listed");
+		squash_closedir(dirs[i]);
+	}
+	errno = 0;
+	expect(NULL == squash_opendir(&fs, "/bombing"), "files are not dirs");
+	expect(-1 == squash_close(fds[199]) && EBADF == errno, "closing twice fails");
+	sqfs_destroy(&fs);
+
+	fprintf(stderr, "\n");
+	fflush(stderr);
+}
+
+static void test_lookup_cache()
+{
+	sqfs fs;
+	sqfs_cache_stats paths, names, after;
+	struct stat st, st_cached;
+	int fd;
+	char buf[1024];
+
+	fprintf(stderr, "Testing the lookup caches\n");
+	fflush(stderr);
+
+	memset(&fs, 0, sizeof(sqfs));
+	sqfs_open_image(&fs, libsquash_fixture, 0);
+	expect(0 == squash_stat(&fs, "/dir1/something4/Egyptian", &st), "stat through a link");
+	squash_lookup_stat(&fs, &paths, &names);
+	expect(0 == paths.hits && 0 < paths.misses, "the first lookup walks the path");
+	expect(0 < names.misses, "the first lookup reads the directories");
+
+	expect(0 == squash_stat(&fs, "/dir1/something4/Egyptian", &st_cached), "stat again");
+	expect(st.st_ino == st_cached.st_ino && 551 == st_cached.st_size, "the cached lookup finds the same file");
+	expect(0 == squash_stat(&fs, "/dir1/../dir1/something4/Egyptian", &st_cached), "stat an equivalent path");
+	expect(st.st_ino == st_cached.st_ino, "paths are cached once dot-dots are resolved");
+	squash_lookup_stat(&fs, &paths, NULL);
+	expect(2 == paths.hits, "repeated lookups skip the walk");
+
+	expect(0 == squash_lstat(&fs, "/dir1/something4", &st), "lstat a link");
+	expect(S_ISLNK(st.st_mode), "lstat is not confused with stat");
+	expect(0 == squash_stat(&fs, "/dir1/something4", &st), "stat a link");
+	expect(S_ISDIR(st.st_mode), "stat is not confused with lstat");
+
+	squash_lookup_stat(&fs, NULL, &names);
+	expect(0 == squash_stat(&fs, "/dir1/.bin", &st), "stat a sibling");
+	squash_lookup_stat(&fs, NULL, &after);
+	expect(names.hits + 1 == after.hits, "siblings share their parents");
+
+	errno = 0;
+	expect(-1 == squash_stat(&fs, "/dir1/nonexistent", &st) && ENOENT == errno, "a miss");
+	squash_lookup_stat(&fs, &paths, NULL);
+	errno = 0;
+	expect(-1 == squash_stat(&fs, "/dir1/nonexistent", &st) && ENOENT == errno, "a miss again");
+	squash_lookup_stat(&fs, &after, NULL);
+	expect(paths.hits + 1 == after.hits, "misses are cached too");
+
+	fd = squash_open(&fs, "/dir1/something4/Egyptian");
+	expect(fd > 0, "open a cached path");
+	expect(551 == squash_read(fd, buf, sizeof(buf)), "read a cached path");
+	squash_close(fd);
+	sqfs_destroy(&fs);
+
+	fprintf(stderr, "\n");
+	fflush(stderr);
+}
+
+static void test_path_index()
+{
+	sqfs fs;
+	sqfs_path_index other;
+	sqfs_cache_stats before, after;
+	struct stat st;
+	uint32_t i;
+
+	fprintf(stderr, "Testing the path index\n");
+	fflush(stderr);
+
+	memset(&fs, 0, sizeof(sqfs));
+	sqfs_open_image(&fs, libsquash_fixture, 0);
+	other = libsquash_fixture_index;
+	other.mkfs_time += 1;
+	expect(SQFS_BADFORMAT == sqfs_path_index_set(&fs, &other), "an index of another image is refused");
+	expect(NULL == fs.path_index, "and not used");
+	expect(SQFS_OK == sqfs_path_index_set(&fs, &libsquash_fixture_index), "the index of the image is taken");
+
+	for (i = 0; i < libsquash_fixture_index.count; ++i) {
+		expect(!sqfs_path_index_absent(&fs, libsquash_fixture_index.paths[i]), "every indexed path is found");
+	}
+	expect(sqfs_path_index_absent(&fs, "/nonexistent"), "a path that does not exist");
+	expect(sqfs_path_index_absent(&fs, "/dir1/nonexistent/deeper"), "below a path that does not exist");
+	expect(!sqfs_path_index_absent(&fs, "/bombing/deeper"), "below a file is up to the walk");
+	expect(!sqfs_path_index_absent(&fs, "/dir1/something4/Egyptian"), "through a link");
+	expect(!sqfs_path_index_absent(&fs, "/dir1/something4/nonexistent"), "the index cannot tell through a link");
+	expect(!sqfs_path_index_absent(&fs, "/dir1/./nonexistent"), "nor with dots");
+	expect(!sqfs_path_index_absent(&fs, "/nonexistent/"), "nor with a trailing slash");
+
+	squash_lookup_stat(&fs, &before, NULL);
+	errno = 0;
+	expect(-1 == squash_stat(&fs, "/dir1/nonexistent", &st) && ENOENT == errno, "stat a path that does not exist");
+	errno = 0;
+	expect(-1 == squash_stat(&fs, "/dir1/../nonexistent", &st) && ENOENT == errno, "stat with dot-dots");
+	squash_lookup_stat(&fs, &after, NULL);
+	expect(before.hits + before.misses == after.hits + after.misses, "the index answers without walking");
+	expect(0 == squash_stat(&fs, "/dir1/something4/Egyptian", &st) && 551 == st.st_size, "existing paths are still walked");
+	errno = 0;
+	expect(-1 == squash_stat(&fs, "/dir1/something4/nonexistent", &st) && ENOENT == errno, "and so are links");
+	sqfs_destroy(&fs);
+
+	fprintf(stderr, "\n");
+	fflush(stderr);
+}
+
+static void test_extract()
+{
+	sqfs fs;
+	struct squash_extract_stats before, after;
+	SQUASH_OS_PATH path;
+	SQUASH_OS_PATH path2;
+	#ifdef _WIN32
+		wchar_t *copy;
+	#else
+		char *copy;
+		struct stat st;
+	#endif
+	FILE *fp;
+	int fd;
+	char expected[1024], buf[1024];
+	size_t size;
+
+	fprintf(stderr, "Testing extraction\n");
+	fflush(stderr);
+
+	memset(&fs, 0, sizeof(sqfs));
+	sqfs_open_image(&fs, libsquash_fixture, 0);
+	fd = squash_open(&fs, "/bombing");
+	expect(998 == squash_read(fd, expected, sizeof(expected)), "read the original");
+	squash_close(fd);
+
+	squash_extract_stat(&before);
+	squash_set_extract_threads(4);
+	path = squash_extract(&fs, "/bombing", NULL);
+	expect(NULL != path, "extracts the file");
+	#ifdef _WIN32
+		fp = _wfopen(path, L"rb");
+	#else
+		fp = fopen(path, "rb");
+	#endif
+	expect(NULL != fp, "opens the extracted file");
+	size = fread(buf, 1, sizeof(buf), fp);
+	fclose(fp);
+	expect(998 == size && 0 == memcmp(expected, buf, size), "the extracted file is the original");
+	path2 = squash_extract(&fs, "/bombing", NULL);
+	expect(path == path2, "extracted once");
+	squash_extract_stat(&after);
+	expect(before.files + 1 == after.files && before.bytes + 998 == after.bytes, "counts the extracted bytes");
+	expect(before.hits + 1 == after.hits, "counts the cache hits");
+	expect(before.nanoseconds < after.nanoseconds, "times the extraction");
+	#ifdef __linux__
+		expect(0 == strncmp(path, "/proc/self/fd/", 14) && before.memfds + 1 == after.memfds, "extracts into memory");
+		fd = squash_extract_memfd(path);
+		expect(-1 != fd && (fcntl(fd, F_GETFD) & FD_CLOEXEC), "the memfd is close-on-exec");
+		expect(-1 == squash_extract_memfd("/proc/self/fd/0"), "other descriptors are not taken for memfds");
+		expect(-1 == squash_extract_memfd("/tmp"), "nor are other paths");
+	#endif
+
+	errno = 0;
+	expect(NULL == squash_extract(&fs, "/dir1", NULL) && EISDIR == errno, "directories are not extracted");
+	expect(NULL == squash_extract(&fs, "/nonexistent", NULL), "nor what does not exist");
+
+	/* path is freed along with the cache */
+	#ifdef _WIN32
+		copy = _wcsdup(path);
+		squash_extract_clear_cache();
+		expect(NULL == _wfopen(copy, L"rb"), "clearing the cache removes the files");
+	#else
+		copy = strdup(path);
+		squash_extract_clear_cache();
+		expect(NULL == fopen(copy, "rb"), "clearing the cache removes the files");
+	#endif
+	free(copy);
+	path = squash_extract(&fs, "/dir1/something4/Egyptian", "txt");
+	expect(NULL != path, "extracts again after clearing the cache");
+	#ifdef __linux__
+		squash_set_extract_memfd(0);
+		path = squash_extract(&fs, "/dir1/@minqi/pan/about", NULL);
+		expect(NULL != path && 0 != strncmp(path, "/proc/self/fd/", 14), "extracts into the temporary folder when told to");
+		squash_set_extract_memfd(1);
+	#endif
+	#ifndef _WIN32
+		squash_extract_clear_cache();
+		squash_set_extract_cache("squash_extract_cache");
+		squash_extract_stat(&before);
+		path = squash_extract(&fs, "/bombing", NULL);
+		expect(NULL != path && 0 == strncmp(path, "squash_extract_cache/", 21), "extracts into the persistent cache");
+		copy = strdup(path);
+		squash_extract_clear_cache();
+		fp = fopen(copy, "rb");
+		expect(NULL != fp, "the persistent cache is kept");
+		size = fread(buf, 1, sizeof(buf), fp);
+		fclose(fp);
+		expect(998 == size && 0 == memcmp(expected, buf, size), "the kept file is the original");
+		path = squash_extract(&fs, "/bombing", NULL);
+		expect(NULL != path && 0 == strcmp(copy, path), "finds the kept file");
+		squash_extract_stat(&after);
+		expect(before.files + 1 == after.files && before.reused + 1 == after.reused, "extracts the kept file once");
+		expect(0 == lstat(copy, &st) && S_IRWXU == (st.st_mode & 07777), "the kept file is private");
+		strcpy(buf, copy);
+		strcat(buf, ".lock");
+		expect(-1 == lstat(buf, &st) && ENOENT == errno, "leaves no lock behind");
+		squash_extract_clear_cache();
+		chmod(copy, 0755);
+		squash_extract_stat(&before);
+		path = squash_extract(&fs, "/bombing", NULL);
+		squash_extract_stat(&after);
+		expect(NULL != path && 0 == strcmp(copy, path) && before.files + 1 == after.files &&
+			before.reused == after.reused, "extracts again a kept file others may write");
+		expect(0 == lstat(copy, &st) && S_IRWXU == (st.st_mode & 07777), "in place of it");
+		squash_extract_clear_cache();
+		chmod("squash_extract_cache", 0755);
+		path = squash_extract(&fs, "/bombing", NULL);
+		expect(NULL != path && 0 != strncmp(path, "squash_extract_cache/", 21), "leaves out a cache others may write to");
+		squash_extract_clear_cache();
+		chmod("squash_extract_cache", 0700);
+		unlink("squash_extract_cache_link");
+		symlink("squash_extract_cache", "squash_extract_cache_link");
+		squash_set_extract_cache("squash_extract_cache_link");
+		path = squash_extract(&fs, "/bombing", NULL);
+		expect(NULL != path && 0 != strncmp(path, "squash_extract_cache", 20), "or a link to one");
+		squash_extract_clear_cache();
+		unlink("squash_extract_cache_link");
+		squash_set_extract_cache(NULL);
+		unlink(copy);
+		rmdir("squash_extract_cache");
+		free(copy);
+	#endif
+	squash_set_extract_threads(SQUASH_EXTRACT_THREADS_DEFAULT);
+	sqfs_destroy(&fs);
+
+	fprintf(stderr, "\n");
+	fflush(stderr);
+}
+
+static void test_mkfs_write(const char *path, const char *data, size_t size)
+{
+	FILE *fp = fopen(path, "wb");
+	expect(NULL != fp, "creates a source file");
+	expect(size == fwrite(data, 1, size, fp), "writes a source file");
+	fclose(fp);
+}
+
+static void test_mkfs_mkdir(const char *path)
+{
+	#ifdef _WIN32
+		_mkdir(path);
+	#else
+		mkdir(path, 0755);
+	#endif
+}
+
+static uint8_t *test_mkfs_load(const char *path, long *size)
+{
+	uint8_t *image;
+	FILE *fp = fopen(path, "rb");
+
+	expect(NULL != fp, "opens the image");
+	fseek(fp, 0, SEEK_END);
+	*size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	image = malloc(*size);
+	expect(*size == (long)fread(image, 1, *size, fp), "reads the image");
+	fclose(fp);
+	return image;
+}
+
+static void test_mkfs()
+{
+	static char big[3 * 4096 + 100];
+	static char got[sizeof(big)];
+	static const char * const uncompressed[] = { "bin", "tar.gz", NULL };
+	sqfs_mkfs_options options;
+	sqfs fs;
+	sqfs_inode node, node2;
+	short found;
+	struct stat st;
+	uint8_t *image;
+	long image_size;
+	char path[256];
+	int fd, i, entries;
+	size_t size;
+	const void *span;
+	SQUASH_DIR *dir;
+	struct SQUASH_DIRENT *entry;
+	sqfs_off_t pos;
+	sqfs_block *block;
+	uint64_t key, key2;
+	#ifndef _WIN32
+		const char *extracted;
+	#endif
+
+	fprintf(stderr, "Testing the image builder\n");
+	fflush(stderr);
+
+	for (i = 0; i < (int)sizeof(big); ++i) {
+		big[i] = (char)(i * 7 % 251);
+	}
+	test_mkfs_mkdir("squash_mkfs_source");
+	test_mkfs_mkdir("squash_mkfs_source/empty");
+	test_mkfs_mkdir("squash_mkfs_source/many");
+	test_mkfs_write("squash_mkfs_source/small", "tiny", 4);
+	test_mkfs_write("squash_mkfs_source/zero", "", 0);
+	test_mkfs_write("squash_mkfs_source/big", big, sizeof(big));
+	test_mkfs_write("squash_mkfs_source/big_copy", big, sizeof(big));
+	test_mkfs_write("squash_mkfs_source/raw.bin", big, sizeof(big));
+	test_mkfs_write("squash_mkfs_source/raw.tar.gz", "tiny", 4);
+	test_mkfs_write("squash_mkfs_source/raw.gz", big, sizeof(big));
+	for (i = 0; i < 300; ++i) {
+		sprintf(path, "squash_mkfs_source/many/%03d", i);
+		test_mkfs_write(path, path, strlen(path));
+	}
+	#ifndef _WIN32
+		unlink("squash_mkfs_source/link");
+		expect(0 == symlink("many/007", "squash_mkfs_source/link"), "creates a source link");
+	#endif
+
+	sqfs_mkfs_options_init(&options);
+	options.block_size = 4096;
+	options.threads = 3;
+	options.uncompressed = uncompressed;
+	expect(SQFS_ERR == sqfs_mkfs("squash_mkfs_nonexistent", "squash_mkfs.squashfs", &options), "the source must exist");
+	options.compression = LZMA_COMPRESSION;
+	expect(SQFS_BADCOMP == sqfs_mkfs("squash_mkfs_source", "squash_mkfs.squashfs", &options), "lzma images are not written");
+	options.compression = ZLIB_COMPRESSION;
+	expect(SQFS_OK == sqfs_mkfs("squash_mkfs_source", "squash_mkfs.squashfs", &options), "builds the image");
+
+	image = test_mkfs_load("squash_mkfs.squashfs", &image_size);
+	expect(0 == image_size % 4096, "the image is padded");
+
+	memset(&fs, 0, sizeof(sqfs));
+	expect(SQFS_OK == sqfs_open_image(&fs, image, 0), "libsquash opens what it built");
+	expect(4096 == fs.sb->block_size, "takes the block size");
+
+	expect(0 == squash_stat(&fs, "/small", &st) && 4 == st.st_size, "stats a file");
+	fd = squash_open(&fs, "/small");
+	expect(4 == squash_read(fd, got, sizeof(got)) && 0 == memcmp("tiny", got, 4), "reads a fragment");
+	squash_close(fd);
+	expect(0 == squash_stat(&fs, "/zero", &st) && 0 == st.st_size, "stats an empty file");
+	fd = squash_open(&fs, "/big");
+	expect(sizeof(big) == squash_read(fd, got, sizeof(got)) && 0 == memcmp(big, got, sizeof(big)), "reads blocks and a fragment");
+	squash_close(fd);
+	fd = squash_open(&fs, "/big_copy");
+	expect(sizeof(big) == squash_read(fd, got, sizeof(got)) && 0 == memcmp(big, got, sizeof(big)), "reads a duplicate");
+	squash_close(fd);
+
+	sqfs_inode_get(&fs, &node, sqfs_inode_root(&fs));
+	sqfs_lookup_path(&fs, &node, "/big", &found);
+	sqfs_inode_get(&fs, &node2, sqfs_inode_root(&fs));
+	sqfs_lookup_path(&fs, &node2, "/big_copy", &found);
+	expect(node.xtra.reg.start_block == node2.xtra.reg.start_block &&
+		node.xtra.reg.frag_idx == node2.xtra.reg.frag_idx &&
+		node.xtra.reg.frag_off == node2.xtra.reg.frag_off, "duplicates share their data");
+	expect(SQUASHFS_INVALID_FRAG != node.xtra.reg.frag_idx, "the tail is a fragment");
+	size = sizeof(key);
+	expect(SQFS_UNSUP == sqfs_xattr_get(&fs, &node, SQUASHFS_XATTR_USER, SQFS_XATTR_HASH, &key, &size), "there are no hashes unless asked for");
+
+	span = squash_map(&fs, "/raw.bin", &size);
+	expect(NULL != span && sizeof(big) == size && 0 == memcmp(big, span, size), "files of the given extensions are mapped");
+	expect(NULL == squash_map(&fs, "/big", &size), "others are compressed");
+	span = squash_map(&fs, "/raw.tar.gz", &size);
+	expect(NULL != span && 4 == size && 0 == memcmp("tiny", span, size), "extensions may have dots");
+	expect(NULL == squash_map(&fs, "/raw.gz", &size), "extensions match as a whole");
+
+	dir = squash_opendir(&fs, "/many");
+	expect(NULL != dir, "opens a large directory");
+	entries = 0;
+	while ((entry = squash_readdir(dir))) {
+		if ('.' != entry->d_name[0]) {
+			sprintf(path, "%03d", entries);
+			expect(0 == strcmp(path, entry->d_name), "entries are sorted");
+			++entries;
+		}
+	}
+	squash_closedir(dir);
+	expect(300 == entries, "lists every entry past a directory header");
+	fd = squash_open(&fs, "/many/299");
+	expect(strlen("squash_mkfs_source/many/299") == squash_read(fd, got, sizeof(got)) &&
+		0 == memcmp("squash_mkfs_source/many/299", got, strlen("squash_mkfs_source/many/299")), "reads the last entry");
+	squash_close(fd);
+	dir = squash_opendir(&fs, "/empty");
+	expect(NULL != dir, "opens an empty directory");
+	while ((entry = squash_readdir(dir))) {
+		expect('.' == entry->d_name[0], "the empty directory is empty");
+	}
+	squash_closedir(dir);
+	#ifndef _WIN32
+		expect(8 == squash_readlink(&fs, "/link", path, sizeof(path)) && 0 == memcmp("many/007", path, 8), "keeps links");
+		expect(0 == squash_stat(&fs, "/link", &st) && S_ISREG(st.st_mode), "follows links");
+	#endif
+	expect(-1 == squash_stat(&fs, "/nonexistent", &st), "nothing else is there");
+	sqfs_destroy(&fs);
+	free(image);
+
+	options.uncompressed_metadata = 1;
+	expect(SQFS_OK == sqfs_mkfs("squash_mkfs_source", "squash_mkfs.squashfs", &options), "builds the image with its metadata stored");
+	image = test_mkfs_load("squash_mkfs.squashfs", &image_size);
+	memset(&fs, 0, sizeof(sqfs));
+	expect(SQFS_OK == sqfs_open_image(&fs, image, 0), "opens it");
+	expect((fs.sb->flags & (1 << SQUASHFS_NOI)) && (fs.sb->flags & (1 << SQUASHFS_NOD)), "flags it");
+	pos = fs.sb->inode_table_start;
+	expect(SQFS_OK == sqfs_md_cache(&fs, &pos, &block) &&
+		block->data == image + fs.sb->inode_table_start + 2, "inodes are read without a copy");
+	sqfs_block_dispose(block);
+	pos = fs.sb->directory_table_start;
+	expect(SQFS_OK == sqfs_md_cache(&fs, &pos, &block) &&
+		block->data == image + fs.sb->directory_table_start + 2, "so are directories");
+	sqfs_block_dispose(block);
+	expect(0 == squash_stat(&fs, "/many/299", &st) && strlen("squash_mkfs_source/many/299") == st.st_size, "looks up a path");
+	fd = squash_open(&fs, "/big");
+	expect(sizeof(big) == squash_read(fd, got, sizeof(got)) && 0 == memcmp(big, got, sizeof(big)), "data is compressed still");
+	squash_close(fd);
+	sqfs_destroy(&fs);
+	free(image);
+
+	options.uncompressed_metadata = 0;
+	options.content_hashes = 1;
+	expect(SQFS_OK == sqfs_mkfs("squash_mkfs_source", "squash_mkfs_hashes.squashfs", &options), "builds the image with content hashes");
+	image = test_mkfs_load("squash_mkfs_hashes.squashfs", &image_size);
+	memset(&fs, 0, sizeof(sqfs));
+	expect(SQFS_OK == sqfs_open_image(&fs, image, 0), "opens it");
+	sqfs_inode_get(&fs, &node, sqfs_inode_root(&fs));
+	sqfs_lookup_path(&fs, &node, "/small", &found);
+	size = sizeof(key);
+	expect(SQFS_OK == sqfs_xattr_get(&fs, &node, SQUASHFS_XATTR_USER, SQFS_XATTR_HASH, &key, &size) && sizeof(key) == size, "records the hash of a file");
+	key2 = 14695981039346656037ULL;
+	for (i = 0; i < 4; ++i) {
+		key2 = (key2 ^ (uint8_t)"tiny"[i]) * 1099511628211ULL;
+	}
+	expect(key == key2, "the FNV-1a hash of its content");
+	size = sizeof(key);
+	expect(SQFS_UNSUP == sqfs_xattr_get(&fs, &node, SQUASHFS_XATTR_TRUSTED, SQFS_XATTR_HASH, &key, &size), "the prefix is part of the name");
+	size = sizeof(key);
+	expect(SQFS_UNSUP == sqfs_xattr_get(&fs, &node, SQUASHFS_XATTR_USER, "squash.has", &key, &size), "so is every character");
+	sqfs_inode_get(&fs, &node, sqfs_inode_root(&fs));
+	sqfs_lookup_path(&fs, &node, "/big", &found);
+	sqfs_inode_get(&fs, &node2, sqfs_inode_root(&fs));
+	sqfs_lookup_path(&fs, &node2, "/big_copy", &found);
+	size = sizeof(key);
+	sqfs_xattr_get(&fs, &node, SQUASHFS_XATTR_USER, SQFS_XATTR_HASH, &key, &size);
+	size = sizeof(key2);
+	expect(SQFS_OK == sqfs_xattr_get(&fs, &node2, SQUASHFS_XATTR_USER, SQFS_XATTR_HASH, &key2, &size) && key == key2, "duplicates share it");
+	fd = squash_open(&fs, "/big");
+	expect(sizeof(big) == squash_read(fd, got, sizeof(got)) && 0 == memcmp(big, got, sizeof(big)), "reads a file with an xattr");
+	squash_close(fd);
+	#ifndef _WIN32
+		squash_set_extract_cache("squash_mkfs_cache");
+		sprintf(path, "squash_mkfs_cache/%016llx-%llu", (unsigned long long)key, (unsigned long long)sizeof(big));
+		extracted = squash_extract(&fs, "/big", NULL);
+		expect(NULL != extracted && 0 == strcmp(path, extracted), "the persistent cache is named after it");
+		squash_extract_clear_cache();
+		squash_set_extract_cache(NULL);
+		unlink(path);
+		rmdir("squash_mkfs_cache");
+	#endif
+	sqfs_destroy(&fs);
+	free(image);
+	unlink("squash_mkfs_hashes.squashfs");
+
+	fprintf(stderr, "\n");
+	fflush(stderr);
+}
+
+/* after test_mkfs(), of which it takes the image */
+static void test_readfile()
+{
+	static char big[3 * 4096 + 100];
+	static char got[sizeof(big)];
+	sqfs fs;
+	sqfs_inode node;
+	short found;
+	uint8_t *image;
+	long image_size;
+	size_t size;
+	char *data;
+	int fd, i;
+
+	fprintf(stderr, "Testing whole-file reads\n");
+	fflush(stderr);
+
+	for (i = 0; i < (int)sizeof(big); ++i) {
+		big[i] = (char)(i * 7 % 251);
+	}
+	image = test_mkfs_load("squash_mkfs.squashfs", &image_size);
+	memset(&fs, 0, sizeof(sqfs));
+	expect(SQFS_OK == sqfs_open_image(&fs, image, 0), "opens the image");
+
+	data = squash_readfile(&fs, "/big", &size);
+	expect(NULL != data && sizeof(big) == size && 0 == memcmp(big, data, size), "reads blocks and a fragment");
+	free(data);
+	sqfs_inode_get(&fs, &node, sqfs_inode_root(&fs));
+	sqfs_lookup_path(&fs, &node, "/big", &found);
+	expect(NULL == sqfs_cache_get(&fs.data_cache, node.xtra.reg.start_block), "whole blocks bypass the cache");
+
+	fd = squash_open(&fs, "/big_copy");
+	expect(100 == squash_pread(fd, got, 100, 4096 + 50), "reads a block partially");
+	squash_close(fd);
+	data = squash_readfile(&fs, "/big_copy", &size);
+	expect(NULL != data && sizeof(big) == size && 0 == memcmp(big, data, size), "takes the blocks that are cached");
+	free(data);
+
+	data = squash_readfile(&fs, "/raw.bin", &size);
+	expect(NULL != data && sizeof(big) == size && 0 == memcmp(big, data, size), "reads stored blocks");
+	free(data);
+	data = squash_readfile(&fs, "/zero", &size);
+	expect(NULL != data && 0 == size, "reads an empty file");
+	free(data);
+	errno = 0;
+	expect(NULL == squash_readfile(&fs, "/many", &size) && EISDIR == errno, "directories are not read");
+	errno = 0;
+	expect(NULL == squash_readfile(&fs, "/nonexistent", &size) && ENOENT == errno, "neither are missing files");
+	sqfs_destroy(&fs);
+	free(image);
+
+	fprintf(stderr, "\n");
+	fflush(stderr);
+}
+
+/* after test_mkfs(), of which it takes the source */
+static void test_scandir_many()
+{
+	struct SQUASH_DIRENT **namelist;
+	sqfs_mkfs_options options;
+	char name[64];
+	sqfs fs;
+	uint8_t *image;
+	long image_size;
+	int i, n;
+
+	fprintf(stderr, "Testing scandir on a large directory\n");
+	fflush(stderr);
+
+	test_mkfs_mkdir("squash_scandir_source");
+	for (i = 0; i < 1500; ++i) {
+		sprintf(name, "squash_scandir_source/%04d", i);
+		fclose(fopen(name, "wb"));
+	}
+	sqfs_mkfs_options_init(&options);
+	expect(SQFS_OK == sqfs_mkfs("squash_scandir_source", "squash_scandir.squashfs", &options), "builds the image");
+	image = test_mkfs_load("squash_scandir.squashfs", &image_size);
+	memset(&fs, 0, sizeof(sqfs));
+	expect(SQFS_OK == sqfs_open_image(&fs, image, 0), "opens the image");
+	n = squash_scandir(&fs, "/", &namelist, NULL, NULL);
+	expect(1500 == n, "lists every entry");
+	expect(0 == strcmp("0000", namelist[0]->d_name) && 0 == strcmp("1499", namelist[1499]->d_name), "in order");
+	for (i = 0; i < n; ++i) {
+		free(namelist[i]);
+	}
+	free(namelist);
+	sqfs_destroy(&fs);
+	free(image);
+
+	fprintf(stderr, "\n");
+	fflush(stderr);
+}
+
+static void test_profile()
+{
+	static const char * const order[] = { "/small", "/many/./299", "/nonexistent/x", "/big", "/small", NULL };
+	static const char * const uncompressed[] = { "bin", NULL };
+	sqfs_mkfs_options options;
+	sqfs fs;
+	sqfs_inode small, last, big, later;
+	short found;
+	uint8_t *image;
+	long image_size;
+	struct stat st;
+	char got[64];
+	FILE *fp;
+	size_t size;
+	int fd;
+
+	fprintf(stderr, "Testing access profiles\n");
+	fflush(stderr);
+
+	sqfs_mkfs_options_init(&options);
+	options.block_size = 4096;
+	options.order = order;
+	options.uncompressed = uncompressed;
+	expect(SQFS_OK == sqfs_mkfs("squash_mkfs_source", "squash_profile.squashfs", &options), "builds the image in the order given");
+	image = test_mkfs_load("squash_profile.squashfs", &image_size);
+	memset(&fs, 0, sizeof(sqfs));
+	expect(SQFS_OK == sqfs_open_image(&fs, image, 0), "opens the image");
+
+	sqfs_inode_get(&fs, &small, sqfs_inode_root(&fs));
+	sqfs_lookup_path(&fs, &small, "/small", &found);
+	sqfs_inode_get(&fs, &last, sqfs_inode_root(&fs));
+	sqfs_lookup_path(&fs, &last, "/many/299", &found);
+	sqfs_inode_get(&fs, &big, sqfs_inode_root(&fs));
+	sqfs_lookup_path(&fs, &big, "/big", &found);
+	sqfs_inode_get(&fs, &later, sqfs_inode_root(&fs));
+	sqfs_lookup_path(&fs, &later, "/many/000", &found);
+	expect(0 == small.xtra.reg.frag_idx && 0 == small.xtra.reg.frag_off, "the first file comes first");
+	expect(0 == last.xtra.reg.frag_idx && 4 == last.xtra.reg.frag_off, "tails share a fragment in order");
+	expect(96 == big.xtra.reg.start_block, "blocks come first");
+	expect(0 == big.xtra.reg.frag_idx && 4 + strlen("squash_mkfs_source/many/299") == big.xtra.reg.frag_off, "and their tails follow");
+	expect(big.xtra.reg.frag_off < later.xtra.reg.frag_off, "the rest comes after");
+
+	expect(0 == squash_profile_start("squash_profile.txt"), "starts a profile");
+	fd = squash_open(&fs, "/big");
+	squash_close(fd);
+	fd = squash_open(&fs, "/big");
+	squash_close(fd);
+	expect(0 == squash_stat(&fs, "/small", &st), "stats a file");
+	expect(NULL != squash_map(&fs, "/raw.bin", &size), "maps a file");
+	fd = squash_open(&fs, "/many");
+	squash_close(fd);
+	fd = squash_open(&fs, "/big_copy");
+	squash_close(fd);
+	squash_profile_stop();
+	fd = squash_open(&fs, "/small");
+	squash_close(fd);
+
+	fp = fopen("squash_profile.txt", "rb");
+	expect(NULL != fp, "writes the profile");
+	size = fread(got, 1, sizeof(got), fp);
+	fclose(fp);
+	expect(size == strlen("/big\n/raw.bin\n/big_copy\n") &&
+		0 == memcmp("/big\n/raw.bin\n/big_copy\n", got, size), "records files read once, in order");
+
+	sqfs_destroy(&fs);
+	free(image);
+
+	fprintf(stderr, "\n");
+	fflush(stderr);
+}
+
+static void test_readahead_wait(struct squash_readahead_stats *stats, uint64_t blocks)
+{
+	long i;
+
+	for (i = 0; i < 100000000; ++i) {
+		squash_readahead_stat(stats);
+		if (stats->blocks + stats->cached >= blocks)
+			return;
+		THREAD_YIELD();
+	}
+}
+
+static void test_readahead()
+{
+	static char data[20 * 4096];
+	char got[1000];
+	sqfs_mkfs_options options;
+	sqfs fs;
+	uint8_t *image;
+	long image_size;
+	struct squash_readahead_stats before, after;
+	sqfs_cache_stats cache;
+	sqfs_off_t pos;
+	ssize_t n;
+	int fd, i;
+
+	fprintf(stderr, "Testing readahead\n");
+	fflush(stderr);
+
+	for (i = 0; i < (int)sizeof(data); ++i) {
+		data[i] = (char)(i / 7 % 13);
+	}
+	test_mkfs_mkdir("squash_readahead_source");
+	test_mkfs_write("squash_readahead_source/data", data, sizeof(data));
+	sqfs_mkfs_options_init(&options);
+	options.block_size = 4096;
+	expect(SQFS_OK == sqfs_mkfs("squash_readahead_source", "squash_readahead.squashfs", &options), "builds the image");
+	image = test_mkfs_load("squash_readahead.squashfs", &image_size);
+	memset(&fs, 0, sizeof(sqfs));
+	expect(SQFS_OK == sqfs_open_image(&fs, image, 0), "opens the image");
+
+	squash_set_readahead(4);
+	expect(4 == squash_readahead_depth(), "takes the depth");
+	squash_readahead_stat(&before);
+	fd = squash_open(&fs, "/data");
+	expect(100 == squash_read(fd, got, 100) && 0 == memcmp(data, got, 100), "reads the start");
+	test_readahead_wait(&after, before.blocks + before.cached + 4);
+	expect(after.requests == before.requests + 1, "a sequential read is followed by a request");
+	expect(after.blocks == before.blocks + 4, "which decompresses the next blocks");
+	sqfs_cache_stat(&fs.data_cache, &cache);
+	expect(5 == cache.used, "into the data cache");
+
+	squash_readahead_stat(&before);
+	expect(100 == squash_pread(fd, got, 100, 100) && 0 == memcmp(data + 100, got, 100), "reads on");
+	squash_readahead_stat(&after);
+	expect(after.requests == before.requests, "nothing more is needed within the window");
+	expect(100 == squash_pread(fd, got, 100, 10 * 4096) && 0 == memcmp(data + 10 * 4096, got, 100), "jumps ahead");
+	squash_readahead_stat(&after);
+	expect(after.requests == before.requests, "random reads are not read ahead");
+
+	squash_lseek(fd, 0, SQUASH_SEEK_SET);
+	for (pos = 0; pos < (sqfs_off_t)sizeof(data); pos += n) {
+		n = squash_read(fd, got, sizeof(got));
+		expect(n > 0 && 0 == memcmp(data + pos, got, n), "reads everything in order");
+	}
+	squash_close(fd);
+
+	squash_set_readahead(0);
+	squash_readahead_stat(&before);
+	fd = squash_open(&fs, "/data");
+	expect(100 == squash_read(fd, got, 100), "reads with readahead off");
+	squash_readahead_stat(&after);
+	expect(after.requests == before.requests, "nothing is read ahead");
+	squash_close(fd);
+	squash_set_readahead(SQUASH_READAHEAD_DEFAULT);
+
+	fd = squash_open(&fs, "/data");
+	expect(100 == squash_read(fd, got, 100), "reads once more");
+	squash_close(fd);
+	sqfs_destroy(&fs);
+	free(image);
+
+	fprintf(stderr, "\n");
+	fflush(stderr);
+}
+
+static void test_overlay()
+{
+	fprintf(stderr, "Testing the overlay index\n");
+	fflush(stderr);
+
+	expect(0 == squash_overlay_lookup("/node_modules/a.js"), "nothing was written yet");
+	expect(0 == squash_overlay_add("/node_modules", 0), "adds an embedded directory");
+	expect(0 == squash_overlay_add("/node_modules/tmp/", 1), "adds a new directory");
+	expect(0 == squash_overlay_add("/node_modules/a.log", 0), "adds a new file");
+
+	expect(squash_overlay_lookup("/node_modules"), "finds the embedded directory");
+	expect(squash_overlay_lookup("/node_modules/a.log"), "finds the file");
+	expect(squash_overlay_lookup("//node_modules//tmp"), "ignores repeated slashes");
+	expect(squash_overlay_lookup("/node_modules/tmp/x/y.js"), "finds what is below the new directory");
+	expect(squash_overlay_lookup("/node_modules/b/../a.log"), "cannot tell dots apart");
+	expect(0 == squash_overlay_lookup("/node_modules/a.js"), "skips an embedded file");
+	expect(0 == squash_overlay_lookup("/node_modules/a.log/x"), "skips what is below a file");
+	expect(0 == squash_overlay_lookup("/node_modules/tm"), "skips a prefix of a name");
+	expect(0 == squash_overlay_lookup("/"), "skips the root");
+
+	squash_overlay_clear();
+	expect(0 == squash_overlay_lookup("/node_modules/a.log"), "forgets everything when cleared");
+
+	fprintf(stderr, "\n");
+	fflush(stderr);
+}
+
 int main(int argc, char const *argv[])
 {
 	squash_start();
@@ -554,6 +1777,22 @@ int main(int argc, char const *argv[])
 	test_dirent();
 	test_squash_readlink();
 	test_open_read_with_links();
+	test_cache();
+	test_cache_budget();
+	test_decompressors();
+	test_pool();
+	test_map();
+	test_pread();
+	test_fdtable();
+	test_lookup_cache();
+	test_path_index();
+	test_extract();
+	test_mkfs();
+	test_readfile();
+	test_scandir_many();
+	test_profile();
+	test_readahead();
+	test_overlay();
 
 	return 0;
 }
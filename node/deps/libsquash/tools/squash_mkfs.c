@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2017 Minqi Pan <pmq2001@gmail.com>
+ *                    Shengyuan Liu <sounder.liu@gmail.com>
+ *
+ * This file is part of libsquash, distributed under the MIT License
+ * For full terms see the included LICENSE file
+ */
+
+/* Builds a squashfs image, taking the options of mksquashfs it shares:
+ *   squash_mkfs SOURCE IMAGE [-comp CODEC] [-b BLOCK_SIZE]
+ *     [-processors N] [-uncompressed EXT,EXT,...] [-profile FILE]
+ *     [-uncompressed-metadata] [-content-hashes]
+ * where FILE is recorded by running with SQUASH_PROFILE=FILE, and lists
+ * the files to lay out first
+ */
+
+#include "squash.h"
+#include "squash/mkfs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+static size_t squash_mkfs_processors() {
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors;
+#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (size_t)n : 1;
+#endif
+}
+
+static int usage() {
+	fprintf(stderr, "Usage: squash_mkfs SOURCE IMAGE [-comp CODEC] [-b BLOCK_SIZE] [-processors N] [-uncompressed EXT,EXT,...] [-profile FILE] [-uncompressed-metadata] [-content-hashes]\n");
+	return 2;
+}
+
+/* Splits "a,b,c" in place into a NULL-terminated list */
+static const char **squash_mkfs_split(char *list) {
+	size_t n = 2;
+	const char **ret;
+	char *p;
+
+	for (p = list; *p; ++p) {
+		if (',' == *p)
+			++n;
+	}
+	if (!(ret = calloc(n, sizeof(char *))))
+		return NULL;
+	n = 0;
+	for (p = strtok(list, ","); p; p = strtok(NULL, ","))
+		ret[n++] = p;
+	return ret;
+}
+
+/* Reads the lines of a profile into a NULL-terminated list, the
+ * content of which is kept in *content */
+static const char **squash_mkfs_profile(const char *path, char **content) {
+	FILE *fp = fopen(path, "rb");
+	const char **ret = NULL;
+	size_t size = 0, capacity = 4096, n = 2;
+	char *p;
+
+	if (!fp)
+		return NULL;
+	*content = malloc(capacity + 1);
+	while (*content) {
+		size += fread(*content + size, 1, capacity - size, fp);
+		if (size < capacity)
+			break;
+		capacity *= 2;
+		if (!(p = realloc(*content, capacity + 1))) {
+			free(*content);
+			*content = NULL;
+		} else {
+			*content = p;
+		}
+	}
+	fclose(fp);
+	if (!*content)
+		return NULL;
+	(*content)[size] = '\0';
+
+	for (p = *content; *p; ++p) {
+		if ('\n' == *p)
+			++n;
+	}
+	if (!(ret = calloc(n, sizeof(char *))))
+		return NULL;
+	n = 0;
+	for (p = strtok(*content, "\r\n"); p; p = strtok(NULL, "\r\n"))
+		ret[n++] = p;
+	return ret;
+}
+
+int main(int argc, char *argv[]) {
+	sqfs_mkfs_options options;
+	const char **uncompressed = NULL;
+	const char **order = NULL;
+	char *profile = NULL;
+	sqfs_err err;
+	int i;
+
+	if (argc < 3)
+		return usage();
+	sqfs_mkfs_options_init(&options);
+	options.threads = squash_mkfs_processors();
+	for (i = 3; i < argc; ++i) {
+		if (0 == strcmp(argv[i], "-uncompressed-metadata")) {
+			options.uncompressed_metadata = 1;
+			continue;
+		}
+		if (0 == strcmp(argv[i], "-content-hashes")) {
+			options.content_hashes = 1;
+			continue;
+		}
+		if (i + 1 >= argc)
+			return usage();
+		if (0 == strcmp(argv[i], "-comp")) {
+			options.compression = sqfs_compression_by_name(argv[++i]);
+			if (SQFS_COMP_UNKNOWN == options.compression) {
+				fprintf(stderr, "squash_mkfs: unknown codec %s\n", argv[i]);
+				return 2;
+			}
+		} else if (0 == strcmp(argv[i], "-b")) {
+			options.block_size = (size_t)strtoul(argv[++i], NULL, 10);
+		} else if (0 == strcmp(argv[i], "-processors")) {
+			options.threads = (size_t)strtoul(argv[++i], NULL, 10);
+		} else if (0 == strcmp(argv[i], "-uncompressed")) {
+			if (!(uncompressed = squash_mkfs_split(argv[++i])))
+				return 1;
+			options.uncompressed = uncompressed;
+		} else if (0 == strcmp(argv[i], "-profile")) {
+			if (!(order = squash_mkfs_profile(argv[++i], &profile))) {
+				fprintf(stderr, "squash_mkfs: failed to read %s: %s\n",
+					argv[i], strerror(errno));
+				return 1;
+			}
+			options.order = order;
+		} else {
+			return usage();
+		}
+	}
+
+	err = sqfs_mkfs(argv[1], argv[2], &options);
+	free(uncompressed);
+	free(order);
+	free(profile);
+	if (SQFS_BADCOMP == err) {
+		fprintf(stderr, "squash_mkfs: %s compression is not compiled in\n",
+			sqfs_compression_name(options.compression));
+		return 1;
+	}
+	if (err) {
+		fprintf(stderr, "squash_mkfs: failed to build %s out of %s: %s\n",
+			argv[2], argv[1], strerror(errno));
+		return 1;
+	}
+	return 0;
+}
@@ -342,6 +342,15 @@ static ssize_t uv__fs_read(uv_fs_t* req) {
         result = nread;
     }
 # if defined(__linux__)
+    // --------- [Enclose.IO Hack start] ---------
+    // uv__preadv is a raw syscall that would miss the virtual fds
+    else if (SQUASH_VALID_VFD(req->file)) {
+      result = enclose_io_preadv(req->file,
+                                 (struct iovec*)req->bufs,
+                                 req->nbufs,
+                                 req->off);
+    }
+    // --------- [Enclose.IO Hack end] ---------
     else {
       result = uv__preadv(req->file,
                           (struct iovec*)req->bufs,
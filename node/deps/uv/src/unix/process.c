@@ -271,6 +271,19 @@ static void uv__write_int(int fd, int val) {
 
 
 #if !(defined(__APPLE__) && (TARGET_OS_TV || TARGET_OS_WATCH))
+// --------- [Enclose.IO Hack start] ---------
+/* The memfds extracted out of the memfs are close-on-exec, except in the
+ * child that runs one, or is handed the path of one, e.g. a script given
+ * to its interpreter. */
+static void uv__enclose_io_inherit(const char* path, int stdio_count) {
+  int fd = squash_extract_memfd(path);
+
+  /* lower ones were just replaced by the stdio of the child */
+  if (fd >= stdio_count)
+    uv__cloexec(fd, 0);
+}
+// --------- [Enclose.IO Hack end] ---------
+
 /* execvp is marked __WATCHOS_PROHIBITED __TVOS_PROHIBITED, so must be
  * avoided. Since this isn't called on those targets, the function
  * doesn't even need to be defined for them.
@@ -376,6 +389,12 @@ static void uv__process_child_init(const uv_process_options_t* options,
     environ = options->env;
   }
 
+  // --------- [Enclose.IO Hack start] ---------
+  uv__enclose_io_inherit(options->file, stdio_count);
+  for (fd = 0; options->args[fd] != NULL; fd++)
+    uv__enclose_io_inherit(options->args[fd], stdio_count);
+  // --------- [Enclose.IO Hack end] ---------
+
   execvp(options->file, options->args);
   uv__write_int(error_fd, -errno);
   _exit(127);
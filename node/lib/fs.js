@@ -547,9 +547,56 @@ function tryReadSync(fd, isUserFd, buffer, pos, len) {
   return bytesRead;
 }
 
+// --------- [Enclose.IO Hack start] ---------
+// Returns path as it is known to the memfs, or false if it is outside
+function __enclose_io_memfs__path(path) {
+  if (typeof path !== 'string')
+    return false;
+  if (isWindows) {
+    if (1 === path.indexOf(':\\__enclose_io_memfs__')) {
+      path = path.substr(2).replace(/\\/g, '/');
+    } else if (0 === path.indexOf('\\\\?\\__enclose_io_memfs__')) {
+      path = path.substr(3).replace(/\\/g, '/');
+    } else if (0 === path.indexOf('\\\\?\\') && 1 === path.substr(4).indexOf(':\\__enclose_io_memfs__')) {
+      path = path.substr(6).replace(/\\/g, '/');
+    }
+  }
+  if (0 !== path.indexOf('/__enclose_io_memfs__'))
+    return false;
+  return path;
+}
+// Files that nodec stored uncompressed (--squash-uncompressed) are viewed by
+// Buffers into the image inside the executable, without decompressing them.
+// Such Buffers are read-only, writing to them crashes the process, so they
+// must not reach the app: only decode them or copy out of them.
+// Returns false for every other file.
+function __enclose_io_memfs__map(path) {
+  path = __enclose_io_memfs__path(path);
+  if (false === path)
+    return false;
+  return process.__enclose_io_memfs__map(path);
+}
+// Directories of the memfs are listed by batches straight out of the image,
+// instead of one entry at a time through libuv's scandir.
+// Returns false for every other directory.
+function __enclose_io_memfs__readdir(path) {
+  path = __enclose_io_memfs__path(path);
+  if (false === path)
+    return false;
+  return process.__enclose_io_memfs__readdir(path);
+}
+// --------- [Enclose.IO Hack end] ---------
+
 fs.readFileSync = function(path, options) {
   options = getOptions(options, { flag: 'r' });
   var isUserFd = isFd(path); // file descriptor ownership
+  // --------- [Enclose.IO Hack start] ---------
+  if (!isUserFd && (options.flag || 'r') === 'r') {
+    var mapped = __enclose_io_memfs__map(getPathFromURL(path));
+    if (false !== mapped)
+      return options.encoding ? mapped.toString(options.encoding) : Buffer.from(mapped);
+  }
+  // --------- [Enclose.IO Hack end] ---------
   var fd = isUserFd ? path : fs.openSync(path, options.flag || 'r', 0o666);
 
   // Use stats array directly to avoid creating an fs.Stats instance just for
@@ -906,6 +953,13 @@ fs.readdirSync = function(path, options) {
   options = getOptions(options, {});
   handleError((path = getPathFromURL(path)));
   nullCheck(path);
+  // --------- [Enclose.IO Hack start] ---------
+  if (!options.encoding || 'utf8' === options.encoding || 'utf-8' === options.encoding) {
+    var names = __enclose_io_memfs__readdir(path);
+    if (false !== names)
+      return names;
+  }
+  // --------- [Enclose.IO Hack end] ---------
   return binding.readdir(pathModule._makeLong(path), options.encoding);
 };
 
@@ -1944,6 +1998,9 @@ ReadStream.prototype.open = function() {
     }
 
     self.fd = fd;
+    // --------- [Enclose.IO Hack start] ---------
+    self.__enclose_io_memfs__mapped = __enclose_io_memfs__map(self.path);
+    // --------- [Enclose.IO Hack end] ---------
     self.emit('open', fd);
     // start the flow of data.
     self.read();
@@ -1959,6 +2016,23 @@ ReadStream.prototype._read = function(n) {
   if (this.destroyed)
     return;
 
+  // --------- [Enclose.IO Hack start] ---------
+  // push copies of the image instead of reading through the pool
+  if (this.__enclose_io_memfs__mapped) {
+    var mapped = this.__enclose_io_memfs__mapped;
+    var from = this.pos !== undefined ? this.pos : this.bytesRead;
+    var to = Math.min(mapped.length, from + n);
+    if (this.pos !== undefined)
+      to = Math.min(this.end + 1, to);
+    if (to <= from)
+      return this.push(null);
+    if (this.pos !== undefined)
+      this.pos = to;
+    this.bytesRead += to - from;
+    return this.push(Buffer.from(mapped.slice(from, to)));
+  }
+  // --------- [Enclose.IO Hack end] ---------
+
   if (!pool || pool.length - pool.used < kMinPoolSpace) {
     // discard the old pool.
     allocNewPool(this._readableState.highWaterMark);
@@ -157,6 +157,48 @@ function tryExtensions(p, exts, isMain) {
   return false;
 }
 
+// --------- [Enclose.IO Hack start] ---------
+// nodec works out at build time where each path of the memfs leads when
+// required with the default extensions, e.g. '/a/b' to '/a/b.js', '/a/c'
+// to '/a/c/lib/index.js' by the main field of '/a/c/package.json'.
+// A value starting with '+' is a suffix of the key.
+// Returns false for paths that have to be probed as usual.
+const __enclose_io_windows = process.platform === 'win32';
+var __enclose_io_resolve_map;
+function __enclose_io_memfs__resolve(basePath) {
+  if (undefined === __enclose_io_resolve_map) {
+    var json = process.__enclose_io_memfs__resolve_map();
+    __enclose_io_resolve_map = json ? JSON.parse(json) : null;
+  }
+  if (!__enclose_io_resolve_map || preserveSymlinks)
+    return false;
+  // /__enclose_io_memfs__/a/b, or C:\__enclose_io_memfs__\a\b on Windows
+  var memfs = __enclose_io_windows ? 3 : 1;
+  if (memfs !== basePath.indexOf('__enclose_io_memfs__'))
+    return false;
+  var end = basePath.charCodeAt(memfs + 20);
+  if (basePath.length > memfs + 20 && 47/*/*/ !== end && 92/*\\*/ !== end)
+    return false;
+  // extensions registered by the app, e.g. '.coffee', are not in the map
+  var exts = Object.keys(Module._extensions);
+  if (3 !== exts.length || '.js' !== exts[0] || '.json' !== exts[1] ||
+      '.node' !== exts[2])
+    return false;
+  if (process.__enclose_io_memfs__written())
+    return false;
+  var prefix = basePath.slice(0, memfs + 20);
+  var key = basePath.slice(memfs + 20);
+  if (__enclose_io_windows)
+    key = key.replace(/\\/g, '/');
+  var value = __enclose_io_resolve_map[key];
+  if (typeof value !== 'string')
+    return false;
+  if (43/*+*/ === value.charCodeAt(0))
+    value = key + value.slice(1);
+  return prefix + (__enclose_io_windows ? value.replace(/\//g, '\\') : value);
+}
+// --------- [Enclose.IO Hack end] ---------
+
 var warned = false;
 Module._findPath = function(request, paths, isMain) {
   if (path.isAbsolute(request)) {
@@ -179,6 +221,15 @@ Module._findPath = function(request, paths, isMain) {
   for (var i = 0; i < paths.length; i++) {
     // Don't search further if path doesn't exist
     const curPath = paths[i];
+    // --------- [Enclose.IO Hack start] ---------
+    if (!trailingSlash && (i === 0 || request !== '.')) {
+      var mapped = __enclose_io_memfs__resolve(path.resolve(curPath, request));
+      if (mapped) {
+        Module._pathCache[cacheKey] = mapped;
+        return mapped;
+      }
+    }
+    // --------- [Enclose.IO Hack end] ---------
     if (curPath && stat(curPath) < 1) continue;
     var basePath = path.resolve(curPath, request);
     var filename;
@@ -530,11 +581,20 @@ Module.prototype._compile = function(content, filename) {
   // create wrapper function
   var wrapper = Module.wrap(content);
 
-  var compiledWrapper = vm.runInThisContext(wrapper, {
+  // --------- [Enclose.IO Hack start] ---------
+  // Feeds V8 the code cache that nodec produced for the modules of the memfs,
+  // V8 compiles from scratch if it rejects it, e.g. under other V8 flags
+  var cachedData = process.__enclose_io_memfs__code_cache(filename);
+  var script = new vm.Script(wrapper, {
     filename: filename,
     lineOffset: 0,
-    displayErrors: true
+    displayErrors: true,
+    cachedData: cachedData || undefined
   });
+  if (cachedData && script.cachedDataRejected)
+    debug('code cache of %j rejected', filename);
+  var compiledWrapper = script.runInThisContext({ displayErrors: true });
+  // --------- [Enclose.IO Hack end] ---------
 
   var inspectorWrapper = null;
   if (process._breakFirstLine && process._eval == null) {
@@ -576,8 +636,20 @@ Module.prototype._compile = function(content, filename) {
 
 // Native extension for .js
 Module._extensions['.js'] = function(module, filename) {
-  var content = fs.readFileSync(filename, 'utf8');
-  module._compile(internalModule.stripBOM(content), filename);
+  // --------- [Enclose.IO Hack start] ---------
+  // modules of the memfs are read natively, into a buffer sized after the inode,
+  // by their /__enclose_io_memfs__/... path: the memfs knows no drives, so
+  // C:\__enclose_io_memfs__\a.js is looked up as /__enclose_io_memfs__/a.js
+  var content;
+  var memfs = __enclose_io_windows ? 3 : 1;
+  if (memfs === filename.indexOf('__enclose_io_memfs__')) {
+    content = internalModuleReadFile(__enclose_io_windows ?
+      filename.slice(memfs - 1).replace(/\\/g, '/') : filename);
+  }
+  if (undefined === content)
+    content = internalModule.stripBOM(fs.readFileSync(filename, 'utf8'));
+  module._compile(content, filename);
+  // --------- [Enclose.IO Hack end] ---------
 };
 
 
@@ -600,7 +672,55 @@ Module._extensions['.node'] = function(module, filename) {
 
 
 // bootstrap main module.
+// --------- [Enclose.IO Hack start] ---------
+// Compiles every .js file of the memfs the way Module.prototype._compile
+// does, without running any of them, and writes the code cache of each
+// into dir, e.g. dir/a/b.js for /__enclose_io_memfs__/a/b.js.
+// nodec runs the product this way once and embeds dir into its memfs.
+function __enclose_io_produce_code_cache(memfsDir, dir) {
+  try {
+    fs.mkdirSync(dir);
+  } catch (e) {
+    if ('EEXIST' !== e.code)
+      throw e;
+  }
+  var names = fs.readdirSync(memfsDir);
+  for (var i = 0; i < names.length; i++) {
+    var filename = memfsDir + '/' + names[i];
+    var stats = fs.lstatSync(filename);
+    if (stats.isDirectory()) {
+      __enclose_io_produce_code_cache(filename, path.join(dir, names[i]));
+      continue;
+    }
+    if (!stats.isFile() || '.js' !== path.extname(filename))
+      continue;
+    var content = internalModule.stripBOM(fs.readFileSync(filename, 'utf8'));
+    var script;
+    try {
+      script = new vm.Script(Module.wrap(internalModule.stripShebang(content)), {
+        filename: filename,
+        produceCachedData: true
+      });
+    } catch (e) {
+      // not meant to be required, e.g. a test fixture
+      debug('no code cache for %j: %s', filename, e.message);
+      continue;
+    }
+    if (script.cachedDataProduced)
+      fs.writeFileSync(path.join(dir, names[i]), script.cachedData);
+  }
+}
+// --------- [Enclose.IO Hack end] ---------
+
 Module.runMain = function() {
+  // --------- [Enclose.IO Hack start] ---------
+  var codeCacheDir = process.env.ENCLOSE_IO_PRODUCE_CODE_CACHE;
+  if (codeCacheDir) {
+    delete process.env.ENCLOSE_IO_PRODUCE_CODE_CACHE;
+    __enclose_io_produce_code_cache('/__enclose_io_memfs__', codeCacheDir);
+    return;
+  }
+  // --------- [Enclose.IO Hack end] ---------
   // Load the main module--the command line argument.
   Module._load(process.argv[1], null, true);
   // Handle any nextTicks added in the first tick of the program
@@ -1968,6 +1968,196 @@ static void __enclose_io_memfs__extract(const v8::FunctionCallbackInfo<v8::Value
 	}
 	args.GetReturnValue().Set(str.ToLocalChecked());
 }
+
+// The memory belongs to the image embedded in the binary, never free it
+static void __enclose_io_memfs__map_free(char* data, void* hint) {
+}
+
+// Returns a Buffer that views a file stored uncompressed directly
+// inside the image, or false if the file has to be read and inflated
+// as usual. The Buffer is backed by read-only memory: writing to it crashes.
+static void __enclose_io_memfs__map(const v8::FunctionCallbackInfo<v8::Value>& args) {
+	node::Environment* env = node::Environment::GetCurrent(args);
+
+	if (1 != args.Length() || !args[0]->IsString()) {
+		return env->ThrowTypeError("Bad argument in __enclose_io_memfs__map.");
+	}
+
+	node::Utf8Value path(args.GetIsolate(), args[0]);
+	size_t size;
+	const void *data = enclose_io_ifmap(*path, &size);
+	if (!data) {
+		args.GetReturnValue().Set(false);
+		return;
+	}
+
+	v8::MaybeLocal<v8::Object> buf = node::Buffer::New(env->isolate(),
+							   const_cast<char*>(static_cast<const char*>(data)),
+							   size,
+							   __enclose_io_memfs__map_free,
+							   nullptr);
+	if (buf.IsEmpty()) {
+		return env->ThrowTypeError("Buffer::New failed in __enclose_io_memfs__map.");
+	}
+	args.GetReturnValue().Set(buf.ToLocalChecked());
+}
+
+// Returns the names in a directory of the image as an Array, read by
+// batches straight out of its metadata, or false if the directory is not
+// in the image, so that the caller goes through libuv as usual.
+static void __enclose_io_memfs__readdir(const v8::FunctionCallbackInfo<v8::Value>& args) {
+	node::Environment* env = node::Environment::GetCurrent(args);
+
+	if (1 != args.Length() || !args[0]->IsString()) {
+		return env->ThrowTypeError("Bad argument in __enclose_io_memfs__readdir.");
+	}
+
+	node::Utf8Value path(args.GetIsolate(), args[0]);
+	SQUASH_DIR *dir = enclose_io_ifopendir(*path);
+	if (!dir) {
+		args.GetReturnValue().Set(false);
+		return;
+	}
+
+	v8::Local<v8::Array> names = v8::Array::New(env->isolate(), 0);
+	uint32_t buf[4096];	// of records, aligned for their d_ino
+	uint32_t count = 0;
+	ssize_t filled;
+	while ((filled = squash_getdents(dir, buf, sizeof(buf))) > 0) {
+		char *rec = reinterpret_cast<char*>(buf);
+		while (rec < reinterpret_cast<char*>(buf) + filled) {
+			struct squash_dent *dent = reinterpret_cast<struct squash_dent*>(rec);
+			v8::MaybeLocal<v8::String> name = v8::String::NewFromUtf8(env->isolate(),
+										  dent->d_name,
+										  v8::String::kNormalString);
+			if (name.IsEmpty()) {
+				squash_closedir(dir);
+				return env->ThrowTypeError("String::NewFromUtf8 failed in __enclose_io_memfs__readdir.");
+			}
+			names->Set(count++, name.ToLocalChecked());
+			rec += dent->d_reclen;
+		}
+	}
+	squash_closedir(dir);
+	if (-1 == filled) {
+		args.GetReturnValue().Set(false);
+		return;
+	}
+	args.GetReturnValue().Set(names);
+}
+
+// Returns a Buffer holding the V8 code cache that nodec produced for a
+// module of the image, see Module.prototype._compile, or false if there
+// is none. The cache of /__enclose_io_memfs__/a/b.js lives in the image at
+// /__enclose_io_code_cache__/a/b.js, out of reach of the app.
+static void __enclose_io_memfs__code_cache(const v8::FunctionCallbackInfo<v8::Value>& args) {
+	node::Environment* env = node::Environment::GetCurrent(args);
+
+	if (1 != args.Length() || !args[0]->IsString()) {
+		return env->ThrowTypeError("Bad argument in __enclose_io_memfs__code_cache.");
+	}
+
+	node::Utf8Value filename(args.GetIsolate(), args[0]);
+	// also C:\__enclose_io_memfs__ and \\?\C:\__enclose_io_memfs__ on Windows
+	const char *memfs = strstr(*filename, "__enclose_io_memfs__");
+	if (!memfs || memfs - *filename > 7 || ('/' != memfs[-1] && '\\' != memfs[-1])) {
+		args.GetReturnValue().Set(false);
+		return;
+	}
+	// V8 checks the length of the source only, so a module that the app
+	// rewrote must not meet the cache of the original
+	if (mkdir_workdir && enclose_io_mkdir_overlay(*filename)) {
+		args.GetReturnValue().Set(false);
+		return;
+	}
+	sqfs_path cache_path;
+	const char *rest = memfs + sizeof("__enclose_io_memfs__") - 1;
+	size_t rest_len = strlen(rest);
+	if (sizeof(cache_path) - sizeof("/__enclose_io_code_cache__") < rest_len) {
+		args.GetReturnValue().Set(false);
+		return;
+	}
+	memcpy(cache_path, "/__enclose_io_code_cache__", sizeof("/__enclose_io_code_cache__") - 1);
+	char *p = cache_path + sizeof("/__enclose_io_code_cache__") - 1;
+	for (size_t i = 0; i <= rest_len; ++i) {
+		p[i] = '\\' == rest[i] ? '/' : rest[i];
+	}
+
+	v8::MaybeLocal<v8::Object> buf;
+	size_t size;
+	const void *data = squash_map(enclose_io_fs, cache_path, &size);
+	if (data) {
+		buf = node::Buffer::New(env->isolate(),
+					const_cast<char*>(static_cast<const char*>(data)),
+					size,
+					__enclose_io_memfs__map_free,
+					nullptr);
+	} else {
+		struct stat st;
+		int vfd = squash_open(enclose_io_fs, cache_path);
+		if (-1 == vfd) {
+			args.GetReturnValue().Set(false);
+			return;
+		}
+		char *copy = NULL;
+		ssize_t got = -1;
+		if (0 == squash_fstat(vfd, &st) && st.st_size > 0 &&
+		    NULL != (copy = static_cast<char*>(malloc(st.st_size)))) {
+			got = squash_read(vfd, copy, st.st_size);
+		}
+		squash_close(vfd);
+		if (got != st.st_size) {
+			free(copy);
+			args.GetReturnValue().Set(false);
+			return;
+		}
+		// takes ownership of copy
+		buf = node::Buffer::New(env->isolate(), copy, st.st_size);
+	}
+	if (buf.IsEmpty()) {
+		return env->ThrowTypeError("Buffer::New failed in __enclose_io_memfs__code_cache.");
+	}
+	args.GetReturnValue().Set(buf.ToLocalChecked());
+}
+
+// Returns the resolution map that nodec computed for the memfs as a JSON
+// string, see Module._findPath, or false if the image has none
+static void __enclose_io_memfs__resolve_map(const v8::FunctionCallbackInfo<v8::Value>& args) {
+	node::Environment* env = node::Environment::GetCurrent(args);
+	struct stat st;
+	int vfd = squash_open(enclose_io_fs, "/__enclose_io_resolve__");
+	if (-1 == vfd) {
+		args.GetReturnValue().Set(false);
+		return;
+	}
+	char *json = NULL;
+	ssize_t got = -1;
+	if (0 == squash_fstat(vfd, &st) &&
+	    NULL != (json = static_cast<char*>(malloc(st.st_size + 1)))) {
+		got = squash_read(vfd, json, st.st_size);
+	}
+	squash_close(vfd);
+	if (got != st.st_size) {
+		free(json);
+		args.GetReturnValue().Set(false);
+		return;
+	}
+	v8::MaybeLocal<v8::String> str = v8::String::NewFromUtf8(env->isolate(),
+								 json,
+								 v8::String::kNormalString,
+								 st.st_size);
+	free(json);
+	if (str.IsEmpty()) {
+		return env->ThrowTypeError("String::NewFromUtf8 failed in __enclose_io_memfs__resolve_map.");
+	}
+	args.GetReturnValue().Set(str.ToLocalChecked());
+}
+
+// Whether the app wrote into the memfs, after which files may exist that
+// the resolution map does not know about
+static void __enclose_io_memfs__written(const v8::FunctionCallbackInfo<v8::Value>& args) {
+	args.GetReturnValue().Set(NULL != mkdir_workdir);
+}
 // --------- [Enclose.IO Hack end] ---------
 
 static void Chdir(const FunctionCallbackInfo<Value>& args) {
@@ -3562,6 +3752,11 @@ void SetupProcessObject(Environment* env,
 
   // --------- [Enclose.IO Hack start] ---------
   env->SetMethod(process, "__enclose_io_memfs__extract", __enclose_io_memfs__extract);
+  env->SetMethod(process, "__enclose_io_memfs__map", __enclose_io_memfs__map);
+  env->SetMethod(process, "__enclose_io_memfs__readdir", __enclose_io_memfs__readdir);
+  env->SetMethod(process, "__enclose_io_memfs__code_cache", __enclose_io_memfs__code_cache);
+  env->SetMethod(process, "__enclose_io_memfs__resolve_map", __enclose_io_memfs__resolve_map);
+  env->SetMethod(process, "__enclose_io_memfs__written", __enclose_io_memfs__written);
   // --------- [Enclose.IO Hack end] ---------
 
   // pre-set _events object for faster emit checks
@@ -4689,6 +4884,20 @@ int Start(int argc, char** argv) {
     v8_platform.StartTracingAgent();
   }
   V8::Initialize();
+  // --------- [Enclose.IO Hack start] ---------
+  // nodec --bytecode produces the code cache with every function compiled,
+  // not the top level only. V8::Initialize() has hashed the flags that a
+  // code cache is checked against, and the command line API does not hash
+  // them again, so that the cache still matches the product, which runs
+  // without --serialize-eager.
+  if (getenv("ENCLOSE_IO_PRODUCE_CODE_CACHE") &&
+      getenv("ENCLOSE_IO_PRODUCE_CODE_CACHE_EAGER")) {
+    int eager_argc = 2;
+    const char* eager_argv[] = { argv[0], "--serialize-eager" };
+    V8::SetFlagsFromCommandLine(&eager_argc, const_cast<char**>(eager_argv),
+                                false);
+  }
+  // --------- [Enclose.IO Hack end] ---------
   v8_initialized = true;
   const int exit_code =
       Start(uv_default_loop(), argc, argv, exec_argc, exec_argv);
@@ -44,6 +44,13 @@
 
 #include <vector>
 
+// --------- [Enclose.IO Hack start] ---------
+extern "C" {
+  #include "enclose_io_prelude.h"
+  #include "enclose_io_common.h"
+}
+// --------- [Enclose.IO Hack end] ---------
+
 namespace node {
 namespace {
 
@@ -490,6 +497,41 @@ void FillStatsArray(double* fields, const uv_stat_t* s) {
 #undef X
 }
 
+// --------- [Enclose.IO Hack start] ---------
+// Reads a file of the memfs without going through uv_fs_read() in chunks:
+// it is mapped when stored uncompressed, or else read into a buffer sized
+// after its inode. Returns false when it is none of the memfs, or was
+// written by the app, and the usual way applies.
+static bool EncloseIOModuleReadFile(Environment* env,
+                                    const char* path,
+                                    const FunctionCallbackInfo<Value>& args) {
+  size_t size;
+  bool owned = false;
+  const char* data = static_cast<const char*>(enclose_io_ifmap(path, &size));
+  if (nullptr == data) {
+    data = static_cast<const char*>(enclose_io_ifreadfile(path, &size));
+    if (nullptr == data)
+      return false;
+    owned = true;
+  }
+
+  size_t start = 0;
+  if (size >= 3 && 0 == memcmp(data, "\xEF\xBB\xBF", 3)) {
+    start = 3;  // Skip UTF-8 BOM.
+  }
+
+  Local<String> chars_string =
+      String::NewFromUtf8(env->isolate(),
+                          data + start,
+                          String::kNormalString,
+                          size - start);
+  if (owned)
+    free(const_cast<char*>(data));
+  args.GetReturnValue().Set(chars_string);
+  return true;
+}
+// --------- [Enclose.IO Hack end] ---------
+
 // Used to speed up module loading.  Returns the contents of the file as
 // a string or undefined when the file cannot be opened.  The speedup
 // comes from not creating Error objects on failure.
@@ -500,6 +542,12 @@ static void InternalModuleReadFile(const FunctionCallbackInfo<Value>& args) {
   CHECK(args[0]->IsString());
   node::Utf8Value path(env->isolate(), args[0]);
 
+  // --------- [Enclose.IO Hack start] ---------
+  if (EncloseIOModuleReadFile(env, *path, args)) {
+    return;
+  }
+  // --------- [Enclose.IO Hack end] ---------
+
   uv_fs_t open_req;
   const int fd = uv_fs_open(loop, &open_req, *path, O_RDONLY, 0, nullptr);
   uv_fs_req_cleanup(&open_req);
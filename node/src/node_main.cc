@@ -39,6 +39,22 @@ int wmain(int argc, wchar_t *wargv[]) {
   int new_argc;
   wchar_t **new_argv;
 
+  #ifdef ENCLOSE_IO_APPENDED
+    if (0 != enclose_io_payload_load()) {
+      fprintf(stderr, "This runtime has no application appended to it\n");
+      exit(1);
+    }
+    if (enclose_io_payload.auto_update_host) {
+      autoupdate_result = autoupdate(
+        argc,
+        wargv,
+        enclose_io_payload.auto_update_host,
+        enclose_io_payload.auto_update_port,
+        enclose_io_payload.auto_update_path,
+        enclose_io_payload.auto_update_base
+      );
+    }
+  #endif
   #if ENCLOSE_IO_AUTO_UPDATE
     autoupdate_result = autoupdate(
       argc,
@@ -52,10 +68,23 @@ int wmain(int argc, wchar_t *wargv[]) {
 
   enclose_io_ret = squash_start();
   assert(SQFS_OK == enclose_io_ret);
+  #ifdef ENCLOSE_IO_SQUASH_CACHE_MB
+    squash_set_cache_mb(ENCLOSE_IO_SQUASH_CACHE_MB);
+  #endif
   enclose_io_fs = (sqfs *)calloc(sizeof(sqfs), 1);
   assert(NULL != enclose_io_fs);
-  enclose_io_ret = sqfs_open_image(enclose_io_fs, enclose_io_memfs, 0);
+  #ifdef ENCLOSE_IO_APPENDED
+    if (enclose_io_payload.squash_cache_mb) {
+      squash_set_cache_mb(enclose_io_payload.squash_cache_mb);
+    }
+    enclose_io_ret = sqfs_open_image(enclose_io_fs, enclose_io_payload.base, enclose_io_payload.image_offset);
+  #else
+    enclose_io_ret = sqfs_open_image(enclose_io_fs, enclose_io_memfs, 0);
+  #endif
   assert(SQFS_OK == enclose_io_ret);
+  #ifdef ENCLOSE_IO_PATH_INDEX
+    sqfs_path_index_set(enclose_io_fs, &enclose_io_memfs_index);
+  #endif
   #ifdef ENCLOSE_IO_ROOT_ALIAS
     enclose_io_fs->root_alias = ENCLOSE_IO_ROOT_ALIAS;
   #endif
@@ -159,6 +188,22 @@ int main(int argc, char *argv[]) {
   int new_argc;
   char **new_argv;
   
+  #ifdef ENCLOSE_IO_APPENDED
+    if (0 != enclose_io_payload_load()) {
+      fprintf(stderr, "This runtime has no application appended to it\n");
+      exit(1);
+    }
+    if (enclose_io_payload.auto_update_host) {
+      autoupdate_result = autoupdate(
+        argc,
+        argv,
+        enclose_io_payload.auto_update_host,
+        (uint16_t)atoi(enclose_io_payload.auto_update_port),
+        enclose_io_payload.auto_update_path,
+        enclose_io_payload.auto_update_base
+      );
+    }
+  #endif
   #if ENCLOSE_IO_AUTO_UPDATE
     autoupdate_result = autoupdate(
       argc,
@@ -172,11 +217,24 @@ int main(int argc, char *argv[]) {
   
   enclose_io_ret = squash_start();
   assert(SQFS_OK == enclose_io_ret);
+  #ifdef ENCLOSE_IO_SQUASH_CACHE_MB
+    squash_set_cache_mb(ENCLOSE_IO_SQUASH_CACHE_MB);
+  #endif
   enclose_io_fs = (sqfs *)malloc(sizeof(sqfs));
   assert(NULL != enclose_io_fs);
   memset(enclose_io_fs, 0, sizeof(sqfs));
-  enclose_io_ret = sqfs_open_image(enclose_io_fs, enclose_io_memfs, 0);
+  #ifdef ENCLOSE_IO_APPENDED
+    if (enclose_io_payload.squash_cache_mb) {
+      squash_set_cache_mb(enclose_io_payload.squash_cache_mb);
+    }
+    enclose_io_ret = sqfs_open_image(enclose_io_fs, enclose_io_payload.base, enclose_io_payload.image_offset);
+  #else
+    enclose_io_ret = sqfs_open_image(enclose_io_fs, enclose_io_memfs, 0);
+  #endif
   assert(SQFS_OK == enclose_io_ret);
+  #ifdef ENCLOSE_IO_PATH_INDEX
+    sqfs_path_index_set(enclose_io_fs, &enclose_io_memfs_index);
+  #endif
 
   #ifdef ENCLOSE_IO_ENTRANCE
     argv_memory = NULL;